@@ -24,6 +24,7 @@ along with this program.  If not, see <https://www.gnu.org/licenses/>.
 #include <fcntl.h>
 #include <stdio.h>
 #include <stdarg.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
@@ -85,7 +86,7 @@ static long hk_getline(char **lineptr, size_t *n, FILE *stream) {
 #else
 #include <sys/ioctl.h>
 #include <sys/types.h>
-#include <sys/select.h>
+#include <poll.h>
 #include <sys/stat.h>
 #include <sys/wait.h>
 #include <termios.h>
@@ -93,6 +94,7 @@ static long hk_getline(char **lineptr, size_t *n, FILE *stream) {
 #include <signal.h>
 #include <dirent.h>
 #include <limits.h>
+#include <sys/mman.h>
 #ifdef __APPLE__
 #include <mach-o/dyld.h>
 #endif
@@ -110,15 +112,27 @@ static long hk_getline(char **lineptr, size_t *n, FILE *stream) {
 #define TAB_STOP 8
 #define MAX_PANES 32
 #define PLUGIN_MAX 64
-#define AI_HISTORY_MAX 1000
+#define AI_HISTORY_MAX 20000
+#define AI_PROMPT_ROWS 5
 #define PASTE_BUFFER_MAX 65536
+#ifndef LARGE_FILE_MB
+#define LARGE_FILE_MB 64
+#endif
+#define ROPE_LEAF_MAX 128
+#define ROPE_FANOUT 32
 
 const char *HAKO_HELP_TEXT = 
 	"hako - A minimal text editor v" HAKO_VERSION "\n\n"
 	"Usage: hako [options] [file]\n\n"
 	"Options:\n"
-	"  -h, --help     Show this help message\n"
-	"  -v, --version  Show version information\n\n"
+	"  -h, --help            Show this help message\n"
+	"  -v, --version         Show version information\n"
+	"  --claw-replay FILE    Play a recorded hakoc transcript into Rei, then\n"
+	"                        print what rendering it cost and exit\n"
+	"  --replay-speed N      Replay time multiplier (default 1, 0 = no delays)\n"
+	"  --headless            Run without a terminal and print timings per phase\n"
+	"  --script FILE         Keys for --headless, in vim notation (<Esc>, <CR>)\n"
+	"  --size COLSxROWS      Screen size for --headless (default 80x24)\n\n"
 	"Commands:\n"
 	"  Normal Mode:\n"
 	"    i              Enter insert mode\n"
@@ -187,7 +201,8 @@ enum editorKey {
 	MOUSE_WHEEL_UP,
 	MOUSE_WHEEL_DOWN,
 	MOUSE_CLICK,
-	MOUSE_MOTION
+	MOUSE_MOTION,
+	PASTE_BEGIN	/* only seen inside editorReadKey */
 };
 
 enum editorHighlight {
@@ -212,6 +227,12 @@ enum editorHighlight {
 	HL_LABEL
 };
 
+enum undoOpType {
+	UNDO_CHANGE,
+	UNDO_INSERT,
+	UNDO_DELETE
+};
+
 enum paneType {
 	PANE_EDITOR,
 	PANE_EXPLORER,
@@ -255,17 +276,55 @@ enum splitDirection {
 };
 
 /*** struct declarations ***/
+struct ropeNode;
+
 typedef struct erow {
-	int idx;
+	struct ropeNode *leaf;
 	int size;
 	int rsize;
+	int cap;	/* bytes allocated for chars */
+	int rcap;	/* bytes allocated for render and for hl */
+	int mapped;	/* chars points into the file mapping, not NUL-terminated */
 	char *chars;
 	char *render;
 	unsigned char *hl;
-	int hl_open_comment;
+	int hl_open_comment;	/* block comment still open at end of row */
+	int hl_state_in;	/* comment state the row was highlighted from */
+	unsigned int hl_epoch;
+	int hl_queued;	/* a stale highlight chain may start here */
 	int indent;
+	unsigned int undo_seq;
 } erow;
 
+/* A large file mapped read-only; off[i] is where line i starts and
+ * off[n] is the end of the file. */
+typedef struct lineMap {
+	char *base;
+	size_t len;
+	size_t *off;
+	int n;
+} lineMap;
+
+/* B+tree of line chunks: leaves hold up to ROPE_LEAF_MAX rows, internal
+ * nodes up to ROPE_FANOUT children; `count` is the rows in the subtree.
+ * A leaf with no `rows` yet stands for mapped lines vline..vline+n-1. */
+typedef struct ropeNode {
+	struct ropeNode *parent;
+	int leaf;
+	int n;
+	int count;
+	int vline;
+	erow *rows;
+	struct ropeNode **kids;
+} ropeNode;
+
+typedef struct rowRope {
+	ropeNode *root;
+	ropeNode *hint;
+	int hint_start;
+	lineMap *map;
+} rowRope;
+
 struct abuf {
 	char *b;
 	int len;
@@ -276,25 +335,74 @@ typedef struct {
 	int r, g, b;
 } Color;
 
+/* 8 bytes with no hidden padding (gridFlush compares with memcmp). `glyph`
+ * holds the character's UTF-8 bytes packed first byte lowest, 0 for blank;
+ * fg and bg index E.palette. */
 typedef struct {
-	char ch[5];
-	Color fg;
-	Color bg;
+	unsigned int glyph;
+	unsigned char fg, bg;
 	signed char width;
+	char pad;
 } Cell;
 
+/* A color seen by the grid, with its escape sequences built once. */
+typedef struct paletteEntry {
+	Color color;
+	char fg[24], bg[24];
+	unsigned char fg_len, bg_len;
+} paletteEntry;
+
+#define GRID_PALETTE_MAX 256
+#define GRID_PALETTE_HASH 1024
+
+/* A band of screen rows whose content moved up by k (down if k < 0). */
+typedef struct gridScroll {
+	int x, y, w, h;
+	int k;
+} gridScroll;
+
+#define GRID_SCROLL_MAX 8
+
+/* one journal entry: row `at` was changed (chars = old text), inserted, or
+ * deleted (chars = removed text). A group is undone by applying the inverse
+ * of its ops in reverse order. */
+typedef struct undoOp {
+	enum undoOpType type;
+	int at;
+	char *chars;
+	int size;
+} undoOp;
+
 typedef struct undoState {
-	erow *rows;
-	int numrows;
+	undoOp *ops;
+	int numops;
+	int opscap;
+	unsigned int seq;
 	int cx, cy;
-	char *filename;
-	char *yank_buffer;
-	int yank_buffer_len;
 	struct undoState *next;
 	time_t timestamp;
-	enum editorMode mode;
 } undoState;
 
+/* Background reader behind editorOpen. The thread only reads and splits
+ * lines into `lines`; the UI thread moves them into the pane, so the rope
+ * is never touched off the main thread. */
+typedef struct fileLoader {
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	FILE *fp;
+	long long total;
+	long long bytes;
+	char **lines;
+	int *lens;
+	int nlines, cap;
+	int loaded_rows;	/* row the next loaded line goes in at */
+	int threaded;
+	int finished;
+	int error;
+	int cancel;
+} fileLoader;
+
 typedef struct explorerData {
 	char *current_dir;
 	char **entries;
@@ -333,11 +441,35 @@ typedef struct pluginData {
 #define HK_ROLE_USER   1
 #define HK_ROLE_AI     2
 
+/* One logical line of Rei history: a message split at '\n', never at a
+ * width. wrap_off caches where each screen row after the first starts
+ * when wrapped at wrap_w columns. */
+typedef struct aiLine {
+	char *text;
+	int len, cap;
+	unsigned char role;
+	int wrap_w;
+	int wrap_rows;
+	int *wrap_off;
+	int wrap_cap;
+} aiLine;
+
+/* Timings of one finished Rei turn, in ms from sending the prompt. */
+typedef struct aiTurnPerf {
+	int first_ms;
+	int done_ms;
+	int events;
+	long long bytes;
+} aiTurnPerf;
+
 typedef struct aiData {
 	/* display state (owned by hako, hakoc manages the API conversation) */
-	char **history;
-	unsigned char *history_role;
+	aiLine *history;	/* ring of history_cap lines starting at history_head */
+	int history_cap;
+	int history_head;
 	int history_count;
+	int wrap_w;		/* width the history is wrapped to */
+	int wrap_rows;		/* screen rows of all lines at wrap_w */
 	int history_pos;
 	int scroll_offset;
 	int spinner_frame;
@@ -355,18 +487,49 @@ typedef struct aiData {
 	char *current_response;
 	int active;
 	int streaming;
-	pthread_mutex_t lock;
-	/* live-streaming slot: index into history[] being updated as tokens arrive */
+	/* live-streaming slot: first history line of the reply being streamed */
 	int stream_slot;
-	char *stream_acc;        /* accumulated raw token text */
-	size_t stream_acc_len;
 	/* token usage (received from hakoc "done" events) */
 	int last_in_tokens;
 	int last_out_tokens;
 	long total_in_tokens;
 	long total_out_tokens;
+	/* latency numbers for /perf; perf_start_ms is the editorNowMs() the
+	 * prompt went out at, 0 when no turn is in flight */
+	long long perf_start_ms;
+	long long perf_first_ms;
+	int perf_events;
+	long long perf_bytes;
+	aiTurnPerf perf_last;
+	int perf_turns;
+	long long perf_sum_first;
+	long long perf_sum_done;
+	char provider[64];
+	char model[64];
 } aiData;
 
+/* The document behind an editor pane. Splits of the same file share one
+ * buffer, so everything here is per file; cursor and scroll stay on the
+ * pane. `refs` counts the panes pointing at it. */
+typedef struct editorBuffer {
+	int refs;
+	int numrows;
+	rowRope rows;
+	char *filename;
+	int dirty;
+	struct editorSyntax *syntax;
+	unsigned int hl_epoch;
+	int hl_first;	/* no row above this is hl_queued; INT_MAX if none is */
+
+	fileLoader *loader;
+
+	undoState *undo_stack;
+	undoState *redo_stack;
+	int undo_stack_size;
+	int redo_stack_size;
+	int undo_open;
+} editorBuffer;
+
 typedef struct editorPane {
 	enum paneType type;
 	int id;
@@ -377,20 +540,12 @@ typedef struct editorPane {
 	int cx, cy;
 	int rx;
 	int rowoff, coloff;
+	int rowoff_wrap;
 	
-	int numrows;
-	erow *row;
-	char *filename;
-	int dirty;
-	struct editorSyntax *syntax;
+	editorBuffer *buf;
 	
 	int visual_anchor_x, visual_anchor_y;
 	
-	undoState *undo_stack;
-	undoState *redo_stack;
-	int undo_stack_size;
-	int redo_stack_size;
-	
 	explorerData *explorer;
 	pluginData *plugin;
 	aiData *ai;
@@ -406,6 +561,9 @@ typedef struct editorPane {
 	
 	int is_focused;
 	int wrap_lines;
+
+	editorBuffer *drawn_buf;	/* view at the last draw, for scroll hints */
+	int drawn_rowoff, drawn_wrap, drawn_coloff;
 } editorPane;
 
 typedef struct {
@@ -452,8 +610,20 @@ typedef struct {
 	int last_match_col;
 	int direction;
 	int wrap_search;
+	int highlight;	/* paint matches of `query` while drawing */
 } SearchState;
 
+/* A bracketed paste being streamed into the buffer. `hold` carries bytes
+ * that may be the start of the closing ESC[201~, or a \r whose \n is in
+ * the next read, over to the next chunk. */
+typedef struct pasteStream {
+	int active;
+	int idle;	/* empty reads in a row */
+	long long bytes;
+	char hold[8];
+	int held;
+} pasteStream;
+
 typedef struct pasteBuffer {
 	char *data;
 	int len;
@@ -470,6 +640,8 @@ struct editorConfig {
 #else
 	struct termios orig_termios;
 #endif
+	int headless;	/* --headless: no tty, keys come from a script */
+	int headless_rows, headless_cols;
 	
 	int tab_stop;
 	int use_tabs;
@@ -478,6 +650,10 @@ struct editorConfig {
 	int show_line_numbers;
 	int line_number_width;
 	int max_undo_levels;
+	int large_file_mb;
+	int loading;	/* panes with a fileLoader still running */
+	unsigned int undo_seq;
+	int undo_suspended;
 	
 	char statusmsg[256];
 	time_t statusmsg_time;
@@ -498,10 +674,21 @@ struct editorConfig {
 	int splash_active;
 	int splash_dismissed;
 	int full_redraw_pending;
+	int frame_rei_only;	/* only Rei output arrived since the last frame */
 
 	Cell *grid_front;
 	Cell *grid_back;
+	unsigned char *grid_dirty;	/* grid_back row changed since the last flush */
+	unsigned char *grid_painted;	/* grid_back cell written this frame */
+	int *grid_row_painted;		/* cells of the row written this frame */
+	paletteEntry palette[GRID_PALETTE_MAX];
+	int palette_n;
+	int palette_full;	/* a color found no room since the last reset */
+	unsigned short palette_hash[GRID_PALETTE_HASH];	/* index + 1, 0 = empty */
+	gridScroll grid_scroll[GRID_SCROLL_MAX];
+	int grid_scroll_n;
 	int grid_w, grid_h;
+	struct abuf outbuf;	/* frame being built; kept across refreshes */
 
 	char *explorer_name;
 	char *explorer_kanji;
@@ -520,6 +707,7 @@ struct editorConfig {
 	Theme theme;
 	
 	int is_pasting;
+	pasteStream paste_stream;
 	int paste_indent_level;
 	
 	int mouse_enabled;
@@ -529,6 +717,7 @@ struct editorConfig {
 	pluginData *plugins[PLUGIN_MAX];
 	int plugin_count;
 	char *plugin_dir;
+	char *rei_perf_csv;	/* append a row per Rei turn here, NULL = off */
 	pluginAPI plugin_api;
 	
 	/* hakoc session info (received from hakoc "init" / "done" events) */
@@ -541,6 +730,9 @@ struct editorConfig {
 	int indent_guides;
 	int scroll_speed;
 	int relative_line_numbers;
+	int max_fps;	/* frames per second cap while keys are arriving, 0 = none */
+	int escape_timeout;	/* ms to wait for the rest of an escape sequence */
+	long long last_frame_ms;
 
 	char *config_path;
 
@@ -585,10 +777,23 @@ char *editorPrompt(char *prompt, void (*callback)(char *, int));
 void editorMoveCursor(int key);
 void editorSave(void);
 void editorOpen(char *filename);
+void editorLoaderPollAll(void);
+void editorLoaderWait(editorPane *pane, int ms);
+void editorLoaderStop(editorPane *pane);
+int editorLoaderPercent(editorPane *pane);
 void editorInsertRow(int at, char *s, size_t len);
 void editorDelRow(int at);
 void editorUpdateRow(erow *row);
+void editorRowRender(erow *row);
+static void editorRowReserveRender(erow *row, int need);
+static void editorRowDropRender(erow *row);
+erow *editorRow(editorPane *pane, int at);
+int editorRowIndex(erow *row);
+void ropeFree(rowRope *r);
+int ropeLoadMapped(rowRope *r, lineMap *map);
+void editorFreeRows(editorPane *pane);
 void editorFreeRow(erow *row);
+void editorRowOwn(erow *row);
 void editorRowInsertChar(erow *row, int at, int c);
 void editorRowAppendString(erow *row, char *s, size_t len);
 void editorRowDelChar(erow *row, int at);
@@ -606,16 +811,28 @@ void editorRedo(void);
 void editorYankVisualSelection(void);
 void editorDeleteVisualSelection(void);
 void editorGetVisualSelection(int *start_x, int *start_y, int *end_x, int *end_y);
+void editorInsertText(const char *text, size_t len);
 void editorHandlePaste(const char *text, int len);
 void editorScroll(void);
+int editorWrapWidth(editorPane *pane);
+int editorWrapLines(erow *row, int wrap_width);
+int editorWrapStep(editorPane *pane, int *y, int *sub, int n);
+int editorWrapOffset(editorPane *pane, int y, int sub, int limit);
+int editorWrapDistance(editorPane *pane, int y0, int sub0, int y1, int sub1, int limit);
 void editorDrawRows(struct abuf *ab);
 void editorDrawStatusBar(struct abuf *ab);
 void editorDrawMessageBar(struct abuf *ab);
 void editorDrawSplash(void);
 void editorProcessKeyPress(void);
 int editorInputPending(void);
+int editorWaitInput(int ms);
+int editorWaitEvent(int ms);
+void editorWake(void);
+void editorProcessInput(void);
 void editorLoadConfig(void);
 void editorUpdateSyntax(erow *row);
+void editorSyntaxInvalidate(editorPane *pane);
+void editorSyntaxFlush(editorPane *pane, int upto);
 void editorSelectSyntaxHighlight(void);
 char *editorRowsToString(int *buflen);
 int editorGetIndent(erow *row);
@@ -637,12 +854,26 @@ void hkClampCursor(editorPane *pane);
 static char *clawFindBinary(void);
 static int clawLaunch(aiData *data);
 static void clawShutdown(void);
-static void clawSendLine(const char *json);
-static void clawHandleEvent(aiData *data, const char *line);
+static void clawSend(const char *type, const char *key, const char *text);
+static void clawFlush(void);
+static int clawWriteFd(void);
+static int clawQueued(void);
+static int clawHandleEvent(aiData *data, char *line);
 static void *clawReaderThread(void *arg);
+void clawPollEvents(void);
+static int clawReplayLoad(const char *path, double speed);
+static void clawReplayFrame(long long start_us, size_t bytes);
+static int clawReplayPending(void);
+static aiLine *aiLineAt(aiData *data, int i);
+static void aiHistoryTruncate(aiData *data, int n);
+static void aiReflow(aiData *data, int width);
 void aiWorkerSend(aiData *data);
 int hkHandleSlash(aiData *data, const char *prompt);
 
+editorBuffer *editorBufferNew(void);
+void editorReleaseBuffer(editorPane *pane);
+void editorDetachBuffer(editorPane *pane);
+void editorClampView(editorPane *pane);
 editorPane *editorCreatePane(enum paneType type, int x, int y, int width, int height);
 void editorFreePane(editorPane *pane);
 editorPane *editorGetActivePane(void);
@@ -655,9 +886,13 @@ void editorCollectLeafPanes(editorPane *root, editorPane ***panes, int *count);
 editorPane *editorFindPaneById(editorPane *root, int id);
 void editorDrawPane(editorPane *pane, struct abuf *ab);
 
-undoState *editorCreateUndoState(void);
 void editorFreeUndoState(undoState *state);
-void editorRestoreState(undoState *state);
+void editorClearUndo(editorPane *pane);
+void undoRecordChange(erow *row);
+void undoRecordInsert(editorPane *pane, int at);
+void undoRecordDelete(editorPane *pane, int at);
+void editorRowTruncate(erow *row, int len);
+void editorRowDelRange(erow *row, int at, int len);
 
 void explorerInit(editorPane *pane);
 void explorerRefresh(editorPane *pane);
@@ -683,13 +918,18 @@ void initEditor(void);
 void abAppend(struct abuf *ab, const char *s, int len);
 void abFree(struct abuf *ab);
 void gridResize(int w, int h);
+void gridScrollHint(int x, int y, int w, int h, int k);
 void gridFree(void);
-void gridClear(Color bg);
+void gridBeginFrame(void);
+void gridEndFrame(Color bg);
 void gridInvalidateFront(void);
 int gridPutStr(int x, int y, const char *s, int max_cols, Color fg, Color bg);
 int gridPutCh(int x, int y, char c, Color fg, Color bg);
 void gridFlush(struct abuf *out);
 int is_separator(int c);
+void gridPaletteReset(void);
+static int colorFgSGR(char *buf, size_t size, Color color);
+static int colorBgSGR(char *buf, size_t size, Color color);
 void setThemeColor(struct abuf *ab, Color color);
 void setThemeBgColor(struct abuf *ab, Color color);
 int editorSyntaxToColor(int hl);
@@ -700,6 +940,8 @@ void detectTerminalType(void);
 void enableRawMode(void);
 int getWindowSize(int *rows, int *cols);
 void die(const char *s);
+void editorHeadlessReport(void);
+static long long editorNowUs(void);
 int getDisplayWidth(const char *str, int len, int col);
 int getCharWidth(char c, int col);
 int utf8_byte_length(unsigned char c);
@@ -1152,7 +1394,7 @@ char *TOML_HL_keywords[] = {
 char *HAKO_HL_extensions[] = {".hakorc", "hakorc", NULL};
 char *HAKO_HL_keywords[] = {
 	"tab_stop", "use_tabs", "word_wrap", "word_wrap_column",
-	"show_line_numbers", "max_undo_levels", "explorer_enabled",
+	"show_line_numbers", "max_undo_levels", "large_file_mb", "explorer_enabled",
 	"explorer_width", "explorer_show_hidden", "show_splash", "mode",
 	"theme", "theme_dark", "theme_light", "theme_solarized", "theme_gruvbox",
 	"theme_monokai", "theme_nord", "theme_dracula",
@@ -1161,7 +1403,8 @@ char *HAKO_HL_keywords[] = {
 	"theme_preprocessor", "theme_function", "theme_type", "theme_operator",
 	"theme_bracket", "theme_line_number", "theme_status_bg", "theme_status_fg",
 	"theme_border", "theme_visual_bg", "theme_visual_fg",
-	"auto_indent", "smart_indent", "mouse_enabled", "scroll_speed",
+	"auto_indent", "smart_indent", "mouse_enabled", "scroll_speed", "max_fps",
+	"escape_timeout", "rei_perf_csv",
 	"relative_numbers", "plugin_dir", "true", "false", "normal", "insert", "1", "0", NULL
 };
 
@@ -1221,6 +1464,7 @@ static HANDLE hStdin, hStdout;
 static DWORD w32_orig_in, w32_orig_out;
 
 void disableRawMode() {
+	if (E.headless) { editorHeadlessReport(); return; }
 	SetConsoleMode(hStdin, w32_orig_in);
 	SetConsoleMode(hStdout, w32_orig_out);
 	write(STDOUT_FILENO, "\x1b[?2004l", 8);
@@ -1261,6 +1505,7 @@ void enableRawMode() {
 }
 
 int getWindowSize(int *rows, int *cols) {
+	if (E.headless) { *rows = E.headless_rows; *cols = E.headless_cols; return 0; }
 	CONSOLE_SCREEN_BUFFER_INFO csbi;
 	if (!GetConsoleScreenBufferInfo(hStdout, &csbi)) return -1;
 	*cols = csbi.srWindow.Right - csbi.srWindow.Left + 1;
@@ -1269,11 +1514,25 @@ int getWindowSize(int *rows, int *cols) {
 }
 
 int editorInputPending() {
+	if (E.headless) return 0;
 	DWORD events = 0;
 	GetNumberOfConsoleInputEvents(hStdin, &events);
 	return events > 1;
 }
 
+int editorWaitInput(int ms) {
+	if (E.headless) return 0;
+	return WaitForSingleObject(hStdin, ms < 0 ? INFINITE : (DWORD)ms) == WAIT_OBJECT_0;
+}
+
+/* no reader threads to wake on Windows; timers still apply */
+void editorWake(void) {
+}
+
+int editorWaitEvent(int ms) {
+	return editorWaitInput(ms);
+}
+
 #endif
 
 void die(const char *s) {
@@ -1316,12 +1575,34 @@ void detectTerminalType() {
 #ifndef _WIN32
 volatile sig_atomic_t winch_received = 0;
 
+/* Self-pipe: a byte here wakes editorWaitEvent. Written from signal
+ * handlers and from the claw reader and loader threads. */
+static int wake_pipe[2] = {-1, -1};
+
+void editorWake(void) {
+	if (wake_pipe[1] < 0) return;
+	char c = 0;
+	ssize_t w = write(wake_pipe[1], &c, 1);
+	(void)w;
+}
+
+static void editorInitWake(void) {
+	if (pipe(wake_pipe) == -1) die("pipe");
+	for (int i = 0; i < 2; i++) {
+		fcntl(wake_pipe[i], F_SETFL, fcntl(wake_pipe[i], F_GETFL) | O_NONBLOCK);
+		fcntl(wake_pipe[i], F_SETFD, FD_CLOEXEC);
+	}
+}
+
 static void on_sigwinch(int signo) {
 	(void)signo;
 	winch_received = 1;
+	editorWake();
 }
 
+/* Headless runs never took the tty; leaving means printing the report. */
 void disableRawMode() {
+	if (E.headless) { editorHeadlessReport(); return; }
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &E.orig_termios) == -1) die("tcsetattr");
 	
 	write(STDOUT_FILENO, "\x1b[?2004l", 8);
@@ -1347,7 +1628,7 @@ void enableRawMode() {
 	raw.c_cflag |= CS8;
 	raw.c_lflag &= ~(ECHO | ICANON | IEXTEN | ISIG);
 	raw.c_cc[VMIN] = 0;
-	raw.c_cc[VTIME] = 1;
+	raw.c_cc[VTIME] = 0;	/* reads never block; editorWaitInput does the waiting */
 
 	if (tcsetattr(STDIN_FILENO, TCSAFLUSH, &raw) == -1) die("tcsetattr");
 
@@ -1368,6 +1649,12 @@ void enableRawMode() {
 int getWindowSize(int *rows, int *cols) {
 	struct winsize ws;
 
+	if (E.headless) {
+		*rows = E.headless_rows;
+		*cols = E.headless_cols;
+		return 0;
+	}
+
 	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == -1 || ws.ws_col == 0) {
 		if (write(STDOUT_FILENO, "\x1b[999C\x1b[999B", 12) != 12) return -1;
 		return -1;
@@ -1379,11 +1666,34 @@ int getWindowSize(int *rows, int *cols) {
 }
 
 int editorInputPending() {
-	fd_set fds;
-	struct timeval tv = {0, 0};
-	FD_ZERO(&fds);
-	FD_SET(STDIN_FILENO, &fds);
-	return select(STDIN_FILENO + 1, &fds, NULL, NULL, &tv) > 0;
+	return editorWaitInput(0);
+}
+
+/* 1 once stdin is readable, 0 on timeout or a signal (e.g. SIGWINCH).
+ * ms < 0 waits for as long as it takes. */
+int editorWaitInput(int ms) {
+	if (E.headless) return 0;	/* scripted keys are fed one per frame */
+	struct pollfd pfd = { STDIN_FILENO, POLLIN, 0 };
+	return poll(&pfd, 1, ms) > 0;
+}
+
+/* The main loop's only blocking point: waits for stdin, an editorWake
+ * (SIGWINCH, Rei output, a finished load), room in the pipe to hakoc
+ * while a prompt is still queued, or ms running out. Returns 1 when
+ * stdin is readable. poll skips the entries whose fd is -1. */
+int editorWaitEvent(int ms) {
+	struct pollfd pfd[3] = {
+		{ E.headless ? -1 : STDIN_FILENO, POLLIN, 0 },
+		{ wake_pipe[0], POLLIN, 0 },
+		{ clawWriteFd(), POLLOUT, 0 },
+	};
+	if (poll(pfd, 3, ms) <= 0) return 0;
+	if (pfd[1].revents & POLLIN) {
+		char drain[64];
+		while (read(wake_pipe[0], drain, sizeof(drain)) > 0);
+	}
+	if (pfd[2].revents) clawFlush();
+	return (pfd[0].revents & (POLLIN | POLLHUP)) != 0;
 }
 
 #endif
@@ -1408,8 +1718,56 @@ void abFree(struct abuf *ab) {
 }
 
 /*** cell grid (diff-render) ***/
-static int gridColorEq(Color a, Color b) {
-	return a.r == b.r && a.g == b.g && a.b == b.b;
+static unsigned char gridColorIndex(Color c);
+
+/* Cells built under the old palette keep their indices, so callers must
+ * invalidate the front grid as well (a theme change already does). The
+ * theme and syntax colors are interned up front, so only colors from
+ * elsewhere can fill the table. */
+void gridPaletteReset(void) {
+	E.palette_n = 0;
+	E.palette_full = 0;
+	memset(E.palette_hash, 0, sizeof(E.palette_hash));
+
+	Color *theme = (Color *)&E.theme;
+	for (size_t i = 0; i < sizeof(E.theme) / sizeof(Color); i++)
+		gridColorIndex(theme[i]);
+	for (int hl = HL_NORMAL; hl <= HL_LABEL; hl++)
+		gridColorIndex(editorSyntaxToRGB(hl));
+}
+
+/* Interns a color, building its SGR sequences the first time it is seen.
+ * A color that finds the palette full gets the nearest entry for now and
+ * sets palette_full, and editorRefreshScreen draws the frame again from a
+ * fresh palette. */
+static unsigned char gridColorIndex(Color c) {
+	unsigned int key = ((unsigned)c.r & 0xFF) << 16 | ((unsigned)c.g & 0xFF) << 8 | ((unsigned)c.b & 0xFF);
+	unsigned int h = (key * 2654435761u) >> 22;
+	while (E.palette_hash[h]) {
+		paletteEntry *p = &E.palette[E.palette_hash[h] - 1];
+		if (p->color.r == c.r && p->color.g == c.g && p->color.b == c.b)
+			return E.palette_hash[h] - 1;
+		h = (h + 1) & (GRID_PALETTE_HASH - 1);
+	}
+
+	if (E.palette_n == GRID_PALETTE_MAX) {
+		E.palette_full = 1;
+		int best = 0;
+		long best_d = -1;
+		for (int i = 0; i < E.palette_n; i++) {
+			Color p = E.palette[i].color;
+			long d = (long)(p.r - c.r) * (p.r - c.r) + (long)(p.g - c.g) * (p.g - c.g) + (long)(p.b - c.b) * (p.b - c.b);
+			if (best_d < 0 || d < best_d) { best = i; best_d = d; }
+		}
+		return best;
+	}
+
+	paletteEntry *p = &E.palette[E.palette_n];
+	p->color = c;
+	p->fg_len = colorFgSGR(p->fg, sizeof(p->fg), c);
+	p->bg_len = colorBgSGR(p->bg, sizeof(p->bg), c);
+	E.palette_hash[h] = ++E.palette_n;
+	return E.palette_n - 1;
 }
 
 void gridResize(int w, int h) {
@@ -1420,23 +1778,40 @@ void gridResize(int w, int h) {
 	if (w == E.grid_w && h == E.grid_h && E.grid_front && E.grid_back) return;
 	free(E.grid_front);
 	free(E.grid_back);
+	free(E.grid_dirty);
+	free(E.grid_painted);
+	free(E.grid_row_painted);
 	E.grid_w = w;
 	E.grid_h = h;
 	size_t n = (size_t)w * (size_t)h;
 	E.grid_front = calloc(n, sizeof(Cell));
 	E.grid_back = calloc(n, sizeof(Cell));
-	if (!E.grid_front || !E.grid_back) {
-		free(E.grid_front); free(E.grid_back);
+	E.grid_dirty = malloc(h);
+	E.grid_painted = calloc(n, 1);
+	E.grid_row_painted = calloc(h, sizeof(int));
+	if (!E.grid_front || !E.grid_back || !E.grid_dirty || !E.grid_painted || !E.grid_row_painted) {
+		free(E.grid_front); free(E.grid_back); free(E.grid_dirty);
+		free(E.grid_painted); free(E.grid_row_painted);
 		E.grid_front = E.grid_back = NULL;
+		E.grid_dirty = E.grid_painted = NULL;
+		E.grid_row_painted = NULL;
 		E.grid_w = E.grid_h = 0;
+		return;
 	}
+	memset(E.grid_dirty, 1, h);
 }
 
 void gridFree(void) {
 	free(E.grid_front);
 	free(E.grid_back);
+	free(E.grid_dirty);
+	free(E.grid_painted);
+	free(E.grid_row_painted);
 	E.grid_front = NULL;
 	E.grid_back = NULL;
+	E.grid_dirty = NULL;
+	E.grid_painted = NULL;
+	E.grid_row_painted = NULL;
 	E.grid_w = 0;
 	E.grid_h = 0;
 }
@@ -1444,43 +1819,76 @@ void gridFree(void) {
 void gridInvalidateFront(void) {
 	if (E.grid_front && E.grid_w > 0 && E.grid_h > 0) {
 		memset(E.grid_front, 0, (size_t)E.grid_w * E.grid_h * sizeof(Cell));
+		memset(E.grid_dirty, 1, E.grid_h);
 	}
 }
 
-void gridClear(Color bg) {
+/* A frame paints over grid_back without clearing it first. gridSetCell
+ * notes each cell it writes and gridEndFrame blanks only the cells that
+ * nothing painted, so a row is dirty only when a cell really changed and
+ * rows that came out as before stay clean. */
+void gridBeginFrame(void) {
 	if (!E.grid_back) return;
-	int n = E.grid_w * E.grid_h;
-	for (int i = 0; i < n; i++) {
-		Cell *c = &E.grid_back[i];
-		c->ch[0] = ' ';
-		c->ch[1] = 0;
-		c->ch[2] = 0;
-		c->ch[3] = 0;
-		c->ch[4] = 0;
-		c->fg = E.theme.fg;
-		c->bg = bg;
-		c->width = 1;
+	memset(E.grid_painted, 0, (size_t)E.grid_w * E.grid_h);
+	memset(E.grid_row_painted, 0, sizeof(int) * E.grid_h);
+}
+
+void gridEndFrame(Color bg) {
+	if (!E.grid_back) return;
+	Cell c;
+	memset(&c, 0, sizeof(c));
+	c.glyph = ' ';
+	c.fg = gridColorIndex(E.theme.fg);
+	c.bg = gridColorIndex(bg);
+	c.width = 1;
+
+	for (int y = 0; y < E.grid_h; y++) {
+		if (E.grid_row_painted[y] == E.grid_w) continue;
+		Cell *r = &E.grid_back[y * E.grid_w];
+		unsigned char *painted = &E.grid_painted[y * E.grid_w];
+		for (int x = 0; x < E.grid_w; x++) {
+			if (painted[x] || memcmp(&r[x], &c, sizeof(c)) == 0) continue;
+			r[x] = c;
+			E.grid_dirty[y] = 1;
+		}
 	}
 }
 
+static void gridMarkPainted(int x, int y) {
+	unsigned char *p = &E.grid_painted[y * E.grid_w + x];
+	if (*p) return;
+	*p = 1;
+	E.grid_row_painted[y]++;
+}
+
 static void gridSetCell(int x, int y, const char *utf8, int byte_len, int width, Color fg, Color bg) {
 	if (!E.grid_back) return;
 	if (x < 0 || y < 0 || x >= E.grid_w || y >= E.grid_h) return;
 	if (byte_len < 0) byte_len = 0;
 	if (byte_len > 4) byte_len = 4;
+	Cell n;
+	memset(&n, 0, sizeof(n));
+	for (int i = byte_len - 1; i >= 0; i--)
+		n.glyph = n.glyph << 8 | (unsigned char)utf8[i];
+	if (byte_len == 0) n.glyph = ' ';
+	n.fg = gridColorIndex(fg);
+	n.bg = gridColorIndex(bg);
+	n.width = (signed char)width;
+	gridMarkPainted(x, y);
 	Cell *c = &E.grid_back[y * E.grid_w + x];
-	memset(c->ch, 0, sizeof(c->ch));
-	if (byte_len > 0) memcpy(c->ch, utf8, byte_len);
-	else c->ch[0] = ' ';
-	c->fg = fg;
-	c->bg = bg;
-	c->width = (signed char)width;
+	if (memcmp(c, &n, sizeof(n)) != 0) {
+		memcpy(c, &n, sizeof(n));
+		E.grid_dirty[y] = 1;
+	}
 	if (width == 2 && x + 1 < E.grid_w) {
+		n.glyph = 0;
+		n.width = 0;
+		gridMarkPainted(x + 1, y);
 		Cell *cc = &E.grid_back[y * E.grid_w + x + 1];
-		memset(cc->ch, 0, sizeof(cc->ch));
-		cc->fg = fg;
-		cc->bg = bg;
-		cc->width = 0;
+		if (memcmp(cc, &n, sizeof(n)) != 0) {
+			memcpy(cc, &n, sizeof(n));
+			E.grid_dirty[y] = 1;
+		}
 	}
 }
 
@@ -1509,47 +1917,121 @@ int gridPutCh(int x, int y, char c, Color fg, Color bg) {
 	return 1;
 }
 
+static void gridAppendInt(struct abuf *out, int v) {
+	char d[12];
+	int n = 0;
+	do { d[n++] = '0' + v % 10; v /= 10; } while (v > 0);
+	while (n > 0) abAppend(out, &d[--n], 1);
+}
+
+/* A pane noticed that its view moved k rows since the last frame. Only a
+ * hint: gridFlush checks it against the grids before trusting it. */
+void gridScrollHint(int x, int y, int w, int h, int k) {
+	if (k == 0 || abs(k) >= h || E.grid_scroll_n == GRID_SCROLL_MAX) return;
+	E.grid_scroll[E.grid_scroll_n++] = (gridScroll){ x, y, w, h, k };
+}
+
+/* Scrolls the terminal rows y..y+h-1 by k with a scroll region and shifts
+ * grid_front to match, so the cell diff only repaints exposed rows. The
+ * region always spans the full width, so it is only used when the pane's
+ * rows really did move and they outweigh what sits beside them. */
+static void gridScrollRegion(struct abuf *out, gridScroll *sc) {
+	int x0 = MAX(sc->x, 0), x1 = MIN(sc->x + sc->w, E.grid_w);
+	int top = MAX(sc->y, 0), bot = MIN(sc->y + sc->h, E.grid_h);
+	int k = sc->k, n = bot - top - abs(k);
+	if (x1 <= x0 || n <= 0) return;
+
+	size_t span = sizeof(Cell) * (x1 - x0);
+	int same = 0;
+	for (int y = top; y < bot; y++) {
+		if (y + k < top || y + k >= bot) continue;
+		if (memcmp(&E.grid_back[y * E.grid_w + x0], &E.grid_front[(y + k) * E.grid_w + x0], span) == 0)
+			same++;
+	}
+	long saved = (long)same * (x1 - x0);
+	long beside = (long)(bot - top) * (E.grid_w - (x1 - x0));
+	if (same * 2 < n || saved <= beside) return;
+
+	abAppend(out, "\x1b[", 2);
+	gridAppendInt(out, top + 1);
+	abAppend(out, ";", 1);
+	gridAppendInt(out, bot);
+	abAppend(out, "r", 1);
+	if (E.term_type == TERM_BASIC) {
+		/* plain VT100 has no SU/SD: LF at the bottom margin, RI at the top */
+		abAppend(out, "\x1b[", 2);
+		gridAppendInt(out, k > 0 ? bot : top + 1);
+		abAppend(out, ";1H", 3);
+		for (int i = 0; i < abs(k); i++)
+			abAppend(out, k > 0 ? "\n" : "\x1bM", k > 0 ? 1 : 2);
+	} else {
+		abAppend(out, "\x1b[", 2);
+		gridAppendInt(out, abs(k));
+		abAppend(out, k > 0 ? "S" : "T", 1);
+	}
+	abAppend(out, "\x1b[r", 3);
+
+	Cell *band = &E.grid_front[top * E.grid_w];
+	size_t row = sizeof(Cell) * E.grid_w;
+	if (k > 0) {
+		memmove(band, band + (size_t)k * E.grid_w, row * n);
+		memset(band + (size_t)n * E.grid_w, 0, row * k);
+	} else {
+		memmove(band + (size_t)(-k) * E.grid_w, band, row * n);
+		memset(band, 0, row * -k);
+	}
+	memset(&E.grid_dirty[top], 1, bot - top);
+}
+
+/* Rows not written since the last flush are skipped outright; written
+ * rows that came out the same are caught by one memcmp of the row, and
+ * only rows that really changed are diffed cell by cell. Colors come out
+ * of the palette already formatted. */
 void gridFlush(struct abuf *out) {
+	int hints = E.grid_scroll_n;
+	E.grid_scroll_n = 0;
 	if (!E.grid_back || !E.grid_front) return;
-	Color cur_fg = { -1, -1, -1 };
-	Color cur_bg = { -1, -1, -1 };
+	for (int i = 0; i < hints; i++)
+		gridScrollRegion(out, &E.grid_scroll[i]);
+	int cur_fg = -1, cur_bg = -1;
 	int cur_x = -1, cur_y = -1;
+	size_t row = sizeof(Cell) * E.grid_w;
 	for (int y = 0; y < E.grid_h; y++) {
+		if (!E.grid_dirty[y]) continue;
+		E.grid_dirty[y] = 0;
+		Cell *bk_row = &E.grid_back[y * E.grid_w];
+		Cell *fr_row = &E.grid_front[y * E.grid_w];
+		if (memcmp(bk_row, fr_row, row) == 0) continue;
+
 		for (int x = 0; x < E.grid_w; x++) {
-			int idx = y * E.grid_w + x;
-			Cell *bk = &E.grid_back[idx];
-			Cell *fr = &E.grid_front[idx];
+			Cell *bk = &bk_row[x];
 			if (bk->width == 0) continue;
-			int same = (bk->width == fr->width
-				&& memcmp(bk->ch, fr->ch, sizeof(bk->ch)) == 0
-				&& gridColorEq(bk->fg, fr->fg)
-				&& gridColorEq(bk->bg, fr->bg));
-			if (same) continue;
+			if (memcmp(bk, &fr_row[x], sizeof(Cell)) == 0) continue;
 			if (cur_y != y || cur_x != x) {
-				char buf[32];
-				snprintf(buf, sizeof(buf), "\x1b[%d;%dH", y + 1, x + 1);
-				abAppend(out, buf, strlen(buf));
+				abAppend(out, "\x1b[", 2);
+				gridAppendInt(out, y + 1);
+				abAppend(out, ";", 1);
+				gridAppendInt(out, x + 1);
+				abAppend(out, "H", 1);
 				cur_x = x;
 				cur_y = y;
 			}
-			if (!gridColorEq(cur_fg, bk->fg)) {
-				setThemeColor(out, bk->fg);
+			if (cur_fg != bk->fg) {
+				abAppend(out, E.palette[bk->fg].fg, E.palette[bk->fg].fg_len);
 				cur_fg = bk->fg;
 			}
-			if (!gridColorEq(cur_bg, bk->bg)) {
-				setThemeBgColor(out, bk->bg);
+			if (cur_bg != bk->bg) {
+				abAppend(out, E.palette[bk->bg].bg, E.palette[bk->bg].bg_len);
 				cur_bg = bk->bg;
 			}
+			char ch[4];
 			int blen = 0;
-			while (blen < (int)sizeof(bk->ch) && bk->ch[blen]) blen++;
+			for (unsigned int g = bk->glyph; g && blen < 4; g >>= 8) ch[blen++] = g & 0xFF;
 			if (blen == 0) { abAppend(out, " ", 1); }
-			else abAppend(out, bk->ch, blen);
+			else abAppend(out, ch, blen);
 			cur_x += (bk->width > 0 ? bk->width : 1);
-			*fr = *bk;
-			if (bk->width == 2 && x + 1 < E.grid_w) {
-				E.grid_front[idx + 1] = E.grid_back[idx + 1];
-			}
 		}
+		memcpy(fr_row, bk_row, row);
 	}
 }
 
@@ -1616,51 +2098,13 @@ int utf8_prev_char(const char *s, int pos) {
 	return pos;
 }
 
-static int utf8_display_width(const char *s) {
-	if (!s) return 0;
-	int col = 0;
-	int i = 0;
-	int n = (int)strlen(s);
-	while (i < n) {
-		col += utf8_char_width(s, i);
-		i = utf8_next_char(s, i, n);
-	}
-	return col;
-}
-
-/* Return byte offset+length covering display cols [start_col, start_col+max_cols).
- * Also returns the actual display-cell count of the slice in *out_cols. */
-static void utf8_slice(const char *s, int start_col, int max_cols,
-                       int *out_off, int *out_len, int *out_cols) {
-	int col = 0, i = 0, n = s ? (int)strlen(s) : 0;
-	int off = n, end = n, cols = 0;
-	int found = 0;
-	while (i < n) {
-		int w = utf8_char_width(s, i);
-		if (!found && col >= start_col) { off = i; found = 1; }
-		if (found) {
-			if (cols + w > max_cols) break;
-			cols += w;
-		}
-		col += w;
-		i = utf8_next_char(s, i, n);
-		if (found) end = i;
-	}
-	if (!found) { off = n; end = n; }
-	if (out_off)  *out_off  = off;
-	if (out_len)  *out_len  = end - off;
-	if (out_cols) *out_cols = cols;
-}
-
 /*** color ***/
-void setThemeColor(struct abuf *ab, Color color) {
-	char buf[32];
-	
+static int colorFgSGR(char *buf, size_t size, Color color) {
 	if (E.term_type == TERM_TRUECOLOR) {
-		snprintf(buf, sizeof(buf), "\x1b[38;2;%d;%d;%dm", color.r, color.g, color.b);
+		return snprintf(buf, size, "\x1b[38;2;%d;%d;%dm", color.r, color.g, color.b);
 	} else if (E.term_type == TERM_XTERM_256) {
 		int color_index = 16 + (36 * (color.r * 5 / 255)) + (6 * (color.g * 5 / 255)) + (color.b * 5 / 255);
-		snprintf(buf, sizeof(buf), "\x1b[38;5;%dm", color_index);
+		return snprintf(buf, size, "\x1b[38;5;%dm", color_index);
 	} else {
 		int ansi_color = 40;
 
@@ -1680,30 +2124,38 @@ void setThemeColor(struct abuf *ab, Color color) {
 			else if (color.r > color.g) ansi_color = 41;
 		}
 
-		snprintf(buf, sizeof(buf), "\x1b[%dm", ansi_color);
+		return snprintf(buf, size, "\x1b[%dm", ansi_color);
 	}
-	abAppend(ab, buf, strlen(buf));
 }
 
-void setThemeBgColor(struct abuf *ab, Color color) {
-	char buf[32];
-	
+static int colorBgSGR(char *buf, size_t size, Color color) {
 	if (E.term_type == TERM_TRUECOLOR) {
-		snprintf(buf, sizeof(buf), "\x1b[48;2;%d;%d;%dm", color.r, color.g, color.b);
+		return snprintf(buf, size, "\x1b[48;2;%d;%d;%dm", color.r, color.g, color.b);
 	} else if (E.term_type == TERM_XTERM_256) {
 		int color_index = 16 + (36 * (color.r * 5 / 255)) + (6 * (color.g * 5 / 255)) + (color.b * 5 / 255);
-		snprintf(buf, sizeof(buf), "\x1b[48;5;%dm", color_index);
+		return snprintf(buf, size, "\x1b[48;5;%dm", color_index);
 	} else {
 		int intensity = (color.r + color.g + color.b) / 3;
 		int ansi_color = 40;
-		
+
 		if (intensity < 50) ansi_color = 40;
 		else if (intensity > 200) ansi_color = 47;
 		else ansi_color = 40;
-		
-		snprintf(buf, sizeof(buf), "\x1b[%dm", ansi_color);
+
+		return snprintf(buf, size, "\x1b[%dm", ansi_color);
 	}
-	abAppend(ab, buf, strlen(buf));
+}
+
+void setThemeColor(struct abuf *ab, Color color) {
+	char buf[32];
+	int len = colorFgSGR(buf, sizeof(buf), color);
+	abAppend(ab, buf, len);
+}
+
+void setThemeBgColor(struct abuf *ab, Color color) {
+	char buf[32];
+	int len = colorBgSGR(buf, sizeof(buf), color);
+	abAppend(ab, buf, len);
 }
 
 int editorSyntaxToColor(int hl) {
@@ -1975,17 +2427,11 @@ void editorPasteFromSystemClipboard() {
 	E.system_paste.data = NULL;
 	E.system_paste.len = 0;
 	
-	editorSaveState();
-	E.is_pasting = 1;
-	
-	int saved_auto_indent = E.auto_indent;
-	int saved_smart_indent = E.smart_indent;
-	E.auto_indent = 0;
-	E.smart_indent = 0;
-	
-	while (fgets(buffer, sizeof(buffer), cmd)) {
-		int len = strlen(buffer);
-		E.system_paste.data = realloc(E.system_paste.data, total + len + 1);
+	size_t len;
+	while ((len = fread(buffer, 1, sizeof(buffer), cmd)) > 0) {
+		char *data = realloc(E.system_paste.data, total + len + 1);
+		if (!data) break;
+		E.system_paste.data = data;
 		memcpy(E.system_paste.data + total, buffer, len);
 		total += len;
 	}
@@ -1996,27 +2442,66 @@ void editorPasteFromSystemClipboard() {
 		E.system_paste.len = total;
 		E.system_paste.data[total] = '\0';
 		
-		for (int i = 0; i < total; i++) {
-			char c = E.system_paste.data[i];
-			if (c == '\n' || c == '\r') {
-				if (c == '\r' && i + 1 < total && E.system_paste.data[i + 1] == '\n') {
-					i++;
-				}
-				editorInsertNewLine();
-			} else if (c != '\0') {
-				editorInsertChar(c);
-			}
-		}
-		
-		editorSetStatusMessage("Pasted %d bytes from system clipboard", total);
+		editorSaveState();
+		editorInsertText(E.system_paste.data, total);
+		editorSetStatusMessage("Pasted %zu bytes from system clipboard", total);
 	}
-	
-	E.auto_indent = saved_auto_indent;
-	E.smart_indent = saved_smart_indent;
-	E.is_pasting = 0;
 }
 
 /*** pane management ***/
+editorBuffer *editorBufferNew(void) {
+	editorBuffer *buf = calloc(1, sizeof(editorBuffer));
+	if (!buf) return NULL;
+	buf->refs = 1;
+	buf->hl_epoch = 1;	/* rows start at 0: never highlighted */
+	buf->hl_first = INT_MAX;
+	return buf;
+}
+
+/* Drop the pane's reference; the last pane out frees the document. */
+void editorReleaseBuffer(editorPane *pane) {
+	if (!pane->buf) return;
+	if (--pane->buf->refs == 0) {
+		editorLoaderStop(pane);
+		editorFreeRows(pane);
+		free(pane->buf->filename);
+		editorClearUndo(pane);
+		free(pane->buf);
+	}
+	pane->buf = NULL;
+}
+
+/* Empty the pane's buffer before loading another file into it. A buffer
+ * shared with a split is left to the split and the pane gets a new one. */
+void editorDetachBuffer(editorPane *pane) {
+	if (pane->buf->refs > 1) {
+		editorBuffer *buf = editorBufferNew();
+		if (buf) {
+			editorReleaseBuffer(pane);
+			pane->buf = buf;
+			return;
+		}
+	}
+	editorLoaderStop(pane);
+	editorFreeRows(pane);
+}
+
+/* Another pane on the same buffer may have removed the rows this one was
+ * on; pull the view back inside the document before it is used. */
+void editorClampView(editorPane *pane) {
+	if (pane->cy > pane->buf->numrows) pane->cy = pane->buf->numrows;
+	if (pane->rowoff > pane->cy) {
+		pane->rowoff = pane->cy;
+		pane->rowoff_wrap = 0;
+	}
+	if (pane->cy < pane->buf->numrows) {
+		erow *row = editorRow(pane, pane->cy);
+		if (pane->cx > row->size) pane->cx = row->size;
+	} else {
+		pane->cx = 0;
+	}
+}
+
 editorPane *editorCreatePane(enum paneType type, int x, int y, int width, int height) {
 	editorPane *pane = calloc(1, sizeof(editorPane));
 	if (!pane) return NULL;
@@ -2032,18 +2517,15 @@ editorPane *editorCreatePane(enum paneType type, int x, int y, int width, int he
 	pane->cy = 0;
 	pane->rx = 0;
 	pane->rowoff = 0;
+	pane->rowoff_wrap = 0;
 	pane->coloff = 0;
-	pane->numrows = 0;
-	pane->row = NULL;
-	pane->filename = NULL;
-	pane->dirty = 0;
-	pane->syntax = NULL;
+	pane->buf = editorBufferNew();
+	if (!pane->buf) {
+		free(pane);
+		return NULL;
+	}
 	pane->visual_anchor_x = 0;
 	pane->visual_anchor_y = 0;
-	pane->undo_stack = NULL;
-	pane->redo_stack = NULL;
-	pane->undo_stack_size = 0;
-	pane->redo_stack_size = 0;
 	pane->explorer = NULL;
 	pane->plugin = NULL;
 	pane->ai = NULL;
@@ -2066,29 +2548,14 @@ void editorFreePane(editorPane *pane) {
 	if (pane->split_dir != SPLIT_NONE) {
 		editorFreePane(pane->child1);
 		editorFreePane(pane->child2);
+		editorReleaseBuffer(pane);
 		free(pane);
 		return;
 	}
 
+	editorReleaseBuffer(pane);
 	if (pane->type == PANE_EDITOR) {
-		for (int i = 0; i < pane->numrows; i++) {
-			editorFreeRow(&pane->row[i]);
-		}
-		free(pane->row);
-		free(pane->filename);
 		free(pane->pane_yank_buffer);
-
-		while (pane->undo_stack) {
-			undoState *temp = pane->undo_stack;
-			pane->undo_stack = pane->undo_stack->next;
-			editorFreeUndoState(temp);
-		}
-
-		while (pane->redo_stack) {
-			undoState *temp = pane->redo_stack;
-			pane->redo_stack = pane->redo_stack->next;
-			editorFreeUndoState(temp);
-		}
 	}
 
 	if (pane->type == PANE_EXPLORER) {
@@ -2096,16 +2563,11 @@ void editorFreePane(editorPane *pane) {
 	}
 
 	if (pane->type == PANE_AI && pane->ai) {
-		pthread_mutex_destroy(&pane->ai->lock);
-		for (int i = 0; i < pane->ai->history_count; i++) {
-			free(pane->ai->history[i]);
-		}
+		aiHistoryTruncate(pane->ai, 0);
 		free(pane->ai->history);
-		free(pane->ai->history_role);
 		free(pane->ai->current_prompt);
 		free(pane->ai->current_response);
 		free(pane->ai->prompt_buffer);
-		free(pane->ai->stream_acc);
 		free(pane->ai);
 		clawShutdown();
 	}
@@ -2222,18 +2684,13 @@ void editorSplitPane(int vertical) {
 	
 	editorUpdatePaneBounds(container);
 	
-	if (current->filename) {
-		new_pane->filename = strdup(current->filename);
-		new_pane->syntax = current->syntax;
-		
-		for (int i = 0; i < current->numrows; i++) {
-			editorPane *temp = E.active_pane;
-			E.active_pane = new_pane;
-			editorInsertRow(new_pane->numrows, current->row[i].chars, current->row[i].size);
-			E.active_pane = temp;
-		}
-		new_pane->dirty = 0;
-	}
+	editorReleaseBuffer(new_pane);
+	new_pane->buf = current->buf;
+	new_pane->buf->refs++;
+	new_pane->cx = current->cx;
+	new_pane->cy = current->cy;
+	new_pane->rowoff = current->rowoff;
+	new_pane->coloff = current->coloff;
 	
 	E.active_pane = new_pane;
 	E.num_panes++;
@@ -2245,7 +2702,8 @@ void editorClosePane() {
 	editorPane *pane = E.active_pane;
 	if (!pane) return;
 
-	if (!E.force_window_command && pane->type == PANE_EDITOR && pane->dirty) {
+	if (!E.force_window_command && pane->type == PANE_EDITOR && pane->buf->dirty &&
+		pane->buf->refs == 1) {
 		editorSetStatusMessage("Pane has unsaved changes. Use Ctrl-W ! to force close");
 		return;
 	}
@@ -2311,6 +2769,7 @@ void editorClosePane() {
 	parent->child2 = NULL;
 	parent->split_dir = SPLIT_NONE;
 	editorFreePane(pane);
+	editorReleaseBuffer(parent);
 	free(parent);
 	
 	E.active_pane = sibling;
@@ -2420,6 +2879,317 @@ void editorResizePanes() {
 	editorUpdatePaneBounds(E.root_pane);
 }
 
+/*** row storage ***/
+/* Rows live in a rope of line chunks (see ropeNode). Lookup, insert and
+ * delete by line number walk one root-to-leaf path; `hint` remembers the
+ * last leaf visited so sequential scans cost O(1) per row. An erow pointer
+ * stays valid until a row is inserted or deleted in its leaf. */
+static ropeNode *ropeNewNode(int leaf) {
+	ropeNode *node = calloc(1, sizeof(ropeNode));
+	if (!node) return NULL;
+
+	node->leaf = leaf;
+	if (leaf) node->rows = calloc(ROPE_LEAF_MAX, sizeof(erow));
+	else node->kids = calloc(ROPE_FANOUT, sizeof(ropeNode *));
+	if (!node->rows && !node->kids) {
+		free(node);
+		return NULL;
+	}
+	return node;
+}
+
+static void ropeFreeNode(ropeNode *node) {
+	if (!node) return;
+	if (node->leaf) {
+		for (int i = 0; node->rows && i < node->n; i++) editorFreeRow(&node->rows[i]);
+		free(node->rows);
+	} else {
+		for (int i = 0; i < node->n; i++) ropeFreeNode(node->kids[i]);
+		free(node->kids);
+	}
+	free(node);
+}
+
+/* leaf holding row `at`; with `append` set, a position on a leaf boundary
+ * resolves to the end of the earlier leaf so rows can be inserted there */
+static ropeNode *ropeDescend(ropeNode *node, int at, int append, int *start) {
+	int base = 0;
+	while (!node->leaf) {
+		int i = 0;
+		while (i < node->n - 1 && (append ? at - base > node->kids[i]->count
+										 : at - base >= node->kids[i]->count)) {
+			base += node->kids[i]->count;
+			i++;
+		}
+		node = node->kids[i];
+	}
+	*start = base;
+	return node;
+}
+
+/* gives a mapped leaf real rows, each pointing at its line in the mapping */
+static int ropeLeafRows(rowRope *r, ropeNode *leaf) {
+	if (leaf->rows) return 1;
+	leaf->rows = calloc(ROPE_LEAF_MAX, sizeof(erow));
+	if (!leaf->rows) return 0;
+
+	lineMap *map = r->map;
+	for (int i = 0; i < leaf->n; i++) {
+		erow *row = &leaf->rows[i];
+		size_t start = map->off[leaf->vline + i];
+		size_t end = map->off[leaf->vline + i + 1];
+		while (end > start && (map->base[end - 1] == '\n' || map->base[end - 1] == '\r'))
+			end--;
+		row->leaf = leaf;
+		row->chars = map->base + start;
+		row->size = (int)(end - start);
+		row->mapped = 1;
+	}
+	return 1;
+}
+
+static int ropeChildIndex(ropeNode *parent, ropeNode *node) {
+	int i = 0;
+	while (i < parent->n && parent->kids[i] != node) i++;
+	return i;
+}
+
+erow *ropeGet(rowRope *r, int at) {
+	if (!r->root || at < 0 || at >= r->root->count) return NULL;
+
+	if (r->hint && at >= r->hint_start && at < r->hint_start + r->hint->n)
+		return &r->hint->rows[at - r->hint_start];
+
+	int start;
+	ropeNode *leaf = ropeDescend(r->root, at, 0, &start);
+	if (!ropeLeafRows(r, leaf)) return NULL;
+	r->hint = leaf;
+	r->hint_start = start;
+	return &leaf->rows[at - start];
+}
+
+int ropeIndex(erow *row) {
+	ropeNode *node = row->leaf;
+	int at = (int)(row - node->rows);
+	while (node->parent) {
+		ropeNode *parent = node->parent;
+		for (int i = 0; parent->kids[i] != node; i++) at += parent->kids[i]->count;
+		node = parent;
+	}
+	return at;
+}
+
+/* moves the upper half of a full node into a new right sibling */
+static ropeNode *ropeSplit(rowRope *r, ropeNode *node) {
+	ropeNode *parent = node->parent;
+	if (!parent) {
+		parent = ropeNewNode(0);
+		if (!parent) return NULL;
+		parent->kids[0] = node;
+		parent->n = 1;
+		parent->count = node->count;
+		node->parent = parent;
+		r->root = parent;
+	} else if (parent->n == ROPE_FANOUT) {
+		if (!ropeSplit(r, parent)) return NULL;
+		parent = node->parent;
+	}
+
+	ropeNode *right = ropeNewNode(node->leaf);
+	if (!right) return NULL;
+
+	int keep = node->n / 2;
+	int moved = node->n - keep;
+	if (node->leaf) {
+		memcpy(right->rows, &node->rows[keep], sizeof(erow) * moved);
+		for (int i = 0; i < moved; i++) right->rows[i].leaf = right;
+		right->count = moved;
+	} else {
+		memcpy(right->kids, &node->kids[keep], sizeof(ropeNode *) * moved);
+		for (int i = 0; i < moved; i++) {
+			right->kids[i]->parent = right;
+			right->count += right->kids[i]->count;
+		}
+	}
+	right->n = moved;
+	node->n = keep;
+	node->count -= right->count;
+
+	int i = ropeChildIndex(parent, node);
+	memmove(&parent->kids[i + 2], &parent->kids[i + 1], sizeof(ropeNode *) * (parent->n - i - 1));
+	parent->kids[i + 1] = right;
+	parent->n++;
+	right->parent = parent;
+	return right;
+}
+
+/* returns a zeroed slot for a new row at `at`, or NULL if out of memory */
+erow *ropeInsert(rowRope *r, int at) {
+	if (!r->root) {
+		r->root = ropeNewNode(1);
+		if (!r->root) return NULL;
+	}
+
+	int start;
+	ropeNode *leaf = ropeDescend(r->root, at, 1, &start);
+	if (!ropeLeafRows(r, leaf)) return NULL;
+	int pos = at - start;
+
+	if (leaf->n == ROPE_LEAF_MAX) {
+		ropeNode *right = ropeSplit(r, leaf);
+		if (!right) return NULL;
+		if (pos > leaf->n) {
+			pos -= leaf->n;
+			start += leaf->n;
+			leaf = right;
+		}
+	}
+
+	memmove(&leaf->rows[pos + 1], &leaf->rows[pos], sizeof(erow) * (leaf->n - pos));
+	memset(&leaf->rows[pos], 0, sizeof(erow));
+	leaf->rows[pos].leaf = leaf;
+	leaf->n++;
+	for (ropeNode *node = leaf; node; node = node->parent) node->count++;
+
+	r->hint = leaf;
+	r->hint_start = start;
+	return &leaf->rows[pos];
+}
+
+static void ropeUnlink(rowRope *r, ropeNode *node) {
+	ropeNode *parent = node->parent;
+	int i = ropeChildIndex(parent, node);
+	memmove(&parent->kids[i], &parent->kids[i + 1], sizeof(ropeNode *) * (parent->n - i - 1));
+	parent->n--;
+	if (node->leaf) free(node->rows);
+	else free(node->kids);
+	free(node);
+
+	if (parent->n == 0 && parent != r->root) ropeUnlink(r, parent);
+}
+
+/* removes row `at` from the tree; the caller has freed its buffers */
+void ropeDelete(rowRope *r, int at) {
+	if (!r->root || at < 0 || at >= r->root->count) return;
+
+	int start;
+	ropeNode *leaf = ropeDescend(r->root, at, 0, &start);
+	if (!ropeLeafRows(r, leaf)) return;
+	int pos = at - start;
+	memmove(&leaf->rows[pos], &leaf->rows[pos + 1], sizeof(erow) * (leaf->n - pos - 1));
+	leaf->n--;
+	for (ropeNode *node = leaf; node; node = node->parent) node->count--;
+	r->hint = NULL;
+
+	if (r->root->count == 0) {
+		ropeFree(r);
+		return;
+	}
+
+	ropeNode *parent = leaf->parent;
+	if (parent && leaf->n == 0) {
+		ropeUnlink(r, leaf);
+	} else if (parent && leaf->n < ROPE_LEAF_MAX / 4 && parent->n > 1) {
+		int i = ropeChildIndex(parent, leaf);
+		ropeNode *left = i > 0 ? parent->kids[i - 1] : leaf;
+		ropeNode *right = i > 0 ? leaf : parent->kids[i + 1];
+		if (left->n + right->n <= ROPE_LEAF_MAX &&
+			ropeLeafRows(r, left) && ropeLeafRows(r, right)) {
+			memcpy(&left->rows[left->n], right->rows, sizeof(erow) * right->n);
+			for (int j = 0; j < right->n; j++) left->rows[left->n + j].leaf = left;
+			left->n += right->n;
+			left->count += right->count;
+			right->count = 0;
+			ropeUnlink(r, right);
+		}
+	}
+
+	while (!r->root->leaf && r->root->n == 1) {
+		ropeNode *old = r->root;
+		r->root = old->kids[0];
+		r->root->parent = NULL;
+		free(old->kids);
+		free(old);
+	}
+}
+
+void ropeFree(rowRope *r) {
+	ropeFreeNode(r->root);
+	r->root = NULL;
+	r->hint = NULL;
+	r->hint_start = 0;
+	if (r->map) {
+#ifndef _WIN32
+		munmap(r->map->base, r->map->len);
+#endif
+		free(r->map->off);
+		free(r->map);
+		r->map = NULL;
+	}
+}
+
+/* Builds the tree over a line index bottom-up, one unmaterialized leaf per
+ * ROPE_LEAF_MAX lines, so no erow exists until its lines are visited. */
+int ropeLoadMapped(rowRope *r, lineMap *map) {
+	int count = (map->n + ROPE_LEAF_MAX - 1) / ROPE_LEAF_MAX;
+	ropeNode **level = malloc(sizeof(ropeNode *) * (count ? count : 1));
+	if (!level) return 0;
+
+	for (int i = 0; i < count; i++) {
+		ropeNode *leaf = calloc(1, sizeof(ropeNode));
+		if (!leaf) {
+			while (i--) free(level[i]);
+			free(level);
+			return 0;
+		}
+		leaf->leaf = 1;
+		leaf->vline = i * ROPE_LEAF_MAX;
+		leaf->n = leaf->count = MIN(ROPE_LEAF_MAX, map->n - leaf->vline);
+		level[i] = leaf;
+	}
+
+	while (count > 1) {
+		int parents = (count + ROPE_FANOUT - 1) / ROPE_FANOUT;
+		for (int p = 0; p < parents; p++) {
+			ropeNode *node = ropeNewNode(0);
+			if (!node) {
+				/* level[0..p) are built parents, level[p * FANOUT..) unlinked */
+				for (int k = 0; k < p; k++) ropeFreeNode(level[k]);
+				for (int k = p * ROPE_FANOUT; k < count; k++) ropeFreeNode(level[k]);
+				free(level);
+				return 0;
+			}
+			for (int k = p * ROPE_FANOUT; k < count && k < (p + 1) * ROPE_FANOUT; k++) {
+				node->kids[node->n++] = level[k];
+				node->count += level[k]->count;
+				level[k]->parent = node;
+			}
+			level[p] = node;
+		}
+		count = parents;
+	}
+
+	r->map = map;
+	r->root = count ? level[0] : NULL;
+	free(level);
+	return 1;
+}
+
+erow *editorRow(editorPane *pane, int at) {
+	if (!pane) return NULL;
+	return ropeGet(&pane->buf->rows, at);
+}
+
+int editorRowIndex(erow *row) {
+	return ropeIndex(row);
+}
+
+void editorFreeRows(editorPane *pane) {
+	ropeFree(&pane->buf->rows);
+	pane->buf->numrows = 0;
+	pane->buf->hl_first = INT_MAX;
+}
+
 /*** row operations ***/
 int editorRowCxToRx(erow *row, int cx) {
 	int rx = 0;
@@ -2459,35 +3229,52 @@ int editorRowRxToCx(erow *row, int rx) {
 	return cx;
 }
 
-void editorUpdateSyntax(erow *row) {
-	row->hl = realloc(row->hl, row->rsize);
-	memset(row->hl, HL_NORMAL, row->rsize);
+/* Whether the scan that colored a byte this way took it alone, outside any
+ * string or comment, so it can resume right after it. */
+static int editorSyntaxRestartable(unsigned char hl) {
+	return hl == HL_NORMAL || hl == HL_OPERATOR || hl == HL_BRACKET;
+}
 
-	editorPane *pane = E.active_pane;
-	if (!pane || pane->type != PANE_EDITOR || !pane->syntax) return;
+/* End of the leading word a C preprocessor line colors, or 0. */
+static int editorPreprocEnd(editorPane *pane, erow *row) {
+	if (row->rsize == 0 || row->render[0] != '#' || pane->buf->syntax != &HLDB[0]) return 0;
+	int j = 0;
+	while (j < row->rsize && row->render[j] != ' ' && row->render[j] != '\t') j++;
+	return j;
+}
 
-	char **keywords = pane->syntax->keywords;
-	char *scs = pane->syntax->singleline_comment_start;
-	char *mcs = pane->syntax->multiline_comment_start;
-	char *mce = pane->syntax->multiline_comment_end;
+/* Scans render from offset `i`, which must be where a token starts, with
+ * the scanner outside any string. When `tail` is set, hl from `tail` on
+ * still holds the old highlighting of an unchanged tail; the scan stops
+ * as soon as it is back in step with it and leaves hl_open_comment as it
+ * was. */
+static void editorHighlightScan(editorPane *pane, erow *row, int i, int in_comment, int prev_sep, int tail) {
+	char **keywords = pane->buf->syntax->keywords;
+	char *scs = pane->buf->syntax->singleline_comment_start;
+	char *mcs = pane->buf->syntax->multiline_comment_start;
+	char *mce = pane->buf->syntax->multiline_comment_end;
 
 	int scs_len = scs ? strlen(scs) : 0;
 	int mcs_len = mcs ? strlen(mcs) : 0;
 	int mce_len = mce ? strlen(mce) : 0;
 
-	int prev_sep = 1;
 	int in_string = 0;
-	int in_comment = (row->idx > 0 && pane->row[row->idx - 1].hl_open_comment);
+	int pp_end = editorPreprocEnd(pane, row);
+	int old_at = -1;
+	unsigned char old_hl = HL_NORMAL;
 
-	int i = 0;
 	while (i < row->rsize) {
 		char c = row->render[i];
 		unsigned char prev_hl = (i > 0) ? row->hl[i - 1] : HL_NORMAL;
 
-		if (row->hl[i] == HL_MATCH) {
-			i++;
-			prev_sep = 0;
-			continue;
+		/* a one-byte token that came out as before, ending outside any
+		 * string or comment, leaves the scanner where the old scan was */
+		if (tail >= 0 && i >= tail && i >= pp_end) {
+			if (i > tail && old_at == i - 1 && prev_hl == old_hl && !in_comment && !in_string &&
+				editorSyntaxRestartable(old_hl))
+				return;
+			old_at = i;
+			old_hl = row->hl[i];
 		}
 
 		if (scs_len && !in_string && !in_comment) {
@@ -2518,7 +3305,7 @@ void editorUpdateSyntax(erow *row) {
 			}
 		}
 
-		if (pane->syntax->flags & HL_HIGHLIGHT_STRINGS) {
+		if (pane->buf->syntax->flags & HL_HIGHLIGHT_STRINGS) {
 			if (in_string) {
 				row->hl[i] = HL_STRING;
 				if (c == '\\' && i + 1 < row->rsize) {
@@ -2540,7 +3327,7 @@ void editorUpdateSyntax(erow *row) {
 			}
 		}
 
-		if (pane->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
+		if (pane->buf->syntax->flags & HL_HIGHLIGHT_NUMBERS) {
 			if ((isdigit(c) && (prev_sep || prev_hl == HL_NUMBER)) ||
 				(c == '.' && prev_hl == HL_NUMBER)) {
 				row->hl[i] = HL_NUMBER;
@@ -2550,13 +3337,7 @@ void editorUpdateSyntax(erow *row) {
 			}
 		}
 
-		if (row->render[0] == '#' && pane->syntax == &HLDB[0]) {
-			int j = 0;
-			while (j < row->rsize && row->render[j] != ' ' && row->render[j] != '\t') {
-				row->hl[j] = HL_PREPROCESSOR;
-				j++;
-			}
-		}
+		if (pp_end) memset(row->hl, HL_PREPROCESSOR, pp_end);
 
 		if (strchr("+-*/%=<>!&|^~?:,;(){}[]", c)) {
 			row->hl[i] = (strchr("(){}[]", c)) ? HL_BRACKET : HL_OPERATOR;
@@ -2585,37 +3366,253 @@ void editorUpdateSyntax(erow *row) {
 			}
 		}
 
+		if (i >= pp_end) row->hl[i] = HL_NORMAL;
 		prev_sep = is_separator(c);
 		i++;
 	}
 
-	int changed = (row->hl_open_comment != in_comment);
 	row->hl_open_comment = in_comment;
-	if (changed && row->idx + 1 < pane->numrows)
-		editorUpdateSyntax(&pane->row[row->idx + 1]);
-
-	if (E.search.query && E.search.query[0]) {
-		int qlen = strlen(E.search.query);
-		if (qlen > 0 && qlen <= row->rsize) {
-			char *m = strstr(row->render, E.search.query);
-			while (m) {
-				int pos = m - row->render;
-				for (int j = 0; j < qlen && pos + j < row->rsize; j++) {
-					row->hl[pos + j] = HL_MATCH;
-				}
-				m = strstr(m + 1, E.search.query);
-			}
-		}
-	}
 }
 
-void editorUpdateRow(erow *row) {
-	int tabs = 0;
-	for (int j = 0; j < row->size; j++)
-		if (row->chars[j] == '\t') tabs++;
+/* Highlights row `at` from the state the previous row ended in. Strings do
+ * not span lines, so that state is just whether a block comment is open. */
+static void editorHighlightRow(editorPane *pane, erow *row, int at) {
+	editorRowReserveRender(row, row->rsize + 1);
+	memset(row->hl, HL_NORMAL, row->rsize);
 
-	free(row->render);
-	row->render = malloc(row->size + tabs * (E.tab_stop - 1) + 1);
+	int in_comment = (at > 0 && editorRow(pane, at - 1)->hl_open_comment);
+	row->hl_state_in = in_comment;
+	row->hl_epoch = pane->buf->hl_epoch;
+	row->hl_open_comment = 0;
+	if (!pane->buf->syntax) return;
+	editorHighlightScan(pane, row, 0, in_comment, 1, -1);
+}
+
+static int editorSyntaxValid(editorPane *pane, int at) {
+	erow *row = editorRow(pane, at);
+	int in = (at > 0 && editorRow(pane, at - 1)->hl_open_comment);
+	return row->hl_epoch == pane->buf->hl_epoch && row->hl_state_in == in;
+}
+
+/* The mark lives in the row, so inserts and deletes carry it along; the
+ * buffer only keeps a bound on the first marked row. */
+static void editorSyntaxQueue(editorPane *pane, int at) {
+	editorRow(pane, at)->hl_queued = 1;
+	if (at < pane->buf->hl_first) pane->buf->hl_first = at;
+}
+
+/* Keeps hl_first on the same line across an insert (delta 1) or delete
+ * (delta -1) at `at`. */
+static void editorSyntaxShift(editorPane *pane, int at, int delta) {
+	int first = pane->buf->hl_first;
+	if (first != INT_MAX && (first > at || (delta > 0 && first == at)))
+		pane->buf->hl_first += delta;
+}
+
+/* Re-highlights the edited row now; rows below whose starting state it
+ * changed are queued and caught up by editorSyntaxFlush when drawn. */
+void editorUpdateSyntax(erow *row) {
+	editorPane *pane = E.active_pane;
+	if (!pane || pane->type != PANE_EDITOR) {
+		editorRowReserveRender(row, row->rsize + 1);
+		memset(row->hl, HL_NORMAL, row->rsize);
+		return;
+	}
+
+	int at = editorRowIndex(row);
+	editorHighlightRow(pane, row, at);
+	if (at + 1 < pane->buf->numrows && !editorSyntaxValid(pane, at + 1))
+		editorSyntaxQueue(pane, at + 1);
+}
+
+/* How far past its first byte the scanner may look to decide a token. */
+static int editorSyntaxReach(struct editorSyntax *syntax) {
+	int reach = 0;
+	char *delims[] = {
+		syntax->singleline_comment_start,
+		syntax->multiline_comment_start,
+		syntax->multiline_comment_end,
+	};
+	for (int j = 0; j < 3; j++) {
+		int len = delims[j] ? (int)strlen(delims[j]) - 1 : 0;
+		if (len > reach) reach = len;
+	}
+	/* a keyword also checks the byte after it */
+	for (char **kw = syntax->keywords; kw && *kw; kw++) {
+		int len = strlen(*kw);
+		if ((*kw)[len - 1] == '|') len--;
+		if (len > reach) reach = len;
+	}
+	return reach;
+}
+
+/* Re-highlights a row that editorRowSplice changed at render offset `rx`,
+ * leaving the unchanged tail at `rx + ins`. The scan restarts at the last
+ * token boundary no decision before the edit could see past, and stops
+ * once it is back in step with the old tail. */
+static void editorSyntaxSplice(erow *row, int rx, int ins) {
+	editorPane *pane = E.active_pane;
+	int at = pane && pane->type == PANE_EDITOR ? editorRowIndex(row) : -1;
+	if (at < 0 || !pane->buf->syntax || !editorSyntaxValid(pane, at)) {
+		editorUpdateSyntax(row);
+		return;
+	}
+
+	int pp_end = editorPreprocEnd(pane, row);
+	int p = rx - editorSyntaxReach(pane->buf->syntax);
+	while (p > 0 && (p - 1 < pp_end || !editorSyntaxRestartable(row->hl[p - 1]))) p--;
+	if (p <= 0)
+		editorHighlightScan(pane, row, 0, row->hl_state_in, 1, rx + ins);
+	else
+		editorHighlightScan(pane, row, p, 0,
+			row->hl[p - 1] == HL_NORMAL ? is_separator(row->render[p - 1]) : 1, rx + ins);
+	if (at + 1 < pane->buf->numrows && !editorSyntaxValid(pane, at + 1))
+		editorSyntaxQueue(pane, at + 1);
+}
+
+void editorSyntaxInvalidate(editorPane *pane) {
+	pane->buf->hl_epoch++;
+	pane->buf->hl_first = INT_MAX;
+	if (pane->buf->numrows > 0) editorSyntaxQueue(pane, 0);
+}
+
+/* Walks down from hl_first, following each marked chain until a row is
+ * already up to date, so opening a comment costs one row per line it
+ * actually recolors and a thousand marks left by one undo cost one pass.
+ * A chain that runs past `upto` is left marked at the first row not yet
+ * needed. Rows above the view are only walked for their end state and
+ * are not kept rendered. */
+void editorSyntaxFlush(editorPane *pane, int upto) {
+	/* without block comments no row's state depends on the one above */
+	if (!pane->buf->syntax || !pane->buf->syntax->multiline_comment_start ||
+		!pane->buf->syntax->multiline_comment_end) {
+		pane->buf->hl_first = INT_MAX;
+		return;
+	}
+
+	if (upto >= pane->buf->numrows) upto = pane->buf->numrows - 1;
+	int y = pane->buf->hl_first;
+	if (y > upto) return;
+	while (y <= upto) {
+		erow *row = editorRow(pane, y);
+		if (!row->hl_queued) {
+			y++;
+			continue;
+		}
+		row->hl_queued = 0;
+		while (y < pane->buf->numrows && !editorSyntaxValid(pane, y)) {
+			row = editorRow(pane, y);
+			if (y > upto) {
+				row->hl_queued = 1;
+				break;
+			}
+			row->hl_queued = 0;
+			int keep = row->render != NULL || y >= pane->rowoff;
+			editorRowRender(row);
+			editorHighlightRow(pane, row, y);
+			if (!keep) editorRowDropRender(row);
+			y++;
+		}
+	}
+	pane->buf->hl_first = y < pane->buf->numrows ? y : INT_MAX;
+}
+
+/* Row `at` with render and hl current, built on first use. */
+erow *editorRowHighlighted(editorPane *pane, int at) {
+	erow *row = editorRow(pane, at);
+	if (!row) return NULL;
+	if (row->render && row->hl && editorSyntaxValid(pane, at)) return row;
+
+	editorRowRender(row);
+	editorHighlightRow(pane, row, at);
+	if (at + 1 < pane->buf->numrows && !editorSyntaxValid(pane, at + 1))
+		editorSyntaxQueue(pane, at + 1);
+	return row;
+}
+
+/* Row buffers grow geometrically and are never shrunk while the row lives,
+ * so steady-state typing reuses them instead of allocating. */
+static int editorGrowCap(int cap, int need) {
+	if (cap < 16) cap = 16;
+	while (cap < need) cap *= 2;
+	return cap;
+}
+
+/* Copy-on-write for mapped rows: gives the row its own NUL-terminated
+ * buffer before it is modified or handed to the undo journal. */
+void editorRowOwn(erow *row) {
+	if (!row->mapped) return;
+	char *chars = malloc(row->size + 1);
+	if (!chars) return;
+	memcpy(chars, row->chars, row->size);
+	chars[row->size] = '\0';
+	row->chars = chars;
+	row->cap = row->size + 1;
+	row->mapped = 0;
+}
+
+static void editorRowReserve(erow *row, int need) {
+	editorRowOwn(row);
+	if (need <= row->cap) return;
+	row->cap = editorGrowCap(row->cap, need);
+	row->chars = realloc(row->chars, row->cap);
+}
+
+static void editorRowReserveRender(erow *row, int need) {
+	if (need <= row->rcap && row->render && row->hl) return;
+	if (need > row->rcap) row->rcap = editorGrowCap(row->rcap, need);
+	row->render = realloc(row->render, row->rcap);
+	row->hl = realloc(row->hl, row->rcap);
+}
+
+static void editorRowUpdateIndent(erow *row) {
+	row->indent = 0;
+	int i = 0;
+	while (i < row->size) {
+		if (row->chars[i] == ' ') {
+			row->indent++;
+			i++;
+		} else if (row->chars[i] == '\t') {
+			row->indent += E.tab_stop;
+			i++;
+		} else {
+			break;
+		}
+	}
+}
+
+/* Patches render/hl after `del` bytes at `at` were replaced by the `ins`
+ * bytes now at chars[at]. Only valid when no tab sits at or after `at` in
+ * either version of the row: the tail then maps byte for byte, so its render
+ * offset follows from the end of the line. */
+static void editorRowSplice(erow *row, int at, int del, int ins) {
+	if (!row->render) {
+		editorUpdateRow(row);
+		return;
+	}
+
+	int old_size = row->size - ins + del;
+	int rx = row->rsize - (old_size - at);
+	int tail = row->rsize - rx - del;
+
+	editorRowReserveRender(row, row->rsize - del + ins + 1);
+	memmove(&row->render[rx + ins], &row->render[rx + del], tail);
+	memmove(&row->hl[rx + ins], &row->hl[rx + del], tail);
+	memcpy(&row->render[rx], &row->chars[at], ins);
+	memset(&row->hl[rx], HL_NORMAL, ins);
+	row->rsize += ins - del;
+	row->render[row->rsize] = '\0';
+
+	editorRowUpdateIndent(row);
+	editorSyntaxSplice(row, rx, ins);
+}
+
+static void editorRowBuildRender(erow *row) {
+	int tabs = 0;
+	for (int j = 0; j < row->size; j++)
+		if (row->chars[j] == '\t') tabs++;
+
+	editorRowReserveRender(row, row->size + tabs * (E.tab_stop - 1) + 1);
 
 	int idx = 0;
 	int j = 0;
@@ -2636,55 +3633,89 @@ void editorUpdateRow(erow *row) {
 	row->render[idx] = '\0';
 	row->rsize = idx;
 
-	row->indent = 0;
-	int i = 0;
-	while (i < row->size) {
-		if (row->chars[i] == ' ') {
-			row->indent++;
-			i++;
-		} else if (row->chars[i] == '\t') {
-			row->indent += E.tab_stop;
-			i++;
-		} else {
-			break;
-		}
-	}
+	editorRowUpdateIndent(row);
+}
 
+void editorUpdateRow(erow *row) {
+	editorRowBuildRender(row);
 	editorUpdateSyntax(row);
 }
 
+/* Rows loaded from disk carry only chars until something needs their
+ * display form; this builds it without highlighting. */
+void editorRowRender(erow *row) {
+	if (!row->render) editorRowBuildRender(row);
+}
+
+static void editorRowDropRender(erow *row) {
+	free(row->render);
+	free(row->hl);
+	row->render = NULL;
+	row->hl = NULL;
+	row->rsize = 0;
+	row->rcap = 0;
+}
+
+/* Keeps a load's watermark under the same line across an edit at `at`.
+ * Rows at or past it were added after everything loaded so far, so the
+ * rest of the file goes in above them. */
+static void editorLoaderShift(editorPane *pane, int at, int delta) {
+	fileLoader *ld = pane->buf->loader;
+	if (ld && at < ld->loaded_rows) ld->loaded_rows += delta;
+}
+
+/* Stores the line as-is and leaves render/hl to first use. */
+static erow *editorInsertRowUnrendered(editorPane *pane, int at, char *chars, int len) {
+	erow *row = ropeInsert(&pane->buf->rows, at);
+	if (!row) {
+		free(chars);
+		return NULL;
+	}
+	editorSyntaxShift(pane, at, 1);
+	editorLoaderShift(pane, at, 1);
+
+	row->size = len;
+	row->cap = len + 1;
+	row->chars = chars;
+	pane->buf->numrows++;
+	return row;
+}
+
+static void editorInsertRowRaw(editorPane *pane, int at, char *chars, int len) {
+	erow *row = editorInsertRowUnrendered(pane, at, chars, len);
+	if (row) editorUpdateRow(row);
+}
+
+static void editorDelRowRaw(editorPane *pane, int at) {
+	editorFreeRow(editorRow(pane, at));
+	ropeDelete(&pane->buf->rows, at);
+	pane->buf->numrows--;
+	editorSyntaxShift(pane, at, -1);
+	editorLoaderShift(pane, at, -1);
+	if (at < pane->buf->numrows && !editorSyntaxValid(pane, at))
+		editorSyntaxQueue(pane, at);
+}
+
 void editorInsertRow(int at, char *s, size_t len) {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (at < 0 || at > pane->numrows) return;
-
-	pane->row = realloc(pane->row, sizeof(erow) * (pane->numrows + 1));
-	memmove(&pane->row[at + 1], &pane->row[at], sizeof(erow) * (pane->numrows - at));
-	for (int j = at + 1; j <= pane->numrows; j++) pane->row[j].idx++;
+	if (at < 0 || at > pane->buf->numrows) return;
 
-	pane->row[at].idx = at;
-	pane->row[at].size = len;
-	pane->row[at].chars = malloc(len + 1);
-	memcpy(pane->row[at].chars, s, len);
-	pane->row[at].chars[len] = '\0';
+	char *chars = malloc(len + 1);
+	memcpy(chars, s, len);
+	chars[len] = '\0';
+	editorInsertRowRaw(pane, at, chars, len);
+	undoRecordInsert(pane, at);
 
-	pane->row[at].rsize = 0;
-	pane->row[at].render = NULL;
-	pane->row[at].hl = NULL;
-	pane->row[at].hl_open_comment = 0;
-	pane->row[at].indent = 0;
-	editorUpdateRow(&pane->row[at]);
-	pane->numrows++;
-
-	if (pane->numrows > 1 || len > 0) {
-		pane->dirty++;
+	if (pane->buf->numrows > 1 || len > 0) {
+		pane->buf->dirty++;
 	}
 }
 
 void editorFreeRow(erow *row) {
 	free(row->render);
-	free(row->chars);
+	if (!row->mapped) free(row->chars);
 	free(row->hl);
 }
 
@@ -2692,50 +3723,81 @@ void editorDelRow(int at) {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (at < 0 || at >= pane->numrows) return;
-	editorFreeRow(&pane->row[at]);
-	memmove(&pane->row[at], &pane->row[at + 1], sizeof(erow) * (pane->numrows - at - 1));
-	for (int j = at; j < pane->numrows - 1; j++) pane->row[j].idx--;
-	pane->numrows--;
-	pane->dirty++;
+	if (at < 0 || at >= pane->buf->numrows) return;
+	undoRecordDelete(pane, at);
+	editorDelRowRaw(pane, at);
+	pane->buf->dirty++;
 }
 
 void editorRowInsertChar(erow *row, int at, int c) {
 	if (at < 0 || at > row->size) at = row->size;
-	row->chars = realloc(row->chars, row->size + 2);
+	undoRecordChange(row);
+	int splice = c != '\t' && !memchr(&row->chars[at], '\t', row->size - at);
+	editorRowReserve(row, row->size + 2);
 	memmove(&row->chars[at + 1], &row->chars[at], row->size - at + 1);
 	row->size++;
 	row->chars[at] = c;
-	editorUpdateRow(row);
+	if (splice) editorRowSplice(row, at, 0, 1);
+	else editorUpdateRow(row);
 
 	editorPane *pane = E.active_pane;
 	if (pane && pane->type == PANE_EDITOR) {
-		pane->dirty++;
+		pane->buf->dirty++;
 	}
 }
 
 void editorRowAppendString(erow *row, char *s, size_t len) {
-	row->chars = realloc(row->chars, row->size + len + 1);
+	undoRecordChange(row);
+	int at = row->size;
+	editorRowReserve(row, row->size + len + 1);
 	memcpy(&row->chars[row->size], s, len);
 	row->size += len;
 	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
+	if (!memchr(&row->chars[at], '\t', len)) editorRowSplice(row, at, 0, len);
+	else editorUpdateRow(row);
 
 	editorPane *pane = E.active_pane;
 	if (pane && pane->type == PANE_EDITOR) {
-		pane->dirty++;
+		pane->buf->dirty++;
 	}
 }
 
 void editorRowDelChar(erow *row, int at) {
 	if (at < 0 || at >= row->size) return;
-	memmove(&row->chars[at], &row->chars[at + 1], row->size - at);
-	row->size--;
-	editorUpdateRow(row);
+	editorRowDelRange(row, at, 1);
+}
+
+void editorRowDelRange(erow *row, int at, int len) {
+	if (at < 0 || len <= 0 || at >= row->size) return;
+	if (at + len > row->size) len = row->size - at;
+	undoRecordChange(row);
+	editorRowOwn(row);
+	int splice = !memchr(&row->chars[at], '\t', row->size - at);
+	memmove(&row->chars[at], &row->chars[at + len], row->size - at - len + 1);
+	row->size -= len;
+	if (splice) editorRowSplice(row, at, len, 0);
+	else editorUpdateRow(row);
+
+	editorPane *pane = E.active_pane;
+	if (pane && pane->type == PANE_EDITOR) {
+		pane->buf->dirty++;
+	}
+}
+
+void editorRowTruncate(erow *row, int len) {
+	if (len < 0 || len >= row->size) return;
+	undoRecordChange(row);
+	editorRowOwn(row);
+	int splice = !memchr(&row->chars[len], '\t', row->size - len);
+	int del = row->size - len;
+	row->size = len;
+	row->chars[len] = '\0';
+	if (splice) editorRowSplice(row, len, del, 0);
+	else editorUpdateRow(row);
 
 	editorPane *pane = E.active_pane;
 	if (pane && pane->type == PANE_EDITOR) {
-		pane->dirty++;
+		pane->buf->dirty++;
 	}
 }
 
@@ -2744,10 +3806,10 @@ void editorInsertChar(int c) {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (pane->cy == pane->numrows) {
-		editorInsertRow(pane->numrows, "", 0);
+	if (pane->cy == pane->buf->numrows) {
+		editorInsertRow(pane->buf->numrows, "", 0);
 	}
-	editorRowInsertChar(&pane->row[pane->cy], pane->cx, c);
+	editorRowInsertChar(editorRow(pane, pane->cy), pane->cx, c);
 	pane->cx++;
 }
 
@@ -2755,43 +3817,41 @@ void editorDelChar() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (pane->cy == pane->numrows) return;
+	if (pane->cy == pane->buf->numrows) return;
 	if (pane->cx == 0 && pane->cy == 0) return;
-	if (pane->numrows == 0) return;
+	if (pane->buf->numrows == 0) return;
 
-	erow *row = &pane->row[pane->cy];
+	erow *row = editorRow(pane, pane->cy);
 	if (pane->cx > 0) {
 		int prev_pos = utf8_prev_char(row->chars, pane->cx);
-		int char_len = pane->cx - prev_pos;
 		
-		memmove(&row->chars[prev_pos], &row->chars[pane->cx], row->size - pane->cx + 1);
-		row->size -= char_len;
+		editorRowDelRange(row, prev_pos, pane->cx - prev_pos);
 		pane->cx = prev_pos;
-		editorUpdateRow(row);
-		pane->dirty++;
 	} else {
-		pane->cx = pane->row[pane->cy - 1].size;
-		editorRowAppendString(&pane->row[pane->cy - 1], row->chars, row->size);
+		pane->cx = editorRow(pane, pane->cy - 1)->size;
+		editorRowAppendString(editorRow(pane, pane->cy - 1), row->chars, row->size);
 		editorDelRow(pane->cy);
 		pane->cy--;
 	}
 }
 
 int editorGetIndent(erow *row) {
-	return row ? row->indent : 0;
+	if (!row) return 0;
+	editorRowRender(row);
+	return row->indent;
 }
 
 void editorInsertNewLine() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	while (pane->cy >= pane->numrows) {
-		editorInsertRow(pane->numrows, "", 0);
+	while (pane->cy >= pane->buf->numrows) {
+		editorInsertRow(pane->buf->numrows, "", 0);
 	}
 
 	int indent = 0;
-	if (E.auto_indent && E.mode == MODE_INSERT && pane->cy < pane->numrows && E.is_pasting == 0) {
-		erow *row = &pane->row[pane->cy];
+	if (E.auto_indent && E.mode == MODE_INSERT && pane->cy < pane->buf->numrows && E.is_pasting == 0) {
+		erow *row = editorRow(pane, pane->cy);
 		
 		if (pane->cx > 0 || (pane->cx == 0 && row->size > 0 && isspace(row->chars[0]))) {
 			indent = editorGetIndent(row);
@@ -2815,12 +3875,9 @@ void editorInsertNewLine() {
 	if (pane->cx == 0) {
 		editorInsertRow(pane->cy, "", 0);
 	} else {
-		erow *row = &pane->row[pane->cy];
+		erow *row = editorRow(pane, pane->cy);
 		editorInsertRow(pane->cy + 1, &row->chars[pane->cx], row->size - pane->cx);
-		row = &pane->row[pane->cy];
-		row->size = pane->cx;
-		row->chars[row->size] = '\0';
-		editorUpdateRow(row);
+		editorRowTruncate(editorRow(pane, pane->cy), pane->cx);
 	}
 
 	pane->cy++;
@@ -2844,27 +3901,88 @@ void editorInsertNewLine() {
 	}
 }
 
-void editorHandlePaste(const char *text, int len) {
+/* Pasted text keeps tabs and UTF-8 but not other control bytes. */
+static size_t editorFilterLine(char *dst, const char *src, size_t len) {
+	size_t n = 0;
+	for (size_t i = 0; i < len; i++) {
+		char c = src[i];
+		if (c == '\t' || c >= 32 || c < 0) dst[n++] = c;
+	}
+	return n;
+}
+
+/* Inserts text at the cursor as if typed without auto-indent, but as whole
+ * rows: the cursor row is recorded for undo once, each new line becomes one
+ * row insert, and only the first row is highlighted now. The pasted rows
+ * are left unrendered and queued, so the draw path colors what is shown.
+ * \n, \r\n and lone \r all end a line. The cursor ends after the text. */
+void editorInsertText(const char *text, size_t len) {
 	editorPane *pane = E.active_pane;
-	if (!pane || pane->type != PANE_EDITOR || !text || len <= 0) return;
-	
-	editorSaveState();
-	E.is_pasting = 1;
-	
-	for (int i = 0; i < len; i++) {
-		if (text[i] == '\n' || text[i] == '\r') {
-			if (text[i] == '\r' && i + 1 < len && text[i + 1] == '\n') {
-				i++;
+	if (!pane || pane->type != PANE_EDITOR || !text || len == 0) return;
+
+	if (pane->cy >= pane->buf->numrows) {
+		pane->cy = pane->buf->numrows;
+		editorInsertRow(pane->buf->numrows, "", 0);
+	}
+	erow *row = editorRow(pane, pane->cy);
+	int cx = pane->cx < row->size ? pane->cx : row->size;
+	undoRecordChange(row);
+	editorRowOwn(row);
+
+	int tail_len = row->size - cx;
+	char *tail = malloc(tail_len + 1);
+	if (!tail) return;
+	memcpy(tail, &row->chars[cx], tail_len);
+	row->size = cx;
+
+	int first = pane->cy;
+	int at = first;
+	size_t i = 0;
+	while (1) {
+		size_t j = i;
+		while (j < len && text[j] != '\n' && text[j] != '\r') j++;
+		int last = j == len;
+		size_t seg = j - i;
+
+		if (at == first) {
+			editorRowReserve(row, row->size + seg + 1);
+			row->size += editorFilterLine(&row->chars[row->size], &text[i], seg);
+		} else {
+			char *chars = malloc(seg + 1);
+			erow *next = chars ? editorInsertRowUnrendered(pane, at,
+				chars, editorFilterLine(chars, &text[i], seg)) : NULL;
+			if (!next) {
+				at--;
+				break;
 			}
-			editorInsertNewLine();
-		} else if (text[i] == '\t') {
-			editorInsertChar('\t');
-		} else if (text[i] >= 32 || text[i] < 0) {
-			editorInsertChar(text[i]);
+			row = next;
+			undoRecordInsert(pane, at);
 		}
+		pane->cx = row->size;
+		if (last) break;
+
+		i = j + 1;
+		if (text[j] == '\r' && i < len && text[i] == '\n') i++;
+		at++;
 	}
+
+	pane->cy = at;
+	editorRowReserve(row, row->size + tail_len + 1);
+	memcpy(&row->chars[row->size], tail, tail_len);
+	row->size += tail_len;
+	row->chars[row->size] = '\0';
+	free(tail);
+
+	editorUpdateRow(editorRow(pane, first));
+	pane->buf->dirty++;
+}
+
+void editorHandlePaste(const char *text, int len) {
+	editorPane *pane = E.active_pane;
+	if (!pane || pane->type != PANE_EDITOR || !text || len <= 0) return;
 	
-	E.is_pasting = 0;
+	editorSaveState();
+	editorInsertText(text, len);
 	editorSetStatusMessage("Pasted %d bytes", len);
 }
 
@@ -2873,7 +3991,7 @@ void editorMoveCursor(int key) {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	erow *row = (pane->cy >= pane->numrows) ? NULL : &pane->row[pane->cy];
+	erow *row = (pane->cy >= pane->buf->numrows) ? NULL : editorRow(pane, pane->cy);
 
 	switch (key) {
 	case ARROW_LEFT:
@@ -2882,8 +4000,8 @@ void editorMoveCursor(int key) {
 			pane->cx = utf8_prev_char(row->chars, pane->cx);
 		} else if (pane->cy > 0) {
 			pane->cy--;
-			if (pane->cy < pane->numrows) {
-				pane->cx = pane->row[pane->cy].size;
+			if (pane->cy < pane->buf->numrows) {
+				pane->cx = editorRow(pane, pane->cy)->size;
 			}
 		}
 		break;
@@ -2892,7 +4010,7 @@ void editorMoveCursor(int key) {
 	case 'l':
 		if (row && pane->cx < row->size) {
 			pane->cx = utf8_next_char(row->chars, pane->cx, row->size);
-		} else if (row && pane->cx == row->size && pane->cy < pane->numrows - 1) {
+		} else if (row && pane->cx == row->size && pane->cy < pane->buf->numrows - 1) {
 			pane->cy++;
 			pane->cx = 0;
 		}
@@ -2917,11 +4035,12 @@ void editorMoveCursor(int key) {
 		
 		if (pane->cy > 0) {
 			pane->cy--;
-			if (E.word_wrap && pane->wrap_lines && pane->cy < pane->numrows) {
+			if (E.word_wrap && pane->wrap_lines && pane->cy < pane->buf->numrows) {
 				int wrap_width = pane->width - E.line_number_width;
 				if (wrap_width < 1) wrap_width = 1;
 				
-				erow *prev_row = &pane->row[pane->cy];
+				erow *prev_row = editorRow(pane, pane->cy);
+				editorRowRender(prev_row);
 				int prev_lines = (prev_row->rsize + wrap_width - 1) / wrap_width;
 				if (prev_lines > 1) {
 					int target_rx = (prev_lines - 1) * wrap_width + (pane->rx % wrap_width);
@@ -2938,6 +4057,7 @@ void editorMoveCursor(int key) {
 			int wrap_width = pane->width - E.line_number_width;
 			if (wrap_width < 1) wrap_width = 1;
 			
+			editorRowRender(row);
 			int rx = editorRowCxToRx(row, pane->cx);
 			int current_wrap_line = rx / wrap_width;
 			int total_wrap_lines = (row->rsize + wrap_width - 1) / wrap_width;
@@ -2950,14 +4070,15 @@ void editorMoveCursor(int key) {
 			}
 		}
 		
-		if (pane->numrows > 0 && pane->cy < pane->numrows - 1) {
+		if (pane->buf->numrows > 0 && pane->cy < pane->buf->numrows - 1) {
 			pane->cy++;
-			if (E.word_wrap && pane->wrap_lines && pane->cy < pane->numrows) {
+			if (E.word_wrap && pane->wrap_lines && pane->cy < pane->buf->numrows) {
 				int wrap_width = pane->width - E.line_number_width;
 				if (wrap_width < 1) wrap_width = 1;
 				
 				int target_rx = pane->rx % wrap_width;
-				erow *next_row = &pane->row[pane->cy];
+				erow *next_row = editorRow(pane, pane->cy);
+				editorRowRender(next_row);
 				if (target_rx > next_row->rsize) target_rx = next_row->rsize;
 				pane->cx = editorRowRxToCx(next_row, target_rx);
 			}
@@ -2965,7 +4086,7 @@ void editorMoveCursor(int key) {
 		break;
 	}
 
-	row = (pane->cy >= pane->numrows) ? NULL : &pane->row[pane->cy];
+	row = (pane->cy >= pane->buf->numrows) ? NULL : editorRow(pane, pane->cy);
 	int rowlen = row ? row->size : 0;
 	if (pane->cx > rowlen) {
 		pane->cx = rowlen;
@@ -2973,39 +4094,101 @@ void editorMoveCursor(int key) {
 }
 
 /*** scrolling ***/
+/* A wrapped view keeps its top as (rowoff, rowoff_wrap): a file row and the
+ * wrap line within it. Everything below walks from there, so positioning
+ * costs a screenful of rows rather than the rows above the view. */
+int editorWrapWidth(editorPane *pane) {
+	int wrap_width = pane->width - E.line_number_width;
+	return wrap_width < 1 ? 1 : wrap_width;
+}
+
+int editorWrapLines(erow *row, int wrap_width) {
+	editorRowRender(row);
+	int lines = (row->rsize + wrap_width - 1) / wrap_width;
+	return lines < 1 ? 1 : lines;
+}
+
+/* moves (*y, *sub) by n wrap lines, stopping at either end of the file */
+int editorWrapStep(editorPane *pane, int *y, int *sub, int n) {
+	int wrap_width = editorWrapWidth(pane);
+	int moved = 0;
+
+	while (n > 0 && *y < pane->buf->numrows) {
+		if (*sub + 1 < editorWrapLines(editorRow(pane, *y), wrap_width)) {
+			(*sub)++;
+		} else if (*y + 1 < pane->buf->numrows) {
+			(*y)++;
+			*sub = 0;
+		} else {
+			break;
+		}
+		n--;
+		moved++;
+	}
+	while (n < 0) {
+		if (*sub > 0) {
+			(*sub)--;
+		} else if (*y > 0) {
+			(*y)--;
+			*sub = editorWrapLines(editorRow(pane, *y), wrap_width) - 1;
+		} else {
+			break;
+		}
+		n++;
+		moved++;
+	}
+	return moved;
+}
+
+/* screen lines from the view top to (y, sub), capped at limit; -1 if above */
+int editorWrapOffset(editorPane *pane, int y, int sub, int limit) {
+	if (y < pane->rowoff || (y == pane->rowoff && sub < pane->rowoff_wrap)) return -1;
+	return editorWrapDistance(pane, pane->rowoff, pane->rowoff_wrap, y, sub, limit);
+}
+
+/* wrap lines from (y0, sub0) down to (y1, sub1), capped at limit */
+int editorWrapDistance(editorPane *pane, int y0, int sub0, int y1, int sub1, int limit) {
+	int wrap_width = editorWrapWidth(pane);
+	int offset = -sub0;
+	for (int i = y0; i < y1 && i < pane->buf->numrows && offset < limit; i++) {
+		offset += editorWrapLines(editorRow(pane, i), wrap_width);
+	}
+	offset += sub1;
+	return offset < limit ? offset : limit;
+}
+
 void editorScroll() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (pane->cy >= pane->numrows) {
-		pane->cy = pane->numrows > 0 ? pane->numrows - 1 : 0;
+	if (pane->cy >= pane->buf->numrows) {
+		pane->cy = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
 	}
 
 	pane->rx = 0;
-	if (pane->cy < pane->numrows) {
-		pane->rx = editorRowCxToRx(&pane->row[pane->cy], pane->cx);
+	if (pane->cy < pane->buf->numrows) {
+		pane->rx = editorRowCxToRx(editorRow(pane, pane->cy), pane->cx);
 	}
 
 	if (E.word_wrap && pane->wrap_lines) {
-		int wrap_width = pane->width - E.line_number_width;
-		if (wrap_width < 1) wrap_width = 1;
-		
-		int visual_row = 0;
-		for (int i = 0; i < pane->cy; i++) {
-			int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-			if (lines < 1) lines = 1;
-			visual_row += lines;
+		int wrap_width = editorWrapWidth(pane);
+
+		if (pane->rowoff >= pane->buf->numrows) {
+			pane->rowoff = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
+			pane->rowoff_wrap = 0;
 		}
-		
-		if (pane->cy < pane->numrows) {
-			visual_row += pane->rx / wrap_width;
+		if (pane->rowoff < pane->buf->numrows) {
+			int lines = editorWrapLines(editorRow(pane, pane->rowoff), wrap_width);
+			if (pane->rowoff_wrap >= lines) pane->rowoff_wrap = lines - 1;
 		}
-		
-		if (visual_row < pane->rowoff) {
-			pane->rowoff = visual_row;
-		}
-		if (visual_row >= pane->rowoff + pane->height) {
-			pane->rowoff = visual_row - pane->height + 1;
+
+		int sub = pane->cy < pane->buf->numrows ? pane->rx / wrap_width : 0;
+		int offset = editorWrapOffset(pane, pane->cy, sub, pane->height);
+		if (offset < 0 || offset >= pane->height) {
+			pane->rowoff = pane->cy;
+			pane->rowoff_wrap = sub;
+			if (offset >= pane->height)
+				editorWrapStep(pane, &pane->rowoff, &pane->rowoff_wrap, -(pane->height - 1));
 		}
 		
 		pane->coloff = 0;
@@ -3057,10 +4240,10 @@ int editorIsInVisualSelection(int row, int col) {
 		tmp = start_x; start_x = end_x; end_x = tmp;
 	}
 
-	if (row >= 0 && row < pane->numrows) {
+	if (row >= 0 && row < pane->buf->numrows) {
 		int char_col = 0;
 		int render_col = 0;
-		erow *r = &pane->row[row];
+		erow *r = editorRow(pane, row);
 
 		for (char_col = 0; char_col < r->size && render_col < col; char_col++) {
 			if (r->chars[char_col] == '\t') {
@@ -3085,7 +4268,7 @@ void editorGetVisualSelection(int *start_x, int *start_y, int *end_x, int *end_y
 	if (E.mode == MODE_VISUAL_LINE) {
 		*start_x = 0;
 		*start_y = pane->visual_anchor_y;
-		*end_x = (pane->cy < pane->numrows) ? pane->row[pane->cy].size - 1 : 0;
+		*end_x = (pane->cy < pane->buf->numrows) ? editorRow(pane, pane->cy)->size - 1 : 0;
 		if (*end_x < 0) *end_x = 0;
 		*end_y = pane->cy;
 	} else {
@@ -3101,8 +4284,8 @@ void editorGetVisualSelection(int *start_x, int *start_y, int *end_x, int *end_y
 		tmp = *start_y; *start_y = *end_y; *end_y = tmp;
 	}
 
-	if (*end_y < pane->numrows && *end_x >= pane->row[*end_y].size) {
-		*end_x = pane->row[*end_y].size - 1;
+	if (*end_y < pane->buf->numrows && *end_x >= editorRow(pane, *end_y)->size) {
+		*end_x = editorRow(pane, *end_y)->size - 1;
 		if (*end_x < 0) *end_x = 0;
 	}
 }
@@ -3118,10 +4301,10 @@ void editorYankVisualSelection() {
 	int is_line_mode = (E.mode == MODE_VISUAL_LINE);
 	
 	for (int y = start_y; y <= end_y; y++) {
-		if (y >= pane->numrows) break;
+		if (y >= pane->buf->numrows) break;
 
 		int row_start = (y == start_y && !is_line_mode) ? start_x : 0;
-		int row_end = (y == end_y && !is_line_mode) ? end_x : pane->row[y].size - 1;
+		int row_end = (y == end_y && !is_line_mode) ? end_x : editorRow(pane, y)->size - 1;
 
 		if (row_start <= row_end) {
 			total_len += row_end - row_start + 1;
@@ -3135,16 +4318,16 @@ void editorYankVisualSelection() {
 	char *p = buffer;
 	
 	for (int y = start_y; y <= end_y; y++) {
-		if (y >= pane->numrows) break;
+		if (y >= pane->buf->numrows) break;
 
 		int row_start = (y == start_y && !is_line_mode) ? start_x : 0;
-		int row_end = (y == end_y && !is_line_mode) ? end_x : pane->row[y].size - 1;
+		int row_end = (y == end_y && !is_line_mode) ? end_x : editorRow(pane, y)->size - 1;
 
-		if (row_start <= row_end && row_start < pane->row[y].size) {
+		if (row_start <= row_end && row_start < editorRow(pane, y)->size) {
 			int len = row_end - row_start + 1;
-			if (row_end >= pane->row[y].size) len = pane->row[y].size - row_start;
+			if (row_end >= editorRow(pane, y)->size) len = editorRow(pane, y)->size - row_start;
 
-			memcpy(p, &pane->row[y].chars[row_start], len);
+			memcpy(p, &editorRow(pane, y)->chars[row_start], len);
 			p += len;
 
 			if (y < end_y || is_line_mode) {
@@ -3177,19 +4360,17 @@ void editorDeleteVisualSelection() {
 
 	if (start_y == end_y) {
 		for (int i = end_x; i >= start_x; i--) {
-			editorRowDelChar(&pane->row[start_y], i);
+			editorRowDelChar(editorRow(pane, start_y), i);
 		}
 	} else {
-		if (start_x < pane->row[start_y].size) {
-			pane->row[start_y].size = start_x;
-			pane->row[start_y].chars[start_x] = '\0';
+		if (start_x < editorRow(pane, start_y)->size) {
+			editorRowTruncate(editorRow(pane, start_y), start_x);
 
-			if (end_x + 1 < pane->row[end_y].size) {
-				editorRowAppendString(&pane->row[start_y],
-					&pane->row[end_y].chars[end_x + 1],
-					pane->row[end_y].size - end_x - 1);
+			if (end_x + 1 < editorRow(pane, end_y)->size) {
+				editorRowAppendString(editorRow(pane, start_y),
+					&editorRow(pane, end_y)->chars[end_x + 1],
+					editorRow(pane, end_y)->size - end_x - 1);
 			}
-			editorUpdateRow(&pane->row[start_y]);
 		}
 
 		for (int i = 0; i < end_y - start_y; i++) {
@@ -3212,207 +4393,251 @@ void editorDeleteVisualSelection() {
 }
 
 /*** undo/redo ***/
-undoState *editorCreateUndoState() {
-	editorPane *pane = E.active_pane;
-	if (!pane || pane->type != PANE_EDITOR) return NULL;
+/* Undo is a journal of row-level deltas. editorSaveState() opens a group;
+ * the row primitives append ops to the open group of the active pane, and
+ * undo/redo replay a group's inverse ops onto only the rows it touched. */
+void editorFreeUndoState(undoState *state) {
+	if (!state) return;
+
+	for (int i = 0; i < state->numops; i++) {
+		free(state->ops[i].chars);
+	}
+	free(state->ops);
+	free(state);
+}
 
+void editorClearUndo(editorPane *pane) {
+	while (pane->buf->undo_stack) {
+		undoState *temp = pane->buf->undo_stack;
+		pane->buf->undo_stack = pane->buf->undo_stack->next;
+		editorFreeUndoState(temp);
+	}
+	while (pane->buf->redo_stack) {
+		undoState *temp = pane->buf->redo_stack;
+		pane->buf->redo_stack = pane->buf->redo_stack->next;
+		editorFreeUndoState(temp);
+	}
+	pane->buf->undo_stack_size = 0;
+	pane->buf->redo_stack_size = 0;
+	pane->buf->undo_open = 0;
+}
+
+static undoState *undoNewState(editorPane *pane) {
 	undoState *state = calloc(1, sizeof(undoState));
 	if (!state) return NULL;
 
-	state->numrows = pane->numrows;
+	state->seq = ++E.undo_seq;
 	state->cx = pane->cx;
 	state->cy = pane->cy;
-	state->filename = pane->filename ? strdup(pane->filename) : NULL;
 	state->timestamp = time(NULL);
-	state->mode = E.mode;
-
-	if (E.paste.data && E.paste.len > 0) {
-		state->yank_buffer = malloc(E.paste.len + 1);
-		if (state->yank_buffer) {
-			memcpy(state->yank_buffer, E.paste.data, E.paste.len + 1);
-			state->yank_buffer_len = E.paste.len;
-		}
-	}
-
-	state->next = NULL;
+	return state;
+}
 
-	if (pane->numrows > 0) {
-		state->rows = calloc(pane->numrows, sizeof(erow));
-		if (!state->rows) {
-			free(state->filename);
-			free(state->yank_buffer);
-			free(state);
-			return NULL;
-		}
+static void undoTrimStack(undoState **stack, int *size) {
+	if (*size <= E.max_undo_levels) return;
 
-		for (int i = 0; i < pane->numrows; i++) {
-			state->rows[i].size = pane->row[i].size;
-			state->rows[i].chars = malloc(pane->row[i].size + 1);
-			if (!state->rows[i].chars) {
-				for (int j = 0; j < i; j++) {
-					free(state->rows[j].chars);
-				}
-				free(state->rows);
-				free(state->filename);
-				free(state->yank_buffer);
-				free(state);
-				return NULL;
-			}
-			memcpy(state->rows[i].chars, pane->row[i].chars, pane->row[i].size + 1);
+	undoState *curr = *stack;
+	undoState *prev = NULL;
+	while (curr && curr->next) {
+		prev = curr;
+		curr = curr->next;
+	}
+	if (prev) {
+		editorFreeUndoState(curr);
+		prev->next = NULL;
+		(*size)--;
+	}
+}
 
-			state->rows[i].rsize = 0;
-			state->rows[i].render = NULL;
-			state->rows[i].hl = NULL;
-			state->rows[i].hl_open_comment = 0;
-			state->rows[i].indent = pane->row[i].indent;
-			state->rows[i].idx = i;
+static void undoPushOp(undoState *state, enum undoOpType type, int at, char *chars, int size) {
+	if (state->numops == state->opscap) {
+		int cap = state->opscap ? state->opscap * 2 : 8;
+		undoOp *ops = realloc(state->ops, sizeof(undoOp) * cap);
+		if (!ops) {
+			free(chars);
+			return;
 		}
-	} else {
-		state->rows = NULL;
+		state->ops = ops;
+		state->opscap = cap;
 	}
+	undoOp *op = &state->ops[state->numops++];
+	op->type = type;
+	op->at = at;
+	op->chars = chars;
+	op->size = size;
+}
 
-	return state;
+static void undoPushState(editorPane *pane, undoState *state) {
+	state->next = pane->buf->undo_stack;
+	pane->buf->undo_stack = state;
+	pane->buf->undo_stack_size++;
+	undoTrimStack(&pane->buf->undo_stack, &pane->buf->undo_stack_size);
 }
 
-void editorFreeUndoState(undoState *state) {
-	if (!state) return;
+/* group that new ops go into; opens one if the last was closed by u/^R */
+static undoState *undoCurrent(editorPane *pane) {
+	if (E.undo_suspended || !pane || pane->type != PANE_EDITOR) return NULL;
 
-	free(state->filename);
-	free(state->yank_buffer);
+	if (!pane->buf->undo_open || !pane->buf->undo_stack) {
+		undoState *state = undoNewState(pane);
+		if (!state) return NULL;
+		undoPushState(pane, state);
+		pane->buf->undo_open = 1;
+	}
 
-	if (state->rows) {
-		for (int i = 0; i < state->numrows; i++) {
-			free(state->rows[i].chars);
-			free(state->rows[i].render);
-			free(state->rows[i].hl);
+	undoState *state = pane->buf->undo_stack;
+	if (state->numops == 0) {
+		while (pane->buf->redo_stack) {
+			undoState *temp = pane->buf->redo_stack;
+			pane->buf->redo_stack = pane->buf->redo_stack->next;
+			editorFreeUndoState(temp);
 		}
-		free(state->rows);
+		pane->buf->redo_stack_size = 0;
 	}
-
-	free(state);
+	return state;
 }
 
-void editorSaveState() {
-	editorPane *pane = E.active_pane;
-	if (!pane || pane->type != PANE_EDITOR) return;
+void undoRecordChange(erow *row) {
+	undoState *state = undoCurrent(E.active_pane);
+	if (!state || row->undo_seq == state->seq) return;
 
-	if (pane->undo_stack && pane->undo_stack->timestamp >= time(NULL) - 1) {
-		return;
-	}
+	char *copy = malloc(row->size + 1);
+	if (!copy) return;
+	memcpy(copy, row->chars, row->size);
+	copy[row->size] = '\0';
+	undoPushOp(state, UNDO_CHANGE, editorRowIndex(row), copy, row->size);
+	row->undo_seq = state->seq;
+}
 
-	if (pane->undo_stack_size >= E.max_undo_levels) {
-		undoState *curr = pane->undo_stack;
-		undoState *prev = NULL;
-		while (curr && curr->next) {
-			prev = curr;
-			curr = curr->next;
-		}
+void undoRecordInsert(editorPane *pane, int at) {
+	undoState *state = undoCurrent(pane);
+	if (!state) return;
 
-		if (prev) {
-			editorFreeUndoState(curr);
-			prev->next = NULL;
-			pane->undo_stack_size--;
-		}
-	}
+	undoPushOp(state, UNDO_INSERT, at, NULL, 0);
+	editorRow(pane, at)->undo_seq = state->seq;
+}
 
-	undoState *state = editorCreateUndoState();
+void undoRecordDelete(editorPane *pane, int at) {
+	undoState *state = undoCurrent(pane);
 	if (!state) return;
 
-	state->next = pane->undo_stack;
-	pane->undo_stack = state;
-	pane->undo_stack_size++;
-
-	while (pane->redo_stack) {
-		undoState *temp = pane->redo_stack;
-		pane->redo_stack = pane->redo_stack->next;
-		editorFreeUndoState(temp);
-		pane->redo_stack_size--;
-	}
+	erow *row = editorRow(pane, at);
+	editorRowOwn(row);
+	undoPushOp(state, UNDO_DELETE, at, row->chars, row->size);
+	row->chars = NULL;
 }
 
-void editorRestoreState(undoState *state) {
+void editorSaveState() {
 	editorPane *pane = E.active_pane;
-	if (!pane || pane->type != PANE_EDITOR || !state) return;
+	if (!pane || pane->type != PANE_EDITOR) return;
 
-	for (int i = 0; i < pane->numrows; i++) {
-		editorFreeRow(&pane->row[i]);
+	undoState *top = pane->buf->undo_open ? pane->buf->undo_stack : NULL;
+	if (top && top->timestamp >= time(NULL) - 1) {
+		return;
 	}
-	free(pane->row);
-
-	pane->numrows = state->numrows;
-	pane->cx = state->cx;
-	pane->cy = state->cy;
 
-	if (state->yank_buffer && state->yank_buffer_len > 0) {
-		editorSetPasteBuffer(state->yank_buffer, state->yank_buffer_len, 0);
+	if (top && top->numops == 0) {
+		top->cx = pane->cx;
+		top->cy = pane->cy;
+		top->timestamp = time(NULL);
+		return;
 	}
 
-	if (state->numrows > 0) {
-		pane->row = calloc(state->numrows, sizeof(erow));
-		for (int i = 0; i < state->numrows; i++) {
-			pane->row[i].size = state->rows[i].size;
-			pane->row[i].chars = malloc(state->rows[i].size + 1);
-			memcpy(pane->row[i].chars, state->rows[i].chars, state->rows[i].size + 1);
-			pane->row[i].idx = i;
-			pane->row[i].indent = state->rows[i].indent;
-
-			pane->row[i].rsize = 0;
-			pane->row[i].render = NULL;
-			pane->row[i].hl = NULL;
-			pane->row[i].hl_open_comment = 0;
-			editorUpdateRow(&pane->row[i]);
+	undoState *state = undoNewState(pane);
+	if (!state) return;
+	undoPushState(pane, state);
+	pane->buf->undo_open = 1;
+}
+
+/* Replays the inverse of `from` onto the active pane, recording the inverse
+ * of each step into `to` so the group can be replayed back. Row buffers are
+ * handed between the two journals rather than copied. */
+static void undoApply(editorPane *pane, undoState *from, undoState *to) {
+	for (int i = from->numops - 1; i >= 0; i--) {
+		undoOp *op = &from->ops[i];
+		switch (op->type) {
+		case UNDO_CHANGE:
+			if (op->at < pane->buf->numrows) {
+				erow *row = editorRow(pane, op->at);
+				editorRowOwn(row);
+				undoPushOp(to, UNDO_CHANGE, op->at, row->chars, row->size);
+				row->chars = op->chars;
+				row->size = op->size;
+				row->cap = op->size + 1;
+				row->undo_seq = to->seq;
+				op->chars = NULL;
+				editorUpdateRow(row);
+			}
+			break;
+		case UNDO_INSERT:
+			if (op->at < pane->buf->numrows) {
+				erow *row = editorRow(pane, op->at);
+				editorRowOwn(row);
+				undoPushOp(to, UNDO_DELETE, op->at, row->chars, row->size);
+				row->chars = NULL;
+				editorDelRowRaw(pane, op->at);
+			}
+			break;
+		case UNDO_DELETE:
+			if (op->at <= pane->buf->numrows) {
+				char *chars = op->chars;
+				if (!chars) chars = calloc(1, 1);
+				editorInsertRowRaw(pane, op->at, chars, op->size);
+				editorRow(pane, op->at)->undo_seq = to->seq;
+				op->chars = NULL;
+				undoPushOp(to, UNDO_INSERT, op->at, NULL, 0);
+			}
+			break;
 		}
-	} else {
-		pane->row = NULL;
 	}
 
-	if (pane->cy >= pane->numrows) pane->cy = pane->numrows > 0 ? pane->numrows - 1 : 0;
+	pane->cx = from->cx;
+	pane->cy = from->cy;
+	if (pane->cy >= pane->buf->numrows) pane->cy = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
 	if (pane->cy < 0) pane->cy = 0;
 
-	erow *row = (pane->cy >= pane->numrows) ? NULL : &pane->row[pane->cy];
-	int rowlen = row ? row->size : 0;
+	int rowlen = pane->cy < pane->buf->numrows ? editorRow(pane, pane->cy)->size : 0;
 	if (pane->cx > rowlen) pane->cx = rowlen;
 
-	pane->dirty++;
+	pane->buf->dirty++;
 }
 
 void editorUndo() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (!pane->undo_stack) {
+	while (pane->buf->undo_stack && pane->buf->undo_stack->numops == 0) {
+		undoState *temp = pane->buf->undo_stack;
+		pane->buf->undo_stack = temp->next;
+		pane->buf->undo_stack_size--;
+		editorFreeUndoState(temp);
+	}
+	pane->buf->undo_open = 0;
+
+	if (!pane->buf->undo_stack) {
 		editorSetStatusMessage("Nothing to undo");
 		return;
 	}
 
-	undoState *current_state = editorCreateUndoState();
-	if (current_state) {
-		current_state->next = pane->redo_stack;
-		pane->redo_stack = current_state;
-		pane->redo_stack_size++;
+	undoState *state = pane->buf->undo_stack;
+	pane->buf->undo_stack = state->next;
+	pane->buf->undo_stack_size--;
 
-		if (pane->redo_stack_size > E.max_undo_levels) {
-			undoState *curr = pane->redo_stack;
-			undoState *prev = NULL;
-			while (curr && curr->next) {
-				prev = curr;
-				curr = curr->next;
-			}
-			if (prev) {
-				editorFreeUndoState(curr);
-				prev->next = NULL;
-				pane->redo_stack_size--;
-			}
-		}
+	undoState *redo = undoNewState(pane);
+	if (!redo) {
+		state->next = pane->buf->undo_stack;
+		pane->buf->undo_stack = state;
+		pane->buf->undo_stack_size++;
+		return;
 	}
-
-	undoState *state = pane->undo_stack;
-	pane->undo_stack = state->next;
-	pane->undo_stack_size--;
-
-	editorRestoreState(state);
+	undoApply(pane, state, redo);
 	editorFreeUndoState(state);
 
+	redo->next = pane->buf->redo_stack;
+	pane->buf->redo_stack = redo;
+	pane->buf->redo_stack_size++;
+	undoTrimStack(&pane->buf->redo_stack, &pane->buf->redo_stack_size);
+
 	editorSetStatusMessage("Undo");
 }
 
@@ -3420,90 +4645,64 @@ void editorRedo() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (!pane->redo_stack) {
+	if (!pane->buf->redo_stack) {
 		editorSetStatusMessage("Nothing to redo");
 		return;
 	}
 
-	undoState *current_state = editorCreateUndoState();
-	if (current_state) {
-		current_state->next = pane->undo_stack;
-		pane->undo_stack = current_state;
-		pane->undo_stack_size++;
+	undoState *state = pane->buf->redo_stack;
+	pane->buf->redo_stack = state->next;
+	pane->buf->redo_stack_size--;
 
-		if (pane->undo_stack_size > E.max_undo_levels) {
-			undoState *curr = pane->undo_stack;
-			undoState *prev = NULL;
-			while (curr && curr->next) {
-				prev = curr;
-				curr = curr->next;
-			}
-			if (prev) {
-				editorFreeUndoState(curr);
-				prev->next = NULL;
-				pane->undo_stack_size--;
-			}
-		}
+	undoState *undo = undoNewState(pane);
+	if (!undo) {
+		state->next = pane->buf->redo_stack;
+		pane->buf->redo_stack = state;
+		pane->buf->redo_stack_size++;
+		return;
 	}
-
-	undoState *state = pane->redo_stack;
-	pane->redo_stack = state->next;
-	pane->redo_stack_size--;
-
-	editorRestoreState(state);
+	undoApply(pane, state, undo);
 	editorFreeUndoState(state);
 
+	undoPushState(pane, undo);
+	pane->buf->undo_open = 0;
+
 	editorSetStatusMessage("Redo");
 }
 
 /*** search ***/
+/* first match at or after byte `from`; mapped rows are not NUL-terminated,
+ * so this goes by size rather than strstr */
+static int editorRowFind(erow *row, int from, const char *q, int qlen) {
+	if (qlen <= 0) return -1;
+	for (int i = from; i + qlen <= row->size; i++) {
+		char *p = memchr(&row->chars[i], q[0], row->size - qlen - i + 1);
+		if (!p) return -1;
+		i = p - row->chars;
+		if (!memcmp(p, q, qlen)) return i;
+	}
+	return -1;
+}
+
 void editorFindNext() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR || !E.search.query) return;
 
-	for (int i = 0; i < pane->numrows; i++) {
-		erow *row = &pane->row[i];
-		for (int j = 0; j < row->rsize; j++) {
-			if (row->hl[j] == HL_MATCH) {
-				row->hl[j] = HL_NORMAL;
-			}
-		}
-		editorUpdateSyntax(row);
-	}
-
-	int query_len = strlen(E.search.query);
-	for (int i = 0; i < pane->numrows; i++) {
-		erow *row = &pane->row[i];
-		char *m = strstr(row->render, E.search.query);
-		while (m) {
-			int pos = m - row->render;
-			for (int j = 0; j < query_len && pos + j < row->rsize; j++) {
-				row->hl[pos + j] = HL_MATCH;
-			}
-			m = strstr(m + 1, E.search.query);
-		}
-	}
-
+	E.search.highlight = 1;
+	int qlen = strlen(E.search.query);
 	int current_row = pane->cy;
 	int current_col = pane->cx;
 
-	for (int i = 0; i < pane->numrows; i++) {
-		int row_idx = (current_row + i) % pane->numrows;
-		erow *row = &pane->row[row_idx];
+	for (int i = 0; i < pane->buf->numrows; i++) {
+		int row_idx = (current_row + i) % pane->buf->numrows;
+		erow *row = editorRow(pane, row_idx);
 
-		char *match = strstr(row->render, E.search.query);
-		if (!match) continue;
-
-		if (row_idx == current_row && i == 0) {
-			int rx = editorRowCxToRx(row, current_col);
-			if (match - row->render <= rx) {
-				match = strstr(row->render + rx + 1, E.search.query);
-				if (!match) continue;
-			}
-		}
+		int from = (row_idx == current_row && i == 0) ? current_col + 1 : 0;
+		int match = editorRowFind(row, from, E.search.query, qlen);
+		if (match < 0) continue;
 
 		E.search.last_match_row = row_idx;
-		E.search.last_match_col = editorRowRxToCx(row, match - row->render);
+		E.search.last_match_col = match;
 
 		pane->cy = row_idx;
 		pane->cx = E.search.last_match_col;
@@ -3523,56 +4722,30 @@ void editorFindPrev() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR || !E.search.query) return;
 
-	for (int i = 0; i < pane->numrows; i++) {
-		erow *row = &pane->row[i];
-		for (int j = 0; j < row->rsize; j++) {
-			if (row->hl[j] == HL_MATCH) {
-				row->hl[j] = HL_NORMAL;
-			}
-		}
-		editorUpdateSyntax(row);
-	}
-
-	int query_len = strlen(E.search.query);
-	for (int i = 0; i < pane->numrows; i++) {
-		erow *row = &pane->row[i];
-		char *m = strstr(row->render, E.search.query);
-		while (m) {
-			int pos = m - row->render;
-			for (int j = 0; j < query_len && pos + j < row->rsize; j++) {
-				row->hl[pos + j] = HL_MATCH;
-			}
-			m = strstr(m + 1, E.search.query);
-		}
-	}
-
+	E.search.highlight = 1;
+	int qlen = strlen(E.search.query);
 	int current_row = pane->cy;
 	int current_col = pane->cx;
 
-	for (int i = 0; i < pane->numrows; i++) {
-		int row_idx = (current_row - i + pane->numrows) % pane->numrows;
-		erow *row = &pane->row[row_idx];
+	for (int i = 0; i < pane->buf->numrows; i++) {
+		int row_idx = (current_row - i + pane->buf->numrows) % pane->buf->numrows;
+		erow *row = editorRow(pane, row_idx);
 
-		char *match = strstr(row->render, E.search.query);
-		char *last_match = NULL;
+		int match = editorRowFind(row, 0, E.search.query, qlen);
 		int last_match_pos = -1;
 
-		while (match) {
-			int match_pos = match - row->render;
-
+		while (match >= 0) {
 			if (row_idx == current_row && i == 0) {
-				int rx = editorRowCxToRx(row, current_col);
-				if (match_pos >= rx) break;
+				if (match >= current_col) break;
 			}
 
-			last_match = match;
-			last_match_pos = match_pos;
-			match = strstr(match + 1, E.search.query);
+			last_match_pos = match;
+			match = editorRowFind(row, match + 1, E.search.query, qlen);
 		}
 
-		if (last_match) {
+		if (last_match_pos >= 0) {
 			E.search.last_match_row = row_idx;
-			E.search.last_match_col = editorRowRxToCx(row, last_match_pos);
+			E.search.last_match_col = last_match_pos;
 
 			pane->cy = row_idx;
 			pane->cx = E.search.last_match_col;
@@ -3597,6 +4770,7 @@ void editorFind() {
 	int saved_cy = pane->cy;
 	int saved_coloff = pane->coloff;
 	int saved_rowoff = pane->rowoff;
+	int saved_rowoff_wrap = pane->rowoff_wrap;
 
 	char *query = editorPrompt("Search: %s (ESC to cancel, Enter to search)", NULL);
 
@@ -3610,20 +4784,13 @@ void editorFind() {
 
 		free(query);
 	} else {
-		for (int i = 0; i < pane->numrows; i++) {
-			erow *row = &pane->row[i];
-			for (int j = 0; j < row->rsize; j++) {
-				if (row->hl[j] == HL_MATCH) {
-					row->hl[j] = HL_NORMAL;
-				}
-			}
-			editorUpdateSyntax(row);
-		}
+		E.search.highlight = 0;
 
 		pane->cx = saved_cx;
 		pane->cy = saved_cy;
 		pane->coloff = saved_coloff;
 		pane->rowoff = saved_rowoff;
+		pane->rowoff_wrap = saved_rowoff_wrap;
 	}
 }
 
@@ -3636,15 +4803,15 @@ char *editorRowsToString(int *buflen) {
 	}
 
 	int totlen = 0;
-	for (int j = 0; j < pane->numrows; j++)
-		totlen += pane->row[j].size + 1;
+	for (int j = 0; j < pane->buf->numrows; j++)
+		totlen += editorRow(pane, j)->size + 1;
 	*buflen = totlen;
 
 	char *buf = malloc(totlen);
 	char *p = buf;
-	for (int j = 0; j < pane->numrows; j++) {
-		memcpy(p, pane->row[j].chars, pane->row[j].size);
-		p += pane->row[j].size;
+	for (int j = 0; j < pane->buf->numrows; j++) {
+		memcpy(p, editorRow(pane, j)->chars, editorRow(pane, j)->size);
+		p += editorRow(pane, j)->size;
 		*p = '\n';
 		p++;
 	}
@@ -3656,10 +4823,11 @@ void editorSelectSyntaxHighlight() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	pane->syntax = &HLDB[HLDB_ENTRIES - 1];
-	if (pane->filename == NULL) return;
+	pane->buf->syntax = &HLDB[HLDB_ENTRIES - 1];
+	editorSyntaxInvalidate(pane);
+	if (pane->buf->filename == NULL) return;
 
-	char *ext = strrchr(pane->filename, '.');
+	char *ext = strrchr(pane->buf->filename, '.');
 
 	for (unsigned int j = 0; j < HLDB_ENTRIES - 1; j++) {
 		struct editorSyntax *s = &HLDB[j];
@@ -3667,11 +4835,8 @@ void editorSelectSyntaxHighlight() {
 		while (s->filematch[i]) {
 			int is_ext = (s->filematch[i][0] == '.');
 			if ((is_ext && ext && !strcasecmp(ext, s->filematch[i])) ||
-				(!is_ext && strstr(pane->filename, s->filematch[i]))) {
-				pane->syntax = s;
-				for (int filerow = 0; filerow < pane->numrows; filerow++) {
-					editorUpdateSyntax(&pane->row[filerow]);
-				}
+				(!is_ext && strstr(pane->buf->filename, s->filematch[i]))) {
+				pane->buf->syntax = s;
 				return;
 			}
 			i++;
@@ -3679,11 +4844,240 @@ void editorSelectSyntaxHighlight() {
 	}
 }
 
+/* Each line is handed over as soon as it is read, so a reader stalled on a
+ * slow mount still shows everything before the stall. */
+static void *editorLoaderThread(void *arg) {
+	fileLoader *ld = arg;
+	char *line = NULL;
+	size_t linecap = 0;
+	ssize_t linelen;
+	long long bytes = 0;
+	int cancel = 0;
+
+	while (!cancel && (linelen = getline(&line, &linecap, ld->fp)) != -1) {
+		bytes += linelen;
+		while (linelen > 0 && (line[linelen - 1] == '\n' ||
+							   line[linelen - 1] == '\r'))
+			linelen--;
+		char *chars = malloc(linelen + 1);
+		if (!chars) break;
+		memcpy(chars, line, linelen);
+		chars[linelen] = '\0';
+
+		pthread_mutex_lock(&ld->lock);
+		if (ld->nlines == ld->cap) {
+			int cap = ld->cap ? ld->cap * 2 : 1024;
+			char **lines = realloc(ld->lines, sizeof(char *) * cap);
+			int *lens = lines ? realloc(ld->lens, sizeof(int) * cap) : NULL;
+			if (lines) ld->lines = lines;
+			if (lens) ld->lens = lens;
+			if (lines && lens) ld->cap = cap;
+		}
+		if (ld->nlines < ld->cap) {
+			ld->lines[ld->nlines] = chars;
+			ld->lens[ld->nlines++] = linelen;
+		} else {
+			free(chars);
+			ld->error = ENOMEM;
+			ld->cancel = 1;
+		}
+		ld->bytes = bytes;
+		cancel = ld->cancel;
+		pthread_mutex_unlock(&ld->lock);
+	}
+
+	free(line);
+	pthread_mutex_lock(&ld->lock);
+	if (!ld->error && ferror(ld->fp)) ld->error = errno ? errno : EIO;
+	ld->finished = 1;
+	pthread_cond_broadcast(&ld->cond);
+	pthread_mutex_unlock(&ld->lock);
+	editorWake();
+	return NULL;
+}
+
+static void editorLoaderFree(fileLoader *ld) {
+	for (int i = 0; i < ld->nlines; i++) free(ld->lines[i]);
+	free(ld->lines);
+	free(ld->lens);
+	fclose(ld->fp);
+	pthread_mutex_destroy(&ld->lock);
+	pthread_cond_destroy(&ld->cond);
+	free(ld);
+}
+
+/* Moves the lines read so far into the pane at the loader's watermark:
+ * after the last loaded line, and above any rows added at the end since.
+ * Edits shift the watermark (editorLoaderShift), and both happen on this
+ * thread, so the file keeps its order whatever is edited during a load. */
+static void editorLoaderPoll(editorPane *pane) {
+	fileLoader *ld = pane->buf->loader;
+	if (!ld) return;
+
+	pthread_mutex_lock(&ld->lock);
+	char **lines = ld->lines;
+	int *lens = ld->lens;
+	int n = ld->nlines;
+	int finished = ld->finished;
+	ld->lines = NULL;
+	ld->lens = NULL;
+	ld->nlines = ld->cap = 0;
+	pthread_mutex_unlock(&ld->lock);
+
+	int first = ld->loaded_rows;
+	for (int i = 0; i < n; i++) {
+		if (editorInsertRowUnrendered(pane, ld->loaded_rows, lines[i], lens[i])) ld->loaded_rows++;
+	}
+	free(lines);
+	free(lens);
+	if (n > 0 && (first == 0 || editorSyntaxValid(pane, first - 1)))
+		editorSyntaxQueue(pane, first);
+	/* rows added below now follow different lines */
+	if (n > 0 && ld->loaded_rows < pane->buf->numrows)
+		editorSyntaxQueue(pane, ld->loaded_rows);
+
+	if (!finished) return;
+	if (ld->threaded) pthread_join(ld->thread, NULL);
+	if (ld->error) editorSetStatusMessage("Error reading file: %s", strerror(ld->error));
+	editorLoaderFree(ld);
+	pane->buf->loader = NULL;
+	E.loading--;
+}
+
+void editorLoaderPollAll() {
+	if (!E.loading) return;
+	editorPane **panes = NULL;
+	int count = 0;
+	editorCollectLeafPanes(E.root_pane, &panes, &count);
+	for (int i = 0; i < count; i++) editorLoaderPoll(panes[i]);
+	free(panes);
+}
+
+/* blocks until the load finishes, or for at most `ms` when ms >= 0 */
+void editorLoaderWait(editorPane *pane, int ms) {
+	fileLoader *ld = pane->buf->loader;
+	if (!ld) return;
+
+	struct timespec deadline;
+	clock_gettime(CLOCK_REALTIME, &deadline);
+	deadline.tv_sec += ms / 1000;
+	deadline.tv_nsec += (long)(ms % 1000) * 1000000L;
+	if (deadline.tv_nsec >= 1000000000L) {
+		deadline.tv_sec++;
+		deadline.tv_nsec -= 1000000000L;
+	}
+
+	pthread_mutex_lock(&ld->lock);
+	while (!ld->finished) {
+		if (ms < 0) pthread_cond_wait(&ld->cond, &ld->lock);
+		else if (pthread_cond_timedwait(&ld->cond, &ld->lock, &deadline) != 0) break;
+	}
+	pthread_mutex_unlock(&ld->lock);
+	editorLoaderPoll(pane);
+}
+
+int editorLoaderPercent(editorPane *pane) {
+	fileLoader *ld = pane->buf->loader;
+	if (!ld || ld->total <= 0) return 0;
+	pthread_mutex_lock(&ld->lock);
+	long long bytes = ld->bytes;
+	pthread_mutex_unlock(&ld->lock);
+	return (int)(bytes * 100 / ld->total);
+}
+
+void editorLoaderStop(editorPane *pane) {
+	fileLoader *ld = pane->buf->loader;
+	if (!ld) return;
+
+	pthread_mutex_lock(&ld->lock);
+	ld->cancel = 1;
+	pthread_mutex_unlock(&ld->lock);
+	if (ld->threaded) pthread_join(ld->thread, NULL);
+	editorLoaderFree(ld);
+	pane->buf->loader = NULL;
+	E.loading--;
+}
+
+static void editorLoaderStart(editorPane *pane, FILE *fp) {
+	fileLoader *ld = calloc(1, sizeof(fileLoader));
+	if (!ld) {
+		fclose(fp);
+		editorSetStatusMessage("Error opening file: %s", strerror(ENOMEM));
+		return;
+	}
+	ld->fp = fp;
+	ld->loaded_rows = pane->buf->numrows;
+	pthread_mutex_init(&ld->lock, NULL);
+	pthread_cond_init(&ld->cond, NULL);
+
+	struct stat st;
+	if (fstat(fileno(fp), &st) == 0) ld->total = st.st_size;
+
+	pane->buf->loader = ld;
+	E.loading++;
+	ld->threaded = pthread_create(&ld->thread, NULL, editorLoaderThread, ld) == 0;
+	if (!ld->threaded) editorLoaderThread(ld);
+}
+
+#ifndef _WIN32
+/* Large-file mode: map the file and index line starts with memchr. Rows
+ * borrow their text from the mapping until edited, so memory follows the
+ * lines visited rather than the file size. */
+static int editorOpenMapped(editorPane *pane, int fd, size_t len) {
+	char *base = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (base == MAP_FAILED) return 0;
+	madvise(base, len, MADV_SEQUENTIAL);
+
+	lineMap *map = calloc(1, sizeof(lineMap));
+	size_t cap = len / 64 + 16;
+	size_t *off = map ? malloc(sizeof(size_t) * cap) : NULL;
+	size_t n = 0;
+	size_t pos = 0;
+	while (off && pos < len) {
+		if (n + 1 >= cap) {
+			size_t *grown = realloc(off, sizeof(size_t) * cap * 2);
+			if (!grown || cap * 2 > INT_MAX) {
+				free(grown ? grown : off);
+				off = NULL;
+				break;
+			}
+			off = grown;
+			cap *= 2;
+		}
+		off[n++] = pos;
+		char *nl = memchr(base + pos, '\n', len - pos);
+		pos = nl ? (size_t)(nl - base) + 1 : len;
+	}
+	if (!off) {
+		free(map);
+		munmap(base, len);
+		return 0;
+	}
+	off[n] = len;
+	madvise(base, len, MADV_RANDOM);
+
+	map->base = base;
+	map->len = len;
+	map->off = off;
+	map->n = (int)n;
+	if (!ropeLoadMapped(&pane->buf->rows, map)) {
+		free(off);
+		free(map);
+		munmap(base, len);
+		return 0;
+	}
+	pane->buf->numrows = map->n;
+	return 1;
+}
+#endif
+
 void editorOpen(char *filename) {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	free(pane->filename);
+	editorLoaderStop(pane);
+	free(pane->buf->filename);
+	editorClearUndo(pane);
 	
 	char resolved[PATH_MAX];
 #ifdef _WIN32
@@ -3691,9 +5085,9 @@ void editorOpen(char *filename) {
 #else
 	if (realpath(filename, resolved)) {
 #endif
-		pane->filename = strdup(resolved);
+		pane->buf->filename = strdup(resolved);
 	} else {
-		pane->filename = strdup(filename);
+		pane->buf->filename = strdup(filename);
 	}
 
 	editorSelectSyntaxHighlight();
@@ -3702,8 +5096,8 @@ void editorOpen(char *filename) {
 
 	if (!fp) {
 		if (errno == ENOENT) {
-			pane->dirty = 0;
-			editorSetStatusMessage("New file: %s", pane->filename);
+			pane->buf->dirty = 0;
+			editorSetStatusMessage("New file: %s", pane->buf->filename);
 			return;
 		} else {
 			editorSetStatusMessage("Error opening file: %s", strerror(errno));
@@ -3716,50 +5110,104 @@ void editorOpen(char *filename) {
 	for (size_t i = 0; i < peek_n; i++) {
 		if (peek[i] == 0) {
 			fclose(fp);
-			editorSetStatusMessage("Binary file refused: %s", pane->filename);
-			pane->dirty = 0;
+			editorSetStatusMessage("Binary file refused: %s", pane->buf->filename);
+			pane->buf->dirty = 0;
 			return;
 		}
 	}
 	rewind(fp);
 
-	char *line = NULL;
-	size_t linecap = 0;
-	ssize_t linelen;
-	while ((linelen = getline(&line, &linecap, fp)) != -1) {
-		while (linelen > 0 && (line[linelen - 1] == '\n' ||
-							   line[linelen - 1] == '\r'))
-			linelen--;
-		editorInsertRow(pane->numrows, line, linelen);
+#ifndef _WIN32
+	struct stat st;
+	if (E.large_file_mb > 0 && fstat(fileno(fp), &st) == 0 && S_ISREG(st.st_mode) &&
+		st.st_size >= (off_t)E.large_file_mb * 1024 * 1024 &&
+		editorOpenMapped(pane, fileno(fp), st.st_size)) {
+		fclose(fp);
+		editorSyntaxInvalidate(pane);
+		pane->buf->dirty = 0;
+		editorSetStatusMessage("Large file mapped: %d lines", pane->buf->numrows);
+		return;
 	}
-	free(line);
-	fclose(fp);
-	pane->dirty = 0;
+#endif
+
+	/* small files finish inside the wait and open as before; slow or large
+	 * ones keep streaming in while the editor draws what has arrived */
+	editorSyntaxInvalidate(pane);
+	pane->buf->dirty = 0;
+	editorLoaderStart(pane, fp);
+	editorLoaderWait(pane, 50);
 }
 
+#ifndef _WIN32
+/* Rows of a mapped file may still point into it, so rewriting it in place
+ * would pull pages out from under them. Stream to a sibling and rename. */
+static void editorSaveMapped(editorPane *pane) {
+	char tmp[PATH_MAX];
+	snprintf(tmp, sizeof(tmp), "%s.hako~", pane->buf->filename);
+	FILE *fp = fopen(tmp, "w");
+	if (!fp) {
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		return;
+	}
+
+	struct stat st;
+	if (stat(pane->buf->filename, &st) == 0) fchmod(fileno(fp), st.st_mode & 07777);
+
+	long long written = 0;
+	for (int j = 0; j < pane->buf->numrows; j++) {
+		erow *row = editorRow(pane, j);
+		fwrite(row->chars, 1, row->size, fp);
+		fputc('\n', fp);
+		written += row->size + 1;
+	}
+	int failed = ferror(fp);
+	if (fclose(fp) != 0) failed = 1;
+	if (failed || rename(tmp, pane->buf->filename) == -1) {
+		unlink(tmp);
+		editorSetStatusMessage("Can't save! I/O error: %s", strerror(errno));
+		return;
+	}
+
+	pane->buf->dirty = 0;
+	editorSetStatusMessage("%lld bytes written to disk", written);
+}
+#endif
+
 void editorSave() {
 	editorPane *pane = E.active_pane;
 	if (!pane || pane->type != PANE_EDITOR) return;
 
-	if (pane->filename == NULL) {
-		pane->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
-		if (pane->filename == NULL) {
+	if (pane->buf->loader) {
+		editorSetStatusMessage("Still loading; save refused until the whole file is in");
+		return;
+	}
+
+	if (pane->buf->filename == NULL) {
+		pane->buf->filename = editorPrompt("Save as: %s (ESC to cancel)", NULL);
+		if (pane->buf->filename == NULL) {
 			editorSetStatusMessage("Save aborted");
 			return;
 		}
 		editorSelectSyntaxHighlight();
 	}
 
+#ifndef _WIN32
+	if (pane->buf->rows.map) {
+		editorSaveMapped(pane);
+		return;
+	}
+#endif
+
 	int len;
 	char *buf = editorRowsToString(&len);
 
-	int fd = open(pane->filename, O_RDWR | O_CREAT, 0644);
+	int fd = open(pane->buf->filename, O_RDWR | O_CREAT, 0644);
 	if (fd != -1) {
 		if (ftruncate(fd, len) != -1) {
 			if (write(fd, buf, len) == len) {
 				close(fd);
 				free(buf);
-				pane->dirty = 0;
+				pane->buf->dirty = 0;
 				editorSetStatusMessage("%d bytes written to disk", len);
 				return;
 			}
@@ -3772,6 +5220,28 @@ void editorSave() {
 }
 
 /*** drawing ***/
+/* Tells the grid how far the view moved since this pane was last drawn. */
+static void editorPaneScrollHint(editorPane *pane) {
+	int k = 0;
+	if (pane->drawn_buf == pane->buf && pane->drawn_coloff == pane->coloff) {
+		if (!(E.word_wrap && pane->wrap_lines)) {
+			k = pane->rowoff - pane->drawn_rowoff;
+		} else if (pane->rowoff > pane->drawn_rowoff ||
+			(pane->rowoff == pane->drawn_rowoff && pane->rowoff_wrap >= pane->drawn_wrap)) {
+			k = editorWrapDistance(pane, pane->drawn_rowoff, pane->drawn_wrap,
+				pane->rowoff, pane->rowoff_wrap, pane->height);
+		} else {
+			k = -editorWrapDistance(pane, pane->rowoff, pane->rowoff_wrap,
+				pane->drawn_rowoff, pane->drawn_wrap, pane->height);
+		}
+	}
+	pane->drawn_buf = pane->buf;
+	pane->drawn_rowoff = pane->rowoff;
+	pane->drawn_wrap = pane->rowoff_wrap;
+	pane->drawn_coloff = pane->coloff;
+	gridScrollHint(pane->x, pane->y, pane->width, pane->height, k);
+}
+
 void editorDrawPane(editorPane *pane, struct abuf *ab) {
 	(void)ab;
 	if (!pane) return;
@@ -3807,8 +5277,12 @@ void editorDrawPane(editorPane *pane, struct abuf *ab) {
 		return;
 	}
 
-	int wrap_width = pane->width - E.line_number_width;
-	if (wrap_width < 1) wrap_width = 1;
+	editorClampView(pane);
+	int wrap_width = editorWrapWidth(pane);
+	int wrap_row = pane->rowoff;
+	int wrap_sub = pane->rowoff_wrap;
+	editorSyntaxFlush(pane, pane->rowoff + pane->height);
+	editorPaneScrollHint(pane);
 
 	for (int screen_y = 0; screen_y < pane->height; screen_y++) {
 		int gy = pane->y + screen_y;
@@ -3818,24 +5292,23 @@ void editorDrawPane(editorPane *pane, struct abuf *ab) {
 		int wrap_line = 0;
 
 		if (E.word_wrap && pane->wrap_lines) {
-			int visual_row = 0;
-			for (int i = 0; i < pane->numrows; i++) {
-				int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-				if (lines < 1) lines = 1;
-				if (visual_row + lines > pane->rowoff + screen_y) {
-					filerow = i;
-					wrap_line = pane->rowoff + screen_y - visual_row;
-					break;
+			if (wrap_row < pane->buf->numrows) {
+				filerow = wrap_row;
+				wrap_line = wrap_sub;
+				if (wrap_sub + 1 < editorWrapLines(editorRow(pane, wrap_row), wrap_width)) {
+					wrap_sub++;
+				} else {
+					wrap_row++;
+					wrap_sub = 0;
 				}
-				visual_row += lines;
 			}
 		} else {
 			filerow = pane->rowoff + screen_y;
 			wrap_line = 0;
 		}
 
-		if (filerow >= 0 && filerow < pane->numrows) {
-			erow *row = &pane->row[filerow];
+		if (filerow >= 0 && filerow < pane->buf->numrows) {
+			erow *row = editorRowHighlighted(pane, filerow);
 
 			if (E.show_line_numbers) {
 				if (wrap_line == 0) {
@@ -3858,8 +5331,18 @@ void editorDrawPane(editorPane *pane, struct abuf *ab) {
 				end_col = MIN(pane->coloff + wrap_width, row->rsize);
 			}
 
+			const char *q = E.search.highlight ? E.search.query : NULL;
+			int qlen = q ? strlen(q) : 0;
+			char *match = NULL;
+			if (qlen && start_col < row->rsize)
+				match = strstr(&row->render[MAX(0, start_col - qlen + 1)], q);
+
 			int drawn = 0;
 			for (int j = start_col; j < end_col && drawn < wrap_width; j++) {
+				while (match && match - row->render + qlen <= j)
+					match = strstr(match + 1, q);
+				int is_match = match && match - row->render <= j;
+
 				int is_selected = pane == E.active_pane &&
 					(E.mode == MODE_VISUAL || E.mode == MODE_VISUAL_LINE) &&
 					editorIsInVisualSelection(filerow, j);
@@ -3870,7 +5353,9 @@ void editorDrawPane(editorPane *pane, struct abuf *ab) {
 					cell_bg = E.theme.visual_bg;
 				} else {
 					cell_bg = E.theme.bg;
-					if (row->hl && j < row->rsize && row->hl[j] == HL_NORMAL) {
+					if (is_match) {
+						cell_fg = editorSyntaxToRGB(HL_MATCH);
+					} else if (row->hl && j < row->rsize && row->hl[j] == HL_NORMAL) {
 						cell_fg = E.theme.fg;
 					} else if (row->hl && j < row->rsize) {
 						cell_fg = editorSyntaxToRGB(row->hl[j]);
@@ -3904,192 +5389,523 @@ void editorDrawPane(editorPane *pane, struct abuf *ab) {
 				}
 			}
 
-			int fill_start = (E.show_line_numbers ? E.line_number_width : 0) + drawn;
-			for (int x = fill_start; x < pane->width; x++) {
-				gridPutCh(pane->x + x, gy, ' ', E.theme.fg, E.theme.bg);
-			}
+			int fill_start = (E.show_line_numbers ? E.line_number_width : 0) + drawn;
+			for (int x = fill_start; x < pane->width; x++) {
+				gridPutCh(pane->x + x, gy, ' ', E.theme.fg, E.theme.bg);
+			}
+		} else {
+			if (E.show_line_numbers) {
+				for (int p = 0; p < E.line_number_width - 2; p++)
+					gridPutCh(pane->x + p, gy, ' ', E.theme.line_number, E.theme.bg);
+				gridPutStr(pane->x + E.line_number_width - 2, gy, "~ ", 2,
+					E.theme.line_number, E.theme.bg);
+			} else {
+				gridPutCh(pane->x, gy, '~', E.theme.line_number, E.theme.bg);
+			}
+			for (int i = E.show_line_numbers ? E.line_number_width : 1; i < pane->width; i++) {
+				gridPutCh(pane->x + i, gy, ' ', E.theme.fg, E.theme.bg);
+			}
+		}
+	}
+}
+
+/*** input ***/
+#define PASTE_CHUNK 16384
+#define PASTE_IDLE_READS 10	/* ~1s of silence ends a paste left open */
+#define INPUT_POLL_MS 100	/* wake-up tick while a load or a stream runs */
+#define STATUS_MSG_SECS 5	/* how long a status message stays up */
+static const char paste_end[] = "\x1b[201~";
+
+/* Bytes read from the terminal but not parsed yet. Room for a full read
+ * plus what a paste hands back after its terminator. */
+static char input_buf[2 * PASTE_CHUNK + 16];
+static int input_len, input_pos;
+
+/* --headless: the terminal lives in memory. Its size comes from --size,
+ * frames are counted instead of written, and keys come from a script,
+ * one per frame. A script is keys in vim notation (<Esc>, <CR>, <C-r>,
+ * <Up>, <lt>, ...); line breaks are not keys. Lines starting with '#'
+ * are comments, "#phase NAME" starts a timed phase and "#repeat N KEYS"
+ * types KEYS N times. When the keys run out hako reports and exits. */
+typedef struct headlessPhase {
+	char name[32];
+	int first;	/* index of its first key */
+	int keys, frames;
+	long long us;
+	long long flush_bytes, out_bytes;
+} headlessPhase;
+
+static struct {
+	const char *script;
+	struct abuf keys;	/* key bytes back to back */
+	int *key_off;		/* nkeys + 1 offsets into keys */
+	int nkeys, key_cap, pos;
+	headlessPhase *phases;
+	int nphases, phase;
+	long long phase_start_us;	/* 0 once the last phase is closed */
+} g_headless;
+
+static const struct { const char *name; const char *seq; } headless_keys[] = {
+	{ "Esc",      "\x1b" },
+	{ "CR",       "\r" },
+	{ "Enter",    "\r" },
+	{ "Tab",      "\t" },
+	{ "BS",       "\x7f" },
+	{ "Space",    " " },
+	{ "lt",       "<" },
+	{ "Del",      "\x1b[3~" },
+	{ "Up",       "\x1b[A" },
+	{ "Down",     "\x1b[B" },
+	{ "Right",    "\x1b[C" },
+	{ "Left",     "\x1b[D" },
+	{ "Home",     "\x1b[H" },
+	{ "End",      "\x1b[F" },
+	{ "PageUp",   "\x1b[5~" },
+	{ "PageDown", "\x1b[6~" },
+};
+
+static void headlessAddKey(const char *seq, int len) {
+	if (g_headless.nkeys + 2 > g_headless.key_cap) {
+		int cap = g_headless.key_cap ? g_headless.key_cap * 2 : 1024;
+		int *off = realloc(g_headless.key_off, sizeof(int) * cap);
+		if (!off) return;
+		g_headless.key_off = off;
+		g_headless.key_cap = cap;
+	}
+	g_headless.key_off[g_headless.nkeys] = g_headless.keys.len;
+	abAppend(&g_headless.keys, seq, len);
+	g_headless.key_off[++g_headless.nkeys] = g_headless.keys.len;
+}
+
+static void headlessAddPhase(const char *name) {
+	headlessPhase *p = realloc(g_headless.phases, sizeof(headlessPhase) * (g_headless.nphases + 1));
+	if (!p) return;
+	g_headless.phases = p;
+	p = &p[g_headless.nphases++];
+	memset(p, 0, sizeof(*p));
+	snprintf(p->name, sizeof(p->name), "%s", name);
+	p->first = g_headless.nkeys;
+}
+
+static void headlessParseKeys(const char *s, int len) {
+	/* keys before any #phase get one of their own, apart from startup */
+	if (g_headless.nphases == 1) headlessAddPhase("keys");
+	for (int i = 0; i < len; ) {
+		const char *gt = s[i] == '<' ? memchr(s + i, '>', len - i) : NULL;
+		if (gt) {
+			const char *name = s + i + 1;
+			int n = (int)(gt - name);
+			int found = 0;
+			if (n == 3 && (name[0] == 'C' || name[0] == 'c') && name[1] == '-') {
+				char c = CTRL_KEY(name[2]);
+				headlessAddKey(&c, 1);
+				found = 1;
+			}
+			for (int k = 0; !found && k < (int)(sizeof(headless_keys) / sizeof(headless_keys[0])); k++) {
+				if ((int)strlen(headless_keys[k].name) == n && strncasecmp(headless_keys[k].name, name, n) == 0) {
+					headlessAddKey(headless_keys[k].seq, strlen(headless_keys[k].seq));
+					found = 1;
+				}
+			}
+			if (found) {
+				i = (int)(gt - s) + 1;
+				continue;
+			}
+		}
+		int next = utf8_next_char(s, i, len);
+		headlessAddKey(s + i, next - i);
+		i = next;
+	}
+}
+
+/* Reads the script before the editor starts; path NULL runs no keys. */
+static int editorHeadlessLoad(const char *path) {
+	headlessAddPhase("startup");
+	g_headless.phase_start_us = editorNowUs();
+	if (!path) return 0;
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
+		if (line[0] != '#') {
+			headlessParseKeys(line, (int)len);
+		} else if (strncmp(line, "#phase ", 7) == 0) {
+			headlessAddPhase(line + 7);
+		} else if (strncmp(line, "#repeat ", 8) == 0) {
+			char *keys;
+			long n = strtol(line + 8, &keys, 10);
+			while (*keys == ' ') keys++;
+			for (long r = 0; r < n; r++) headlessParseKeys(keys, (int)strlen(keys));
+		}
+	}
+	free(line);
+	fclose(fp);
+	g_headless.script = path;
+	return 0;
+}
+
+static void headlessEndPhase(void) {
+	if (!g_headless.phase_start_us) return;
+	long long now = editorNowUs();
+	g_headless.phases[g_headless.phase].us += now - g_headless.phase_start_us;
+	g_headless.phase_start_us = now;
+}
+
+/* Called instead of a read: hands the parser the next scripted key,
+ * entering a new phase at its first key. Bytes still unparsed mean the
+ * parser wants the rest of an Esc sequence, and nothing follows. */
+static int editorHeadlessFill(void) {
+	if (input_len > 0) return input_len;
+	if (g_headless.pos == g_headless.nkeys) {
+		if (clawReplayPending()) return 0;
+		headlessEndPhase();
+		g_headless.phase_start_us = 0;
+		exit(0);
+	}
+	while (g_headless.phase + 1 < g_headless.nphases &&
+		g_headless.phases[g_headless.phase + 1].first <= g_headless.pos) {
+		headlessEndPhase();
+		g_headless.phase++;
+	}
+	int off = g_headless.key_off[g_headless.pos];
+	int n = g_headless.key_off[g_headless.pos + 1] - off;
+	memcpy(input_buf, g_headless.keys.b + off, n);
+	input_len = n;
+	g_headless.pos++;
+	g_headless.phases[g_headless.phase].keys++;
+	return input_len;
+}
+
+static void editorHeadlessFrame(size_t flush_bytes, size_t out_bytes) {
+	headlessPhase *p = &g_headless.phases[g_headless.phase];
+	p->frames++;
+	p->flush_bytes += flush_bytes;
+	p->out_bytes += out_bytes;
+}
+
+void editorHeadlessReport(void) {
+	headlessEndPhase();
+	g_headless.phase_start_us = 0;
+	printf("hako headless: %dx%d, %s, %d keys\n", E.headless_cols, E.headless_rows,
+		g_headless.script ? g_headless.script : "no script", g_headless.nkeys);
+	printf("  %-20s %8s %8s %10s %9s %12s %12s\n",
+		"phase", "keys", "frames", "ms", "us/key", "gridFlush B", "output B");
+	/* us/key for the total is over keyed phases only: startup has no keys */
+	headlessPhase total = { "total", 0, 0, 0, 0, 0, 0 };
+	long long keyed_us = 0;
+	for (int i = 0; i <= g_headless.nphases; i++) {
+		headlessPhase *p = i < g_headless.nphases ? &g_headless.phases[i] : &total;
+		if (p != &total) {
+			total.keys += p->keys;
+			total.frames += p->frames;
+			total.us += p->us;
+			total.flush_bytes += p->flush_bytes;
+			total.out_bytes += p->out_bytes;
+			if (p->keys > 0) keyed_us += p->us;
+		}
+		long long us = p == &total ? keyed_us : p->us;
+		char per_key[16] = "-";
+		if (p->keys > 0) snprintf(per_key, sizeof(per_key), "%.1f", (double)us / p->keys);
+		printf("  %-20s %8d %8d %10.1f %9s %12lld %12lld\n", p->name, p->keys, p->frames,
+			p->us / 1000.0, per_key, p->flush_bytes, p->out_bytes);
+	}
+	fflush(stdout);
+}
+
+/* Waits up to ms (-1: no limit, 0: not at all) for the terminal, then
+ * reads everything it has in one go. Returns the bytes left to parse. */
+static int editorFillInput(int ms) {
+	if (input_pos > 0) {
+		memmove(input_buf, &input_buf[input_pos], input_len - input_pos);
+		input_len -= input_pos;
+		input_pos = 0;
+	}
+	if (E.headless) return editorHeadlessFill();
+	int room = (int)sizeof(input_buf) - input_len;
+	if (room > PASTE_CHUNK) room = PASTE_CHUNK;
+	if (room <= 0 || (ms != 0 && !editorWaitInput(ms))) return input_len;
+
+	int r = read(STDIN_FILENO, &input_buf[input_len], room);
+	if (r == -1 && errno != EAGAIN && errno != EINTR) die("read");
+	if (r > 0) input_len += r;
+	return input_len;
+}
+
+/* Up to len raw bytes, waiting at most INPUT_POLL_MS for them. */
+static int editorReadInput(char *buf, int len) {
+	if (input_pos == input_len && editorFillInput(INPUT_POLL_MS) == 0) return 0;
+	int n = input_len - input_pos;
+	if (n > len) n = len;
+	memcpy(buf, &input_buf[input_pos], n);
+	input_pos += n;
+	return n;
+}
+
+/* Puts bytes back in front of whatever is still unparsed. */
+static void editorUnreadInput(const char *p, int n) {
+	int have = input_len - input_pos;
+	if (n + have > (int)sizeof(input_buf)) have = sizeof(input_buf) - n;
+	memmove(&input_buf[n], &input_buf[input_pos], have);
+	memcpy(input_buf, p, n);
+	input_pos = 0;
+	input_len = n + have;
+}
+
+/* Keys already waiting, buffered or on stdin. */
+static int editorInputQueued(void) {
+	return input_pos < input_len || E.paste_stream.active || editorInputPending();
+}
+
+static long long editorNowMs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static long long editorNowUs(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static void editorPasteEnd(void) {
+	E.paste_stream.active = 0;
+	editorSetStatusMessage("Pasted %lld bytes", E.paste_stream.bytes);
+}
+
+/* Feeds a bracketed paste into the buffer a chunk at a time, with no cap on
+ * its size. Returns 0 (no key) every ~30ms so the screen and the byte count
+ * on the status line keep up with multi-megabyte pastes. */
+static int editorPasteStream(void) {
+	pasteStream *ps = &E.paste_stream;
+	char chunk[PASTE_CHUNK + sizeof(ps->hold)];
+	struct timespec start, now;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	do {
+		int n = ps->held;
+		memcpy(chunk, ps->hold, n);
+		ps->held = 0;
+
+		int r = editorReadInput(&chunk[n], PASTE_CHUNK);
+		if (r == -1 && errno != EAGAIN && errno != EINTR) die("read");
+		if (r <= 0) {
+			if (++ps->idle < PASTE_IDLE_READS) {
+				memcpy(ps->hold, chunk, n);
+				ps->held = n;
+				break;
+			}
+			editorInsertText(chunk, n);
+			ps->bytes += n;
+			editorPasteEnd();
+			return 0;
+		}
+		ps->idle = 0;
+		n += r;
+
+		for (int i = 0; i + (int)sizeof(paste_end) - 1 <= n; i++) {
+			char *esc = memchr(&chunk[i], '\x1b', n - i);
+			if (!esc) break;
+			i = esc - chunk;
+			if (i + (int)sizeof(paste_end) - 1 > n) break;
+			if (memcmp(esc, paste_end, sizeof(paste_end) - 1) != 0) continue;
+
+			editorInsertText(chunk, i);
+			ps->bytes += i;
+			int rest = i + sizeof(paste_end) - 1;
+			editorUnreadInput(&chunk[rest], n - rest);
+			editorPasteEnd();
+			return 0;
+		}
+
+		int keep = n < (int)sizeof(paste_end) - 1 ? n : (int)sizeof(paste_end) - 2;
+		while (keep > 0 && memcmp(&chunk[n - keep], paste_end, keep) != 0) keep--;
+		if (n - keep > 0 && chunk[n - keep - 1] == '\r') keep++;
+		memcpy(ps->hold, &chunk[n - keep], keep);
+		ps->held = keep;
+		editorInsertText(chunk, n - keep);
+		ps->bytes += n - keep;
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+	} while ((now.tv_sec - start.tv_sec) * 1000 + (now.tv_nsec - start.tv_nsec) / 1000000 < 30);
+
+	editorSetStatusMessage("Pasting... %lld KB", ps->bytes / 1024);
+	return 0;
+}
+
+/* Escape sequences the terminal sends for keys. A param of 0 matches any
+ * (CSI 1;5A is still ARROW_UP). */
+typedef struct keySeq {
+	char final;
+	int param;
+	int key;
+} keySeq;
+
+static const keySeq csi_keys[] = {
+	{'A', 0, ARROW_UP}, {'B', 0, ARROW_DOWN}, {'C', 0, ARROW_RIGHT}, {'D', 0, ARROW_LEFT},
+	{'H', 0, HOME_KEY}, {'F', 0, END_KEY},
+	{'~', 1, HOME_KEY}, {'~', 3, DEL_KEY}, {'~', 4, END_KEY}, {'~', 5, PAGE_UP},
+	{'~', 6, PAGE_DOWN}, {'~', 7, HOME_KEY}, {'~', 8, END_KEY}, {'~', 200, PASTE_BEGIN},
+	{0, 0, 0}
+};
+
+static const keySeq ss3_keys[] = {
+	{'A', 0, ARROW_UP}, {'B', 0, ARROW_DOWN}, {'C', 0, ARROW_RIGHT}, {'D', 0, ARROW_LEFT},
+	{'H', 0, HOME_KEY}, {'F', 0, END_KEY},
+	{0, 0, 0}
+};
+
+static int editorLookupKey(const keySeq *table, char final, int param) {
+	for (const keySeq *k = table; k->final; k++)
+		if (k->final == final && (k->param == 0 || k->param == param)) return k->key;
+	return 0;
+}
+
+/* SGR mouse report: CSI < button ; x ; y M/m */
+static int editorMouseKey(const int *arg, int nargs, char final) {
+	if (nargs != 3) return 0;
+	int button = arg[0];
+	if (button == 64) return MOUSE_WHEEL_UP;
+	if (button == 65) return MOUSE_WHEEL_DOWN;
+	if (button >= 0 && button <= 2 && final == 'M') {
+		E.mouse_x = arg[1] - 1;
+		E.mouse_y = arg[2] - 1;
+		E.mouse_button = button;
+		return MOUSE_CLICK;
+	}
+	if (button >= 32 && button <= 35) return MOUSE_MOTION;
+	return 0;
+}
+
+/* kitty keyboard protocol: CSI code ; modifiers u */
+static int editorKittyKey(const int *arg, int nargs) {
+	int code = arg[0];
+	int mods = nargs > 1 && arg[1] > 0 ? arg[1] - 1 : 0;
+	if (code == 13 || code == 9 || code == 27 || code == 127) return code;
+	if (code >= 32 && code < 127) {
+		if ((mods & 4) && isalpha(code)) return CTRL_KEY(code);
+		return code;
+	}
+	return 0;
+}
+
+/* Parses one key off the front of p. Returns the bytes it used, or 0 if
+ * the sequence is cut short and more input may complete it. Sequences
+ * that parse but mean nothing here come back as key 0. */
+static int editorParseKey(const char *p, int n, int *key) {
+	*key = (unsigned char)p[0];
+	if (p[0] != '\x1b') return 1;
+	if (n < 2) return 0;
+
+	if (p[1] == 'O') {
+		if (n < 3) return 0;
+		*key = editorLookupKey(ss3_keys, p[2], 0);
+		return 3;
+	}
+	if (p[1] != '[') {
+		*key = '\x1b';	/* Esc then an ordinary key: leave that key queued */
+		return 1;
+	}
+
+	int arg[8] = {0}, nargs = 0, priv = 0;
+	int i = 2;
+	if (i < n && (p[i] == '<' || p[i] == '>' || p[i] == '?')) priv = p[i++];
+	for (; i < n; i++) {
+		unsigned char c = p[i];
+		if (c >= '0' && c <= '9') {
+			if (nargs == 0) nargs = 1;
+			if (nargs <= 8) arg[nargs - 1] = arg[nargs - 1] * 10 + (c - '0');
+		} else if (c == ';' || c == ':') {
+			if (nargs == 0) nargs = 1;
+			nargs++;	/* kitty's ':' sub-fields are kept as extra args */
+		} else if (c >= 0x20 && c <= 0x2F) {
+			continue;	/* intermediate bytes */
+		} else if (c >= 0x40 && c <= 0x7E) {
+			if (nargs > 8) nargs = 8;
+			if (priv == '<') *key = (c == 'M' || c == 'm') ? editorMouseKey(arg, nargs, c) : 0;
+			else if (priv) *key = 0;
+			else if (c == 'u' && nargs > 0) *key = editorKittyKey(arg, nargs);
+			else *key = editorLookupKey(csi_keys, c, arg[0]);
+			return i + 1;
 		} else {
-			if (E.show_line_numbers) {
-				for (int p = 0; p < E.line_number_width - 2; p++)
-					gridPutCh(pane->x + p, gy, ' ', E.theme.line_number, E.theme.bg);
-				gridPutStr(pane->x + E.line_number_width - 2, gy, "~ ", 2,
-					E.theme.line_number, E.theme.bg);
-			} else {
-				gridPutCh(pane->x, gy, '~', E.theme.line_number, E.theme.bg);
-			}
-			for (int i = E.show_line_numbers ? E.line_number_width : 1; i < pane->width; i++) {
-				gridPutCh(pane->x + i, gy, ' ', E.theme.fg, E.theme.bg);
-			}
+			*key = 0;	/* not a CSI after all: drop what was read */
+			return i;
 		}
 	}
+	return 0;
 }
 
-/*** input ***/
+/* ms until something redraws on its own: the Rei spinner, load progress
+ * or a status message running out. -1 when nothing is due. */
+static int editorNextTimer(void) {
+	int ms = -1;
+	int is_streaming = (E.right_panel && E.right_panel->type == PANE_AI && E.right_panel->ai && E.right_panel->ai->streaming);
+	if (is_streaming || E.loading) ms = INPUT_POLL_MS;
+
+	if (E.statusmsg[0] && E.statusmsg_time) {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		long long left = ((long long)E.statusmsg_time + STATUS_MSG_SECS) * 1000
+			- ((long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000);
+		if (left > 0 && (ms < 0 || left < ms)) ms = (int)left + 10;
+	}
+	return ms;
+}
+
+/* Next key from the terminal. Input is read in bulk and parsed from the
+ * buffer; an Esc that could start a sequence waits escape_timeout ms for
+ * the rest. Otherwise this is where the editor sleeps: in poll, until a
+ * key, a wake-up or the next timer. Returns 0 for the latter two so the
+ * caller redraws. */
 int editorReadKey() {
-	static int was_streaming = 0;
-	int nread;
-	char c;
+	if (E.paste_stream.active) {
+		E.frame_rei_only = 0;
+		return editorPasteStream();
+	}
+
+	for (;;) {
+		int have = input_len - input_pos;
+		if (have > 0) {
+			E.frame_rei_only = 0;
+			int key;
+			int used = editorParseKey(&input_buf[input_pos], have, &key);
+			if (used == 0) {
+				if (editorFillInput(E.escape_timeout) > have) continue;
+				key = '\x1b';	/* timed out: a lone Esc */
+				used = 1;
+			}
+			input_pos += used;
 
-	while ((nread = read(STDIN_FILENO, &c, 1)) != 1) {
-		if (nread == -1 && errno != EAGAIN) die("read");
+			if (key == PASTE_BEGIN) {
+				editorSaveState();
+				E.paste_stream.active = 1;
+				E.paste_stream.idle = 0;
+				E.paste_stream.bytes = 0;
+				E.paste_stream.held = 0;
+				return editorPasteStream();
+			}
+			return key;
+		}
 
 #ifndef _WIN32
 		if (winch_received) {
 			winch_received = 0;
 			editorUpdateWindowSize();
 			editorResizePanes();
+			E.frame_rei_only = 0;
 			return CTRL_KEY('l');
 		}
 #endif
-		int is_streaming = (E.right_panel && E.right_panel->type == PANE_AI && E.right_panel->ai && E.right_panel->ai->streaming);
-		if (is_streaming) { was_streaming = 1; return 0; }
-		if (was_streaming) { was_streaming = 0; return 0; }
-	}
-
-	if (c == '\x1b') {
-		char seq[32];
-
-		if (read(STDIN_FILENO, &seq[0], 1) != 1) return '\x1b';
-		if (read(STDIN_FILENO, &seq[1], 1) != 1) return '\x1b';
-
-		if (seq[0] == '[') {
-			if (seq[1] == '<') {
-				int idx = 2;
-				while (idx < 31) {
-					if (read(STDIN_FILENO, &seq[idx], 1) != 1) break;
-					if (seq[idx] == 'M' || seq[idx] == 'm') {
-						seq[idx + 1] = '\0';
-						break;
-					}
-					idx++;
-				}
-
-				int button, x, y;
-				char release;
-				if (sscanf(&seq[2], "%d;%d;%d%c", &button, &x, &y, &release) == 4) {
-					if (button == 64) {
-						return MOUSE_WHEEL_UP;
-					} else if (button == 65) {
-						return MOUSE_WHEEL_DOWN;
-					} else if ((button == 0 || button == 1 || button == 2) && release == 'M') {
-						E.mouse_x = x - 1;
-						E.mouse_y = y - 1;
-						E.mouse_button = button;
-						return MOUSE_CLICK;
-					} else if (button >= 32 && button <= 35) {
-						return MOUSE_MOTION;
-					}
-				}
-				return 0;
-			}
-			
-			if (seq[1] >= '0' && seq[1] <= '9') {
-				if (read(STDIN_FILENO, &seq[2], 1) != 1) return '\x1b';
-				if (seq[2] == '~') {
-					switch (seq[1]) {
-					case '1': return HOME_KEY;
-					case '3': return DEL_KEY;
-					case '4': return END_KEY;
-					case '5': return PAGE_UP;
-					case '6': return PAGE_DOWN;
-					case '7': return HOME_KEY;
-					case '8': return END_KEY;
-					}
-				}
-				if (seq[1] == '1' && seq[2] == ';') {
-					if (read(STDIN_FILENO, &seq[3], 1) != 1) return '\x1b';
-					if (read(STDIN_FILENO, &seq[4], 1) != 1) return '\x1b';
-					switch (seq[4]) {
-					case 'A': return ARROW_UP;
-					case 'B': return ARROW_DOWN;
-					case 'C': return ARROW_RIGHT;
-					case 'D': return ARROW_LEFT;
-					case 'H': return HOME_KEY;
-					case 'F': return END_KEY;
-					}
-					return '\x1b';
-				}
-				if (seq[1] == '2' && seq[2] == '0') {
-					if (read(STDIN_FILENO, &seq[3], 1) != 1) return '\x1b';
-					if (seq[3] == '0') {
-						if (read(STDIN_FILENO, &seq[4], 1) != 1) return '\x1b';
-						if (seq[4] == '~') {
-							char paste_buffer[65536];
-							int paste_len = 0;
-							
-							editorSaveState();
-							E.is_pasting = 1;
-							int saved_auto_indent = E.auto_indent;
-							int saved_smart_indent = E.smart_indent;
-							E.auto_indent = 0;
-							E.smart_indent = 0;
-							
-							while (1) {
-								if (read(STDIN_FILENO, &c, 1) != 1) break;
-								
-								if (c == '\x1b') {
-									char end_seq[5];
-									if (read(STDIN_FILENO, &end_seq[0], 1) == 1 &&
-										read(STDIN_FILENO, &end_seq[1], 1) == 1 &&
-										read(STDIN_FILENO, &end_seq[2], 1) == 1 &&
-										read(STDIN_FILENO, &end_seq[3], 1) == 1) {
-										if (end_seq[0] == '[' && end_seq[1] == '2' &&
-											end_seq[2] == '0' && end_seq[3] == '1') {
-											if (read(STDIN_FILENO, &c, 1) == 1 && c == '~') {
-												paste_buffer[paste_len] = '\0';
-												
-												for (int i = 0; i < paste_len; i++) {
-													if (paste_buffer[i] == '\n' || paste_buffer[i] == '\r') {
-														if (paste_buffer[i] == '\r' && i + 1 < paste_len && paste_buffer[i + 1] == '\n') {
-															i++;
-														}
-														editorInsertNewLine();
-													} else if (paste_buffer[i] != '\0') {
-														editorInsertChar(paste_buffer[i]);
-													}
-												}
-												
-												E.auto_indent = saved_auto_indent;
-												E.smart_indent = saved_smart_indent;
-												E.is_pasting = 0;
-												editorSetStatusMessage("Pasted %d bytes", paste_len);
-												return 0;
-											}
-										}
-									}
-								}
-								
-								if (paste_len < sizeof(paste_buffer) - 1) {
-									paste_buffer[paste_len++] = c;
-								}
-							}
-							
-							E.auto_indent = saved_auto_indent;
-							E.smart_indent = saved_smart_indent;
-							E.is_pasting = 0;
-						}
-					}
-				}
-			} else {
-				switch (seq[1]) {
-				case 'A': return ARROW_UP;
-				case 'B': return ARROW_DOWN;
-				case 'C': return ARROW_RIGHT;
-				case 'D': return ARROW_LEFT;
-				case 'H': return HOME_KEY;
-				case 'F': return END_KEY;
-				}
-			}
-		} else if (seq[0] == 'O') {
-			switch (seq[1]) {
-			case 'H': return HOME_KEY;
-			case 'F': return END_KEY;
-			}
-		}
-
-		return '\x1b';
-	} else {
-		return c;
+		if (E.headless && editorFillInput(0) > 0) continue;
+		if (editorWaitEvent(editorNextTimer()) && editorFillInput(0) > 0) continue;
+#ifndef _WIN32
+		if (winch_received) continue;
+#endif
+		if (E.loading) E.frame_rei_only = 0;
+		return 0;
 	}
 }
 
@@ -4181,34 +5997,21 @@ void editorProcessMouse(int button, int x, int y) {
 				int rel_y = y - pane->y;
 				int file_y, file_x;
 				if (E.word_wrap && pane->wrap_lines) {
-					int wrap_width = pane->width - E.line_number_width;
-					if (wrap_width < 1) wrap_width = 1;
-					int target_visual = rel_y + pane->rowoff;
-					int visual = 0;
-					int found = 0;
-					for (int r = 0; r < pane->numrows; r++) {
-						int lines = (pane->row[r].rsize + wrap_width - 1) / wrap_width;
-						if (lines < 1) lines = 1;
-						if (visual + lines > target_visual) {
-							file_y = r;
-							int seg = target_visual - visual;
-							file_x = seg * wrap_width + (x - pane->x - E.line_number_width);
-							found = 1;
-							break;
-						}
-						visual += lines;
-					}
-					if (!found) {
-						file_y = pane->numrows - 1;
+					int seg = pane->rowoff_wrap;
+					file_y = pane->rowoff;
+					if (editorWrapStep(pane, &file_y, &seg, rel_y) == rel_y) {
+						file_x = seg * editorWrapWidth(pane) + (x - pane->x - E.line_number_width);
+					} else {
+						file_y = pane->buf->numrows - 1;
 						file_x = 0;
 					}
 				} else {
 					file_y = rel_y + pane->rowoff;
 					file_x = x - pane->x - E.line_number_width + pane->coloff;
 				}
-				if (file_y >= 0 && file_y < pane->numrows && file_x >= 0) {
+				if (file_y >= 0 && file_y < pane->buf->numrows && file_x >= 0) {
 					pane->cy = file_y;
-					pane->cx = editorRowRxToCx(&pane->row[file_y], file_x);
+					pane->cx = editorRowRxToCx(editorRow(pane, file_y), file_x);
 				}
 			}
 			
@@ -4258,12 +6061,12 @@ void editorHandleScroll(int direction) {
 		for (int i = 0; i < amount && pane->cy > 0; i++)
 			pane->cy--;
 	} else if (direction == MOUSE_WHEEL_DOWN) {
-		for (int i = 0; i < amount && pane->cy < pane->numrows - 1; i++)
+		for (int i = 0; i < amount && pane->cy < pane->buf->numrows - 1; i++)
 			pane->cy++;
 	}
 
-	if (pane->cy < pane->numrows) {
-		int rowlen = pane->row[pane->cy].size;
+	if (pane->cy < pane->buf->numrows) {
+		int rowlen = editorRow(pane, pane->cy)->size;
 		if (pane->cx > rowlen) pane->cx = rowlen;
 	}
 }
@@ -4298,7 +6101,7 @@ void editorSetMode(enum editorMode mode) {
 		cursor_seq = "\x1b[6 q";
 		break;
 	}
-	if (cursor_seq) write(STDOUT_FILENO, cursor_seq, strlen(cursor_seq));
+	if (cursor_seq && !E.headless) write(STDOUT_FILENO, cursor_seq, strlen(cursor_seq));
 }
 
 void editorColonCommand() {
@@ -4317,14 +6120,14 @@ void editorColonCommand() {
 		int line = atoi(cmd);
 		if (line < 1) line = 1;
 
-		if (pane->numrows == 0) {
+		if (pane->buf->numrows == 0) {
 			editorSetStatusMessage("No lines in file");
 			free(cmd);
 			return;
 		}
 
-		if (line > pane->numrows) {
-			line = pane->numrows;
+		if (line > pane->buf->numrows) {
+			line = pane->buf->numrows;
 			editorSetStatusMessage("Line %d out of range, moved to line %d", atoi(cmd), line);
 		}
 
@@ -4332,6 +6135,7 @@ void editorColonCommand() {
 		pane->cy = line - 1;
 		pane->cx = 0;
 		pane->rowoff = pane->cy;
+		pane->rowoff_wrap = 0;
 		free(cmd);
 		return;
 	}
@@ -4377,7 +6181,7 @@ void editorColonCommand() {
 		}
 
 		if (total_panes > 1 && lcount > 1) {
-			if (E.active_pane && E.active_pane->type == PANE_EDITOR && E.active_pane->dirty) {
+			if (E.active_pane && E.active_pane->type == PANE_EDITOR && E.active_pane->buf->dirty) {
 				editorSetStatusMessage("Unsaved changes. :w then :q, or :q! to force.");
 			} else {
 				editorClosePane();
@@ -4391,7 +6195,7 @@ void editorColonCommand() {
 		int count = 0;
 		editorCollectLeafPanes(E.root_pane, &panes, &count);
 		for (int i = 0; i < count; i++) {
-			if (panes[i]->type == PANE_EDITOR && panes[i]->dirty) { has_unsaved = 1; break; }
+			if (panes[i]->type == PANE_EDITOR && panes[i]->buf->dirty) { has_unsaved = 1; break; }
 		}
 		free(panes);
 
@@ -4422,14 +6226,14 @@ void editorColonCommand() {
 		char *filename = cmd + 2;
 		while (*filename == ' ') filename++;
 		if (*filename && pane && pane->type == PANE_EDITOR) {
-			free(pane->filename);
-			pane->filename = strdup(filename);
+			free(pane->buf->filename);
+			pane->buf->filename = strdup(filename);
 			editorSelectSyntaxHighlight();
 			editorSave();
 		}
 	} else if (strcmp(cmd, "wq") == 0 || strcmp(cmd, "x") == 0) {
 		editorSave();
-		if (!pane || !pane->dirty) {
+		if (!pane || !pane->buf->dirty) {
 			exit(0);
 		}
 	} else if (strcmp(cmd, "help") == 0 || strcmp(cmd, "h") == 0) {
@@ -4491,14 +6295,9 @@ void editorColonCommand() {
 		}
 
 		if (*filename && pane && pane->type == PANE_EDITOR) {
-			for (int i = 0; i < pane->numrows; i++) {
-				editorFreeRow(&pane->row[i]);
-			}
-			free(pane->row);
-			pane->row = NULL;
-			pane->numrows = 0;
+			editorDetachBuffer(pane);
 			pane->cx = pane->cy = 0;
-			pane->rowoff = pane->coloff = 0;
+			pane->rowoff = pane->coloff = pane->rowoff_wrap = 0;
 
 			editorOpen(filename);
 		} else {
@@ -4535,24 +6334,27 @@ void editorColonCommand() {
 
 		editorSaveState();
 		int start_y = all_lines ? 0 : pane->cy;
-		int end_y = all_lines ? pane->numrows - 1 : pane->cy;
+		int end_y = all_lines ? pane->buf->numrows - 1 : pane->cy;
 		int total_subs = 0;
-		for (int y = start_y; y <= end_y && y < pane->numrows; y++) {
-			erow *row = &pane->row[y];
+		for (int y = start_y; y <= end_y && y < pane->buf->numrows; y++) {
+			erow *row = editorRow(pane, y);
 			int i = 0;
 			while (i <= row->size - plen) {
 				if (memcmp(&row->chars[i], pat, plen) == 0) {
+					undoRecordChange(row);
 					int new_size = row->size - plen + rlen;
 					char *nb = malloc(new_size + 1);
 					memcpy(nb, row->chars, i);
 					memcpy(nb + i, rep, rlen);
 					memcpy(nb + i + rlen, row->chars + i + plen, row->size - i - plen);
 					nb[new_size] = '\0';
-					free(row->chars);
+					if (!row->mapped) free(row->chars);
+					row->mapped = 0;
 					row->chars = nb;
 					row->size = new_size;
+					row->cap = new_size + 1;
 					editorUpdateRow(row);
-					pane->dirty++;
+					pane->buf->dirty++;
 					total_subs++;
 					if (!global) break;
 					i += rlen;
@@ -4616,17 +6418,23 @@ void editorDrawStatusBar(struct abuf *ab) {
 	char status[80], rstatus[80];
 
 	if (pane && pane->type == PANE_EDITOR) {
-		const char *display_name = pane->filename;
+		const char *display_name = pane->buf->filename;
 		if (display_name) {
 			const char *slash = strrchr(display_name, '/');
 			if (slash) display_name = slash + 1;
 		}
 		int len = snprintf(status, sizeof(status), " %.20s %s",
 			display_name ? display_name : "[No Name]",
-			pane->dirty ? "[+]" : "");
-		int rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d ",
-			pane->syntax ? pane->syntax->filetype : "text",
-			pane->cy + 1, pane->cx + 1);
+			pane->buf->dirty ? "[+]" : "");
+		int rlen;
+		if (pane->buf->loader) {
+			rlen = snprintf(rstatus, sizeof(rstatus), "loading %d%% | %d:%d ",
+				editorLoaderPercent(pane), pane->cy + 1, pane->cx + 1);
+		} else {
+			rlen = snprintf(rstatus, sizeof(rstatus), "%s | %d:%d ",
+				pane->buf->syntax ? pane->buf->syntax->filetype : "text",
+				pane->cy + 1, pane->cx + 1);
+		}
 		if (len > E.screencols) len = E.screencols;
 		gridPutStr(0, gy, status, len, sb_fg, sb_bg);
 		if (rlen <= E.screencols - len) {
@@ -4677,7 +6485,7 @@ void editorDrawMessageBar(struct abuf *ab) {
 
 	int msglen = strlen(E.statusmsg);
 	if (msglen > E.screencols) msglen = E.screencols;
-	if (msglen && time(NULL) - E.statusmsg_time < 5) {
+	if (msglen && time(NULL) - E.statusmsg_time < STATUS_MSG_SECS) {
 		gridPutStr(0, gy, E.statusmsg, msglen, msg_fg, msg_bg);
 	} else {
 		const char *mode_str = "";
@@ -4701,6 +6509,10 @@ void editorRefreshScreen() {
 		return;
 	}
 
+	editorLoaderPollAll();
+	clawPollEvents();
+	long long frame_us = editorNowUs();
+
 #ifndef _WIN32
 	if (winch_received) {
 		winch_received = 0;
@@ -4718,8 +6530,8 @@ void editorRefreshScreen() {
 		int max_line = 0;
 		for (int i = 0; i < leaf_count; i++) {
 			if (all_leaves[i] && all_leaves[i]->type == PANE_EDITOR
-				&& all_leaves[i]->numrows > max_line) {
-				max_line = all_leaves[i]->numrows;
+				&& all_leaves[i]->buf->numrows > max_line) {
+				max_line = all_leaves[i]->buf->numrows;
 			}
 		}
 		free(all_leaves);
@@ -4734,44 +6546,64 @@ void editorRefreshScreen() {
 
 	editorScroll();
 
-	struct abuf ab = ABUF_INIT;
+	struct abuf *ab = &E.outbuf;
+	ab->len = 0;
 
-	abAppend(&ab, "\x1b[?25l", 6);
+	abAppend(ab, "\x1b[?25l", 6);
 	if (E.full_redraw_pending) {
-		abAppend(&ab, "\x1b[2J", 4);
-		abAppend(&ab, "\x1b[H", 3);
+		abAppend(ab, "\x1b[2J", 4);
+		abAppend(ab, "\x1b[H", 3);
 		gridInvalidateFront();
 		E.full_redraw_pending = 0;
+		E.frame_rei_only = 0;
 	}
 
-	gridClear(E.theme.bg);
-	editorDrawRows(&ab);
-	editorDrawStatusBar(&ab);
-	editorDrawMessageBar(&ab);
-	gridFlush(&ab);
+	/* Woken only by Rei: the rest of the back grid still holds the last
+	 * frame, so redraw just the Rei pane and the bars below it. */
+	int rei_only = E.frame_rei_only && E.right_panel && E.right_panel->type == PANE_AI &&
+		E.right_panel->width > 0;
+	if (rei_only) {
+		editorDrawPane(E.right_panel, ab);
+	} else {
+		gridBeginFrame();
+		editorDrawRows(ab);
+	}
+	E.frame_rei_only = 0;
+	editorDrawStatusBar(ab);
+	editorDrawMessageBar(ab);
+	if (!rei_only) gridEndFrame(E.theme.bg);
+
+	/* The palette filled up: cells already in both grids hold indices into
+	 * it, so start a fresh one and paint the whole frame again. Only a
+	 * frame with more colors than the palette holds keeps nearest ones. */
+	if (E.palette_full) {
+		gridPaletteReset();
+		gridInvalidateFront();
+		E.grid_scroll_n = 0;
+		gridBeginFrame();
+		editorDrawRows(ab);
+		editorDrawStatusBar(ab);
+		editorDrawMessageBar(ab);
+		gridEndFrame(E.theme.bg);
+		E.palette_full = 0;
+	}
+	int flush_start = ab->len;
+	gridFlush(ab);
+	int flush_bytes = ab->len - flush_start;
 
 	editorPane *pane = E.active_pane;
 	if (pane && pane->type == PANE_EDITOR) {
 		int cursor_x = pane->x + E.line_number_width + 1;
 		int cursor_y = pane->y + 1;
 
-		if (E.word_wrap && pane->wrap_lines && pane->cy < pane->numrows) {
-			int wrap_width = pane->width - E.line_number_width;
-			if (wrap_width <= 0) wrap_width = 1;
-
-			int visual_row = 0;
-			for (int i = 0; i < pane->cy; i++) {
-				int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-				if (lines < 1) lines = 1;
-				visual_row += lines;
-			}
+		if (E.word_wrap && pane->wrap_lines && pane->cy < pane->buf->numrows) {
+			int wrap_width = editorWrapWidth(pane);
 
-			int rx = editorRowCxToRx(&pane->row[pane->cy], pane->cx);
+			int rx = editorRowCxToRx(editorRow(pane, pane->cy), pane->cx);
 			int line_in_wrap = rx / wrap_width;
 			int col_in_line = rx % wrap_width;
-			visual_row += line_in_wrap;
 			
-			cursor_y = pane->y + (visual_row - pane->rowoff) + 1;
+			cursor_y = pane->y + editorWrapOffset(pane, pane->cy, line_in_wrap, pane->height) + 1;
 			cursor_x = pane->x + E.line_number_width + col_in_line + 1;
 		} else {
 			cursor_y = pane->y + (pane->cy - pane->rowoff) + 1;
@@ -4785,14 +6617,14 @@ void editorRefreshScreen() {
 
 		char buf[32];
 		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", cursor_y, cursor_x);
-		abAppend(&ab, buf, strlen(buf));
+		abAppend(ab, buf, strlen(buf));
 	} else if (pane && pane->type == PANE_EXPLORER && pane->explorer) {
 		explorerData *edata = pane->explorer;
 		int row = pane->y + 2 + (edata->selected - edata->scroll_offset) + 1;
 		int col = pane->x + 2;
 		char buf[32];
 		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, col);
-		abAppend(&ab, buf, strlen(buf));
+		abAppend(ab, buf, strlen(buf));
 	} else if (pane && pane->type == PANE_AI && pane->ai) {
 		aiData *adata = pane->ai;
 		int inner_w = pane->width - 1 - 2;
@@ -4849,16 +6681,48 @@ void editorRefreshScreen() {
 		int col = pane->x + 1 + 1 + 2 + col_in_line + 1;
 		char buf[32];
 		snprintf(buf, sizeof(buf), "\x1b[%d;%dH", row, col);
-		abAppend(&ab, buf, strlen(buf));
+		abAppend(ab, buf, strlen(buf));
 	}
 
-	abAppend(&ab, "\x1b[?25h", 6);
+	abAppend(ab, "\x1b[?25h", 6);
 
-	write(STDOUT_FILENO, ab.b, ab.len);
-	abFree(&ab);
+	if (E.headless) editorHeadlessFrame(flush_bytes, ab->len);
+	else write(STDOUT_FILENO, ab->b, ab->len);
+	clawReplayFrame(frame_us, ab->len);
 }
 
 /*** input processing ***/
+#define INPUT_BATCH_MAX_MS 33	/* a flood of input still gets ~30 frames/s */
+
+static int input_last_key;
+
+/* Handles keys until nothing more is queued, so a burst of input (key
+ * repeat, fast typing, wheel and motion reports) costs one frame. Frames
+ * are also kept 1/max_fps apart; keys arriving in the gap join the batch.
+ * Mouse motion on its own never asks for a frame. */
+void editorProcessInput(void) {
+	int interval = E.max_fps > 0 ? 1000 / E.max_fps : 0;
+
+	E.frame_rei_only = 1;
+	do {
+		editorProcessKeyPress();
+	} while (input_last_key == MOUSE_MOTION);
+
+	long long start = editorNowMs();
+	for (;;) {
+		long long now = editorNowMs();
+		if (editorInputQueued()) {
+			if (now - start >= MAX(interval, INPUT_BATCH_MAX_MS)) break;
+			editorProcessKeyPress();
+		} else if (now < E.last_frame_ms + interval) {
+			if (!editorWaitInput(E.last_frame_ms + interval - now)) break;
+		} else {
+			break;
+		}
+	}
+	E.last_frame_ms = editorNowMs();
+}
+
 static int hkReadKeyBlocking(void) {
 	int k;
 	do { k = editorReadKey(); }
@@ -4928,15 +6792,15 @@ static void hkDotRepeat(void) {
 		hkReplayInsert();
 		break;
 	case 'a':
-		if (pane->cy < pane->numrows && pane->cx < pane->row[pane->cy].size) pane->cx++;
+		if (pane->cy < pane->buf->numrows && pane->cx < editorRow(pane, pane->cy)->size) pane->cx++;
 		hkReplayInsert();
 		break;
 	case 'A':
-		if (pane->cy < pane->numrows) pane->cx = pane->row[pane->cy].size;
+		if (pane->cy < pane->buf->numrows) pane->cx = editorRow(pane, pane->cy)->size;
 		hkReplayInsert();
 		break;
 	case 'o':
-		if (pane->cy < pane->numrows) pane->cx = pane->row[pane->cy].size;
+		if (pane->cy < pane->buf->numrows) pane->cx = editorRow(pane, pane->cy)->size;
 		editorInsertNewLine();
 		hkReplayInsert();
 		break;
@@ -4947,43 +6811,40 @@ static void hkDotRepeat(void) {
 		break;
 	case 'x':
 		for (int k = 0; k < n; k++) {
-			if (pane->cy < pane->numrows && pane->cx < pane->row[pane->cy].size) {
-				editorRowDelChar(&pane->row[pane->cy], pane->cx);
-				if (pane->cx >= pane->row[pane->cy].size && pane->cx > 0) pane->cx--;
+			if (pane->cy < pane->buf->numrows && pane->cx < editorRow(pane, pane->cy)->size) {
+				editorRowDelChar(editorRow(pane, pane->cy), pane->cx);
+				if (pane->cx >= editorRow(pane, pane->cy)->size && pane->cx > 0) pane->cx--;
 			}
 		}
 		break;
 	case 'd':
-		for (int k = 0; k < n && pane->cy < pane->numrows; k++) {
+		for (int k = 0; k < n && pane->cy < pane->buf->numrows; k++) {
 			editorDelRow(pane->cy);
 		}
-		if (pane->numrows == 0) editorInsertRow(0, "", 0);
-		if (pane->cy >= pane->numrows) pane->cy = pane->numrows - 1;
+		if (pane->buf->numrows == 0) editorInsertRow(0, "", 0);
+		if (pane->cy >= pane->buf->numrows) pane->cy = pane->buf->numrows - 1;
 		pane->cx = 0;
 		break;
 	case 'J':
 		for (int k = 0; k < n; k++) {
-			if (pane->cy < pane->numrows - 1) {
-				pane->cx = pane->row[pane->cy].size;
-				if (pane->row[pane->cy].size > 0 && pane->row[pane->cy + 1].size > 0) editorInsertChar(' ');
-				editorRowAppendString(&pane->row[pane->cy], pane->row[pane->cy + 1].chars, pane->row[pane->cy + 1].size);
+			if (pane->cy < pane->buf->numrows - 1) {
+				pane->cx = editorRow(pane, pane->cy)->size;
+				if (editorRow(pane, pane->cy)->size > 0 && editorRow(pane, pane->cy + 1)->size > 0) editorInsertChar(' ');
+				editorRowAppendString(editorRow(pane, pane->cy), editorRow(pane, pane->cy + 1)->chars, editorRow(pane, pane->cy + 1)->size);
 				editorDelRow(pane->cy + 1);
 			}
 		}
 		break;
 	case 'w':
 	case 'W':
-		if (pane->cy < pane->numrows) {
-			erow *row = &pane->row[pane->cy];
+		if (pane->cy < pane->buf->numrows) {
+			erow *row = editorRow(pane, pane->cy);
 			int start = pane->cx;
 			int end = pane->cx;
 			while (end < row->size && !is_separator(row->chars[end])) end++;
 			while (end < row->size && is_separator(row->chars[end]) && row->chars[end] != '\n') end++;
 			if (end > start) {
-				memmove(&row->chars[start], &row->chars[end], row->size - end + 1);
-				row->size -= (end - start);
-				editorUpdateRow(row);
-				pane->dirty++;
+				editorRowDelRange(row, start, end - start);
 				if (pane->cx >= row->size && pane->cx > 0) pane->cx = row->size > 0 ? row->size - 1 : 0;
 			}
 			if (E.hk.last_op == 'W') hkReplayInsert();
@@ -4993,8 +6854,8 @@ static void hkDotRepeat(void) {
 }
 
 static int hkTextObject(editorPane *pane, int inner, int obj, int *sx, int *ex) {
-	if (pane->cy >= pane->numrows) return -1;
-	erow *row = &pane->row[pane->cy];
+	if (pane->cy >= pane->buf->numrows) return -1;
+	erow *row = editorRow(pane, pane->cy);
 	int cx = pane->cx;
 	if (cx > row->size) cx = row->size;
 
@@ -5076,7 +6937,7 @@ static int hkTextObject(editorPane *pane, int inner, int obj, int *sx, int *ex)
 }
 
 static void hkApplyLineOp(editorPane *pane, int op, int sx, int ex) {
-	erow *row = &pane->row[pane->cy];
+	erow *row = editorRow(pane, pane->cy);
 	int len = ex - sx + 1;
 	if (len <= 0) return;
 	if (op == 'y') {
@@ -5086,11 +6947,7 @@ static void hkApplyLineOp(editorPane *pane, int op, int sx, int ex) {
 	}
 	hkSetRegister(E.hk.pending_reg, &row->chars[sx], len, 0, 0);
 	E.hk.pending_reg = 0;
-	memmove(&row->chars[sx], &row->chars[ex + 1], row->size - ex - 1);
-	row->size -= len;
-	row->chars[row->size] = '\0';
-	editorUpdateRow(row);
-	pane->dirty++;
+	editorRowDelRange(row, sx, len);
 	pane->cx = sx;
 	if (pane->cx > row->size) pane->cx = row->size > 0 ? row->size - 1 : 0;
 	if (op == 'c') editorSetMode(MODE_INSERT);
@@ -5111,9 +6968,9 @@ void hkPushJump(int x, int y) {
 
 void hkClampCursor(editorPane *pane) {
 	if (pane->cy < 0) pane->cy = 0;
-	if (pane->cy >= pane->numrows) pane->cy = pane->numrows > 0 ? pane->numrows - 1 : 0;
-	if (pane->cy < pane->numrows && pane->cx > pane->row[pane->cy].size) {
-		pane->cx = pane->row[pane->cy].size;
+	if (pane->cy >= pane->buf->numrows) pane->cy = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
+	if (pane->cy < pane->buf->numrows && pane->cx > editorRow(pane, pane->cy)->size) {
+		pane->cx = editorRow(pane, pane->cy)->size;
 	}
 	if (pane->cx < 0) pane->cx = 0;
 }
@@ -5126,6 +6983,7 @@ void editorProcessKeyPress() {
 	static int last_action = 0;
 
 	int c = editorReadKey();
+	input_last_key = c;
 	
 	if (E.splash_active) {
 		if (c == MOUSE_WHEEL_UP || c == MOUSE_WHEEL_DOWN || c == MOUSE_MOTION || c == 0) {
@@ -5285,8 +7143,8 @@ void editorProcessKeyPress() {
 
 		switch (c) {
 		case '%': {
-			if (pane->cy >= pane->numrows) break;
-			erow *row = &pane->row[pane->cy];
+			if (pane->cy >= pane->buf->numrows) break;
+			erow *row = editorRow(pane, pane->cy);
 			int start = pane->cx;
 			int open = -1, close = -1, dir = 0;
 			const char *pairs = "()[]{}";
@@ -5306,8 +7164,8 @@ void editorProcessKeyPress() {
 			int y = pane->cy, x = start;
 			if (dir > 0) {
 				x++;
-				while (y < pane->numrows) {
-					erow *r = &pane->row[y];
+				while (y < pane->buf->numrows) {
+					erow *r = editorRow(pane, y);
 					while (x < r->size) {
 						if (r->chars[x] == open) depth++;
 						else if (r->chars[x] == close) {
@@ -5321,7 +7179,7 @@ void editorProcessKeyPress() {
 			} else {
 				x--;
 				while (y >= 0) {
-					erow *r = &pane->row[y];
+					erow *r = editorRow(pane, y);
 					while (x >= 0) {
 						if (r->chars[x] == open) depth++;
 						else if (r->chars[x] == close) {
@@ -5331,7 +7189,7 @@ void editorProcessKeyPress() {
 						x--;
 					}
 					y--;
-					if (y >= 0) x = pane->row[y].size - 1;
+					if (y >= 0) x = editorRow(pane, y)->size - 1;
 				}
 			}
 			editorSetStatusMessage("No matching bracket");
@@ -5342,8 +7200,8 @@ void editorProcessKeyPress() {
 
 		case '*':
 		case '#': {
-			if (pane->cy >= pane->numrows) break;
-			erow *row = &pane->row[pane->cy];
+			if (pane->cy >= pane->buf->numrows) break;
+			erow *row = editorRow(pane, pane->cy);
 			int s = pane->cx, e = pane->cx;
 			if (s >= row->size) break;
 			if (is_separator(row->chars[s])) {
@@ -5391,8 +7249,8 @@ void editorProcessKeyPress() {
 					hkPushJump(pane->cx, pane->cy);
 					pane->cy = E.hk.marks_y[i];
 					pane->cx = squote ? 0 : E.hk.marks_x[i];
-					if (squote && pane->cy < pane->numrows) {
-						erow *r = &pane->row[pane->cy];
+					if (squote && pane->cy < pane->buf->numrows) {
+						erow *r = editorRow(pane, pane->cy);
 						while (pane->cx < r->size && isspace((unsigned char)r->chars[pane->cx])) pane->cx++;
 					}
 					hkClampCursor(pane);
@@ -5438,8 +7296,8 @@ void editorProcessKeyPress() {
 
 		case 'I':
 			pane->cx = 0;
-			if (pane->cy < pane->numrows) {
-				erow *row = &pane->row[pane->cy];
+			if (pane->cy < pane->buf->numrows) {
+				erow *row = editorRow(pane, pane->cy);
 				while (pane->cx < row->size && isspace(row->chars[pane->cx]))
 					pane->cx++;
 			}
@@ -5449,8 +7307,8 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'a':
-			if (pane->cy < pane->numrows && pane->cx < pane->row[pane->cy].size) {
-				pane->cx = utf8_next_char(pane->row[pane->cy].chars, pane->cx, pane->row[pane->cy].size);
+			if (pane->cy < pane->buf->numrows && pane->cx < editorRow(pane, pane->cy)->size) {
+				pane->cx = utf8_next_char(editorRow(pane, pane->cy)->chars, pane->cx, editorRow(pane, pane->cy)->size);
 			}
 			hkRecordStart('a', hkConsumeCount());
 			editorSetMode(MODE_INSERT);
@@ -5459,8 +7317,8 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'A':
-			if (pane->cy < pane->numrows) {
-				pane->cx = pane->row[pane->cy].size;
+			if (pane->cy < pane->buf->numrows) {
+				pane->cx = editorRow(pane, pane->cy)->size;
 			}
 			hkRecordStart('A', hkConsumeCount());
 			editorSetMode(MODE_INSERT);
@@ -5468,8 +7326,8 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'o':
-			if (pane->cy < pane->numrows) {
-				pane->cx = pane->row[pane->cy].size;
+			if (pane->cy < pane->buf->numrows) {
+				pane->cx = editorRow(pane, pane->cy)->size;
 			}
 			editorSaveState();
 			editorInsertNewLine();
@@ -5496,12 +7354,12 @@ void editorProcessKeyPress() {
 			editorSaveState();
 			char *buf = NULL; int blen = 0; int bcap = 0;
 			for (int k = 0; k < n; k++) {
-				if (pane->cy < pane->numrows && pane->cx < pane->row[pane->cy].size) {
-					char ch = pane->row[pane->cy].chars[pane->cx];
+				if (pane->cy < pane->buf->numrows && pane->cx < editorRow(pane, pane->cy)->size) {
+					char ch = editorRow(pane, pane->cy)->chars[pane->cx];
 					if (blen + 1 > bcap) { bcap = bcap ? bcap * 2 : 16; buf = realloc(buf, bcap); }
 					buf[blen++] = ch;
-					editorRowDelChar(&pane->row[pane->cy], pane->cx);
-					if (pane->cx >= pane->row[pane->cy].size && pane->cx > 0) pane->cx--;
+					editorRowDelChar(editorRow(pane, pane->cy), pane->cx);
+					if (pane->cx >= editorRow(pane, pane->cy)->size && pane->cx > 0) pane->cx--;
 				}
 			}
 			if (blen > 0) hkSetRegister(E.hk.pending_reg, buf, blen, 0, 0);
@@ -5512,15 +7370,12 @@ void editorProcessKeyPress() {
 		}
 
 		case 'D':
-			if (pane->cy < pane->numrows) {
+			if (pane->cy < pane->buf->numrows) {
 				editorSaveState();
-				erow *row = &pane->row[pane->cy];
+				erow *row = editorRow(pane, pane->cy);
 				if (pane->cx < row->size) {
 					hkSetRegister(E.hk.pending_reg, &row->chars[pane->cx], row->size - pane->cx, 0, 0);
-					row->size = pane->cx;
-					row->chars[row->size] = '\0';
-					editorUpdateRow(row);
-					pane->dirty++;
+					editorRowTruncate(row, pane->cx);
 				}
 			}
 			E.hk.pending_reg = 0;
@@ -5529,15 +7384,12 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'C':
-			if (pane->cy < pane->numrows) {
+			if (pane->cy < pane->buf->numrows) {
 				editorSaveState();
-				erow *row = &pane->row[pane->cy];
+				erow *row = editorRow(pane, pane->cy);
 				if (pane->cx < row->size) {
 					hkSetRegister(E.hk.pending_reg, &row->chars[pane->cx], row->size - pane->cx, 0, 0);
-					row->size = pane->cx;
-					row->chars[row->size] = '\0';
-					editorUpdateRow(row);
-					pane->dirty++;
+					editorRowTruncate(row, pane->cx);
 				}
 			}
 			E.hk.pending_reg = 0;
@@ -5577,7 +7429,7 @@ void editorProcessKeyPress() {
 			if (g_pressed) {
 				int target = E.hk.pending_count > 0 ? E.hk.pending_count - 1 : 0;
 				if (target < 0) target = 0;
-				if (pane->numrows > 0 && target >= pane->numrows) target = pane->numrows - 1;
+				if (pane->buf->numrows > 0 && target >= pane->buf->numrows) target = pane->buf->numrows - 1;
 				hkPushJump(pane->cx, pane->cy);
 				pane->cy = target;
 				pane->cx = 0;
@@ -5585,7 +7437,7 @@ void editorProcessKeyPress() {
 				g_pressed = 0;
 				if (d_pressed) {
 					editorSaveState();
-					while (pane->numrows > 0) {
+					while (pane->buf->numrows > 0) {
 						editorDelRow(0);
 					}
 					editorInsertRow(0, "", 0);
@@ -5602,13 +7454,11 @@ void editorProcessKeyPress() {
 		case 'G':
 			if (d_pressed) {
 				editorSaveState();
-				while (pane->cy < pane->numrows - 1) {
+				while (pane->cy < pane->buf->numrows - 1) {
 					editorDelRow(pane->cy + 1);
 				}
-				if (pane->cy < pane->numrows) {
-					pane->row[pane->cy].size = pane->cx;
-					pane->row[pane->cy].chars[pane->cx] = '\0';
-					editorUpdateRow(&pane->row[pane->cy]);
+				if (pane->cy < pane->buf->numrows) {
+					editorRowTruncate(editorRow(pane, pane->cy), pane->cx);
 				}
 				editorSetStatusMessage("Deleted to end of file");
 				d_pressed = 0;
@@ -5617,12 +7467,12 @@ void editorProcessKeyPress() {
 				hkPushJump(pane->cx, pane->cy);
 				if (E.hk.pending_count > 0) {
 					int target = E.hk.pending_count - 1;
-					if (pane->numrows > 0 && target >= pane->numrows) target = pane->numrows - 1;
+					if (pane->buf->numrows > 0 && target >= pane->buf->numrows) target = pane->buf->numrows - 1;
 					if (target < 0) target = 0;
 					pane->cy = target;
 					pane->cx = 0;
 				} else {
-					pane->cy = pane->numrows > 0 ? pane->numrows - 1 : 0;
+					pane->cy = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
 				}
 				E.hk.pending_count = 0;
 			}
@@ -5633,16 +7483,16 @@ void editorProcessKeyPress() {
 		case 'y':
 			if (last_char == 'y') {
 				int n = hkConsumeCount();
-				if (pane->cy < pane->numrows) {
+				if (pane->cy < pane->buf->numrows) {
 					int end = pane->cy + n;
-					if (end > pane->numrows) end = pane->numrows;
+					if (end > pane->buf->numrows) end = pane->buf->numrows;
 					int total = 0;
-					for (int k = pane->cy; k < end; k++) total += pane->row[k].size + 1;
+					for (int k = pane->cy; k < end; k++) total += editorRow(pane, k)->size + 1;
 					char *buf = malloc(total + 1);
 					int off = 0;
 					for (int k = pane->cy; k < end; k++) {
-						memcpy(buf + off, pane->row[k].chars, pane->row[k].size);
-						off += pane->row[k].size;
+						memcpy(buf + off, editorRow(pane, k)->chars, editorRow(pane, k)->size);
+						off += editorRow(pane, k)->size;
 						buf[off++] = '\n';
 					}
 					buf[off] = '\0';
@@ -5661,12 +7511,12 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'r':
-			if (pane->cy < pane->numrows && pane->cx < pane->row[pane->cy].size) {
+			if (pane->cy < pane->buf->numrows && pane->cx < editorRow(pane, pane->cy)->size) {
 				int next_char = hkReadKeyBlocking();
 				if (next_char != '\x1b' && !iscntrl(next_char)) {
 					editorSaveState();
-					editorRowDelChar(&pane->row[pane->cy], pane->cx);
-					editorRowInsertChar(&pane->row[pane->cy], pane->cx, next_char);
+					editorRowDelChar(editorRow(pane, pane->cy), pane->cx);
+					editorRowInsertChar(editorRow(pane, pane->cy), pane->cx, next_char);
 				}
 			}
 			last_char = 0;
@@ -5678,12 +7528,12 @@ void editorProcessKeyPress() {
 			E.hk.last_op = 'J'; E.hk.last_count = n;
 			editorSaveState();
 			for (int k = 0; k < n; k++) {
-				if (pane->cy < pane->numrows - 1) {
-					pane->cx = pane->row[pane->cy].size;
-					if (pane->row[pane->cy].size > 0 && pane->row[pane->cy + 1].size > 0) {
+				if (pane->cy < pane->buf->numrows - 1) {
+					pane->cx = editorRow(pane, pane->cy)->size;
+					if (editorRow(pane, pane->cy)->size > 0 && editorRow(pane, pane->cy + 1)->size > 0) {
 						editorInsertChar(' ');
 					}
-					editorRowAppendString(&pane->row[pane->cy], pane->row[pane->cy + 1].chars, pane->row[pane->cy + 1].size);
+					editorRowAppendString(editorRow(pane, pane->cy), editorRow(pane, pane->cy + 1)->chars, editorRow(pane, pane->cy + 1)->size);
 					editorDelRow(pane->cy + 1);
 				}
 			}
@@ -5695,18 +7545,15 @@ void editorProcessKeyPress() {
 			if (d_pressed || last_char == 'c') {
 				int was_change = (last_char == 'c');
 				editorSaveState();
-				if (pane->cy < pane->numrows) {
-					erow *row = &pane->row[pane->cy];
+				if (pane->cy < pane->buf->numrows) {
+					erow *row = editorRow(pane, pane->cy);
 					int start = pane->cx;
 					int end = pane->cx;
 					while (end < row->size && !is_separator(row->chars[end])) end++;
 					while (end < row->size && is_separator(row->chars[end]) && row->chars[end] != '\n') end++;
 					if (end > start) {
 						hkSetRegister(E.hk.pending_reg, &row->chars[start], end - start, 0, 0);
-						memmove(&row->chars[start], &row->chars[end], row->size - end + 1);
-						row->size -= (end - start);
-						editorUpdateRow(row);
-						pane->dirty++;
+						editorRowDelRange(row, start, end - start);
 						if (pane->cx >= row->size && pane->cx > 0) pane->cx = row->size > 0 ? row->size - 1 : 0;
 					}
 					if (was_change) {
@@ -5726,11 +7573,11 @@ void editorProcessKeyPress() {
 			{
 				int n = hkConsumeCount();
 				for (int k = 0; k < n; k++) {
-					if (pane->cy >= pane->numrows) break;
-					erow *row = &pane->row[pane->cy];
+					if (pane->cy >= pane->buf->numrows) break;
+					erow *row = editorRow(pane, pane->cy);
 					while (pane->cx < row->size && !is_separator(row->chars[pane->cx])) pane->cx++;
 					while (pane->cx < row->size && is_separator(row->chars[pane->cx])) pane->cx++;
-					if (pane->cx >= row->size && pane->cy < pane->numrows - 1) {
+					if (pane->cx >= row->size && pane->cy < pane->buf->numrows - 1) {
 						pane->cy++;
 						pane->cx = 0;
 					}
@@ -5746,9 +7593,9 @@ void editorProcessKeyPress() {
 				if (pane->cx == 0 && pane->cy == 0) break;
 				if (pane->cx == 0 && pane->cy > 0) {
 					pane->cy--;
-					pane->cx = pane->row[pane->cy].size;
+					pane->cx = editorRow(pane, pane->cy)->size;
 				} else {
-					erow *row = &pane->row[pane->cy];
+					erow *row = editorRow(pane, pane->cy);
 					while (pane->cx > 0 && is_separator(row->chars[pane->cx - 1])) pane->cx--;
 					while (pane->cx > 0 && !is_separator(row->chars[pane->cx - 1])) pane->cx--;
 				}
@@ -5768,8 +7615,8 @@ void editorProcessKeyPress() {
 
 		case '$':
 		case END_KEY:
-			if (pane->cy < pane->numrows) {
-				pane->cx = pane->row[pane->cy].size;
+			if (pane->cy < pane->buf->numrows) {
+				pane->cx = editorRow(pane, pane->cy)->size;
 			}
 			E.hk.pending_count = 0;
 			last_char = 0;
@@ -5809,13 +7656,13 @@ void editorProcessKeyPress() {
 				editorSaveState();
 				for (int k = 0; k < n; k++) {
 					if (pb->is_line_mode) {
-						pane->cx = (pane->cy < pane->numrows) ? pane->row[pane->cy].size : 0;
+						pane->cx = (pane->cy < pane->buf->numrows) ? editorRow(pane, pane->cy)->size : 0;
 						editorInsertNewLine();
 						editorHandlePaste(pb->data, pb->len);
 					} else {
-						if (pane->cy < pane->numrows) {
+						if (pane->cy < pane->buf->numrows) {
 							pane->cx++;
-							if (pane->cx > pane->row[pane->cy].size) pane->cx = pane->row[pane->cy].size;
+							if (pane->cx > editorRow(pane, pane->cy)->size) pane->cx = editorRow(pane, pane->cy)->size;
 						}
 						editorHandlePaste(pb->data, pb->len);
 					}
@@ -5859,15 +7706,7 @@ void editorProcessKeyPress() {
 
 		case '\x1b':
 			if (E.search.query) {
-				for (int i = 0; i < pane->numrows; i++) {
-					erow *row = &pane->row[i];
-					for (int j = 0; j < row->rsize; j++) {
-						if (row->hl[j] == HL_MATCH) {
-							row->hl[j] = HL_NORMAL;
-						}
-					}
-					editorUpdateSyntax(row);
-				}
+				E.search.highlight = 0;
 				editorSetStatusMessage("Search cleared");
 			}
 			E.hk.pending_count = 0;
@@ -5896,16 +7735,16 @@ void editorProcessKeyPress() {
 				E.hk.last_op = 'd'; E.hk.last_count = n;
 				editorSaveState();
 
-				if (pane->cy < pane->numrows) {
+				if (pane->cy < pane->buf->numrows) {
 					int end = pane->cy + n;
-					if (end > pane->numrows) end = pane->numrows;
+					if (end > pane->buf->numrows) end = pane->buf->numrows;
 					int total = 0;
-					for (int k = pane->cy; k < end; k++) total += pane->row[k].size + 1;
+					for (int k = pane->cy; k < end; k++) total += editorRow(pane, k)->size + 1;
 					char *buf = malloc(total + 1);
 					int off = 0;
 					for (int k = pane->cy; k < end; k++) {
-						memcpy(buf + off, pane->row[k].chars, pane->row[k].size);
-						off += pane->row[k].size;
+						memcpy(buf + off, editorRow(pane, k)->chars, editorRow(pane, k)->size);
+						off += editorRow(pane, k)->size;
 						buf[off++] = '\n';
 					}
 					buf[off] = '\0';
@@ -5917,12 +7756,12 @@ void editorProcessKeyPress() {
 				}
 				E.hk.pending_reg = 0;
 
-				if (pane->numrows == 0) {
+				if (pane->buf->numrows == 0) {
 					editorInsertRow(0, "", 0);
-					pane->rowoff = pane->coloff = 0;
+					pane->rowoff = pane->coloff = pane->rowoff_wrap = 0;
 				}
 
-				if (pane->cy >= pane->numrows) pane->cy = pane->numrows - 1;
+				if (pane->cy >= pane->buf->numrows) pane->cy = pane->buf->numrows - 1;
 				if (pane->cy < 0) pane->cy = 0;
 
 				pane->cx = 0;
@@ -5941,14 +7780,11 @@ void editorProcessKeyPress() {
 		case 'c':
 			if (last_char == 'c') {
 				editorSaveState();
-				if (pane->cy < pane->numrows) {
-					erow *row = &pane->row[pane->cy];
+				if (pane->cy < pane->buf->numrows) {
+					erow *row = editorRow(pane, pane->cy);
 					hkSetRegister(E.hk.pending_reg, row->chars, row->size, 0, 0);
-					row->size = 0;
-					row->chars[0] = '\0';
-					editorUpdateRow(row);
+					editorRowTruncate(row, 0);
 					pane->cx = 0;
-					pane->dirty++;
 				}
 				E.hk.pending_reg = 0;
 				editorSetMode(MODE_INSERT);
@@ -5964,35 +7800,29 @@ void editorProcessKeyPress() {
 		case CTRL_KEY('f'):
 		case PAGE_DOWN:
 			if (E.word_wrap && pane->wrap_lines) {
-				int wrap_width = pane->width - E.line_number_width;
-				if (wrap_width < 1) wrap_width = 1;
-				
-				int visual_rows = 0;
-				for (int i = 0; i < pane->numrows; i++) {
-					int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-					if (lines < 1) lines = 1;
-					visual_rows += lines;
-				}
-				
-				int old_rowoff = pane->rowoff;
-				pane->rowoff = MIN(pane->rowoff + pane->height, MAX(0, visual_rows - pane->height));
-				
-				if (pane->rowoff != old_rowoff) {
-					int current_visual = 0;
-					for (int i = 0; i < pane->numrows; i++) {
-						int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-						if (lines < 1) lines = 1;
-						if (current_visual + lines > pane->rowoff) {
-							pane->cy = i;
-							pane->cx = 0;
-							break;
-						}
-						current_visual += lines;
+				if (pane->buf->numrows > 0) {
+					/* the last full page starts height-1 lines above the end */
+					int last_y = pane->buf->numrows - 1;
+					int last_sub = editorWrapLines(editorRow(pane, last_y), editorWrapWidth(pane)) - 1;
+					editorWrapStep(pane, &last_y, &last_sub, -(pane->height - 1));
+
+					int y = pane->rowoff, sub = pane->rowoff_wrap;
+					editorWrapStep(pane, &y, &sub, pane->height);
+					if (y > last_y || (y == last_y && sub > last_sub)) {
+						y = last_y;
+						sub = last_sub;
+					}
+
+					if (y != pane->rowoff || sub != pane->rowoff_wrap) {
+						pane->rowoff = y;
+						pane->rowoff_wrap = sub;
+						pane->cy = y;
+						pane->cx = editorRowRxToCx(editorRow(pane, y), sub * editorWrapWidth(pane));
 					}
 				}
 			} else {
-				pane->rowoff = MIN(pane->rowoff + pane->height, MAX(0, pane->numrows - pane->height));
-				pane->cy = MIN(pane->rowoff + pane->height - 1, pane->numrows - 1);
+				pane->rowoff = MIN(pane->rowoff + pane->height, MAX(0, pane->buf->numrows - pane->height));
+				pane->cy = MIN(pane->rowoff + pane->height - 1, pane->buf->numrows - 1);
 				if (pane->cy < pane->rowoff) pane->cy = pane->rowoff;
 			}
 			last_char = 0;
@@ -6002,23 +7832,12 @@ void editorProcessKeyPress() {
 		case CTRL_KEY('b'):
 		case PAGE_UP:
 			if (E.word_wrap && pane->wrap_lines) {
-				int old_rowoff = pane->rowoff;
-				pane->rowoff = MAX(0, pane->rowoff - pane->height);
-				
-				if (pane->rowoff != old_rowoff) {
-					int wrap_width = pane->width - E.line_number_width;
-					if (wrap_width < 1) wrap_width = 1;
-					
-					int current_visual = 0;
-					for (int i = 0; i < pane->numrows; i++) {
-						int lines = (pane->row[i].rsize + wrap_width - 1) / wrap_width;
-						if (lines < 1) lines = 1;
-						if (current_visual + lines > pane->rowoff + pane->height - 1) {
-							pane->cy = i;
-							pane->cx = 0;
-							break;
-						}
-						current_visual += lines;
+				if (editorWrapStep(pane, &pane->rowoff, &pane->rowoff_wrap, -pane->height) > 0) {
+					int y = pane->rowoff, sub = pane->rowoff_wrap;
+					editorWrapStep(pane, &y, &sub, pane->height - 1);
+					if (y < pane->buf->numrows) {
+						pane->cy = y;
+						pane->cx = editorRowRxToCx(editorRow(pane, y), sub * editorWrapWidth(pane));
 					}
 				}
 			} else {
@@ -6136,11 +7955,11 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'w':
-			if (pane->cy < pane->numrows) {
-				erow *row = &pane->row[pane->cy];
+			if (pane->cy < pane->buf->numrows) {
+				erow *row = editorRow(pane, pane->cy);
 				while (pane->cx < row->size && !is_separator(row->chars[pane->cx])) pane->cx++;
 				while (pane->cx < row->size && is_separator(row->chars[pane->cx])) pane->cx++;
-				if (pane->cx >= row->size && pane->cy < pane->numrows - 1) {
+				if (pane->cx >= row->size && pane->cy < pane->buf->numrows - 1) {
 					pane->cy++;
 					pane->cx = 0;
 				}
@@ -6151,9 +7970,9 @@ void editorProcessKeyPress() {
 			if (pane->cx > 0 || pane->cy > 0) {
 				if (pane->cx == 0 && pane->cy > 0) {
 					pane->cy--;
-					pane->cx = pane->row[pane->cy].size;
+					pane->cx = editorRow(pane, pane->cy)->size;
 				} else {
-					erow *row = &pane->row[pane->cy];
+					erow *row = editorRow(pane, pane->cy);
 					while (pane->cx > 0 && is_separator(row->chars[pane->cx - 1])) pane->cx--;
 					while (pane->cx > 0 && !is_separator(row->chars[pane->cx - 1])) pane->cx--;
 				}
@@ -6161,9 +7980,9 @@ void editorProcessKeyPress() {
 			break;
 
 		case 'G':
-			pane->cy = pane->numrows > 0 ? pane->numrows - 1 : 0;
-			if (pane->cy < pane->numrows)
-				pane->cx = pane->row[pane->cy].size;
+			pane->cy = pane->buf->numrows > 0 ? pane->buf->numrows - 1 : 0;
+			if (pane->cy < pane->buf->numrows)
+				pane->cx = editorRow(pane, pane->cy)->size;
 			break;
 
 		case 'g':
@@ -6176,15 +7995,15 @@ void editorProcessKeyPress() {
 			break;
 
 		case '$':
-			if (pane->cy < pane->numrows)
-				pane->cx = pane->row[pane->cy].size;
+			if (pane->cy < pane->buf->numrows)
+				pane->cx = editorRow(pane, pane->cy)->size;
 			break;
 
 		case CTRL_KEY('f'):
 		case PAGE_DOWN:
 			{
 				int times = pane->height;
-				while (times-- && pane->cy < pane->numrows - 1) {
+				while (times-- && pane->cy < pane->buf->numrows - 1) {
 					pane->cy++;
 				}
 			}
@@ -6632,14 +8451,9 @@ void explorerHandleKey(editorPane *pane, int key) {
 				if (target) {
 					E.active_pane = target;
 					
-					for (int i = 0; i < target->numrows; i++) {
-						editorFreeRow(&target->row[i]);
-					}
-					free(target->row);
-					target->row = NULL;
-					target->numrows = 0;
+					editorDetachBuffer(target);
 					target->cx = target->cy = 0;
-					target->rowoff = target->coloff = 0;
+					target->rowoff = target->coloff = target->rowoff_wrap = 0;
 					
 					editorOpen(full_path);
 					editorSetStatusMessage("Opened: %s", full_path);
@@ -6698,14 +8512,8 @@ void explorerHandleKey(editorPane *pane, int key) {
 			}
 
 			editorPane *np = E.active_pane;
-			for (int i = 0; i < np->numrows; i++) editorFreeRow(&np->row[i]);
-			free(np->row);
-			np->row = NULL;
-			np->numrows = 0;
-			np->cx = np->cy = np->rowoff = np->coloff = 0;
-			free(np->filename);
-			np->filename = NULL;
-			np->dirty = 0;
+			editorDetachBuffer(np);
+			np->cx = np->cy = np->rowoff = np->coloff = np->rowoff_wrap = 0;
 
 			editorOpen(full_path);
 			editorSetStatusMessage("Opened in new pane: %s", full_path);
@@ -6798,8 +8606,9 @@ void aiInit(editorPane *pane) {
 	aiData *data = calloc(1, sizeof(aiData));
 	if (!data) return;
 
-	data->history = malloc(sizeof(char*) * AI_HISTORY_MAX);
-	data->history_role = calloc(AI_HISTORY_MAX, 1);
+	data->history = NULL;
+	data->history_cap = 0;
+	data->history_head = 0;
 	data->history_count = 0;
 	data->history_pos = 0;
 	data->scroll_offset = 0;
@@ -6811,7 +8620,6 @@ void aiInit(editorPane *pane) {
 	data->prompt_capacity = 256;
 	data->active = 1;
 	data->stream_slot = -1;
-	pthread_mutex_init(&data->lock, NULL);
 
 	const char *mascot[] = {
 		"  ▄█████▄ ",
@@ -6821,25 +8629,24 @@ void aiInit(editorPane *pane) {
 		NULL
 	};
 	for (int i = 0; mascot[i]; i++) {
-		if (data->history_count < AI_HISTORY_MAX)
-			data->history[data->history_count++] = strdup(mascot[i]);
+		aiAddHistory(data, mascot[i]);
 	}
 
 	char line[128];
-	data->history[data->history_count++] = strdup("-----");
+	aiAddHistory(data, "-----");
 	snprintf(line, sizeof(line), "%s (powered by hakoc)", E.ai_name);
-	data->history[data->history_count++] = strdup(line);
-	data->history[data->history_count++] = strdup("-----");
+	aiAddHistory(data, line);
+	aiAddHistory(data, "-----");
 
 	pane->ai = data;
 
 	if (clawLaunch(data) < 0) {
-		data->history[data->history_count++] = strdup("hakoc not found.");
-		data->history[data->history_count++] = strdup("Install: curl -fsSL https://mithraeums.github.io/install.sh | sh");
-		data->history[data->history_count++] = strdup("Or: make BUNDLE_CLAW=1 from hako source.");
-		data->history[data->history_count++] = strdup("'i' to try again | /help");
+		aiAddHistory(data, "hakoc not found.");
+		aiAddHistory(data, "Install: curl -fsSL https://mithraeums.github.io/install.sh | sh");
+		aiAddHistory(data, "Or: make BUNDLE_CLAW=1 from hako source.");
+		aiAddHistory(data, "'i' to try again | /help");
 	} else {
-		data->history[data->history_count++] = strdup("'i' chat | /help");
+		aiAddHistory(data, "'i' chat | /help");
 	}
 }
 
@@ -6876,7 +8683,6 @@ void aiHandleKey(editorPane *pane, int key) {
 	aiData *data = pane->ai;
 	if (!data) return;
 
-	pthread_mutex_lock(&data->lock);
 
 	if (data->mode == MODE_INSERT) {
 		if (data->prompt_cursor < 0) data->prompt_cursor = 0;
@@ -7010,7 +8816,7 @@ void aiHandleKey(editorPane *pane, int key) {
 				
 				size_t total_len = 0;
 				for (int i = start; i <= end && i < data->history_count; i++) {
-					total_len += strlen(data->history[i]) + 1;
+					total_len += aiLineAt(data, i)->len + 1;
 				}
 				
 				if (total_len > 0) {
@@ -7018,8 +8824,9 @@ void aiHandleKey(editorPane *pane, int key) {
 					char *p = yanked;
 					
 					for (int i = start; i <= end && i < data->history_count; i++) {
-						int len = strlen(data->history[i]);
-						memcpy(p, data->history[i], len);
+						aiLine *l = aiLineAt(data, i);
+						int len = l->len;
+						memcpy(p, l->text, len);
 						p += len;
 						*p++ = '\n';
 					}
@@ -7037,7 +8844,6 @@ void aiHandleKey(editorPane *pane, int key) {
 			
 		case CTRL_KEY('w'):
 			data->visual_mode = 0;
-			pthread_mutex_unlock(&data->lock);
 			editorNextPane();
 			return;
 
@@ -7105,7 +8911,6 @@ void aiHandleKey(editorPane *pane, int key) {
 			if (data->prompt_len > 0) {
 				int r = aiSubmitPrompt(data);
 				if (r == 2) {
-					pthread_mutex_unlock(&data->lock);
 					editorToggleAI();
 					return;
 				}
@@ -7141,7 +8946,7 @@ void aiHandleKey(editorPane *pane, int key) {
 		case 'l':
 		case ARROW_RIGHT:
 			if (data->cursor_y < data->history_count) {
-				int len = strlen(data->history[data->cursor_y]);
+				int len = aiLineAt(data, data->cursor_y)->len;
 				if (data->cursor_x < len - 1) {
 					data->cursor_x++;
 				}
@@ -7158,35 +8963,29 @@ void aiHandleKey(editorPane *pane, int key) {
 			
 		case ':':
 			{
-				pthread_mutex_unlock(&data->lock);
 				char *cmd = editorPrompt(":%s", NULL);
-				pthread_mutex_lock(&data->lock);
 				if (cmd) {
 					if (strcmp(cmd, "q") == 0) {
 						free(cmd);
-						pthread_mutex_unlock(&data->lock);
 						editorToggleAI();
 						return;
 					} else if (strcmp(cmd, "w") == 0 || strcmp(cmd, "wq") == 0) {
 						FILE *fp = fopen("ai_chat.txt", "w");
 						if (fp) {
 							for (int i = 0; i < data->history_count; i++) {
-								fprintf(fp, "%s\n", data->history[i]);
+								fprintf(fp, "%s\n", aiLineAt(data, i)->text);
 							}
 							fclose(fp);
 							editorSetStatusMessage("AI chat saved to ai_chat.txt");
 						}
 						if (strcmp(cmd, "wq") == 0) {
 							free(cmd);
-							pthread_mutex_unlock(&data->lock);
 							editorToggleAI();
 							return;
 						}
 					} else if (strcmp(cmd, "clear") == 0) {
-						for (int i = 0; i < data->history_count; i++) {
-							free(data->history[i]);
-						}
-						data->history_count = 0;
+						aiHistoryTruncate(data, 0);
+						data->stream_slot = -1;
 						data->cursor_x = data->cursor_y = 0;
 						data->history_pos = 0;
 						editorSetStatusMessage("AI history cleared");
@@ -7197,18 +8996,15 @@ void aiHandleKey(editorPane *pane, int key) {
 			break;
 			
 		case CTRL_KEY('w'):
-			pthread_mutex_unlock(&data->lock);
 			editorNextPane();
 			return;
 
 		case CTRL_KEY('c'):
-			pthread_mutex_unlock(&data->lock);
 			editorToggleAI();
 			return;
 		}
 	}
 
-	pthread_mutex_unlock(&data->lock);
 }
 
 void editorToggleAI() {
@@ -7250,16 +9046,15 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 
 	aiData *data = pane->ai;
 
-	pthread_mutex_lock(&data->lock);
 
 	int inner_w = pane->width - 1 - 2;
 	if (inner_w < 4) inner_w = 4;
 	int seg_w = inner_w - 2;
 	if (seg_w < 2) seg_w = 2;
 
-	int pmax = 32;
-	int *pstart = malloc(sizeof(int) * pmax);
-	int *pend = malloc(sizeof(int) * pmax);
+	/* only the last AI_PROMPT_ROWS segments of the prompt are shown, so
+	 * a ring of that many is all the wrap state it needs */
+	int pstart[AI_PROMPT_ROWS], pend[AI_PROMPT_ROWS];
 	int plines_total = 0;
 	if (data->prompt_buffer && data->prompt_len > 0) {
 		int i = 0;
@@ -7270,13 +9065,8 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 			int seg = line_start;
 			do {
 				int take = (line_end - seg > seg_w) ? seg_w : (line_end - seg);
-				if (plines_total >= pmax) {
-					pmax *= 2;
-					pstart = realloc(pstart, sizeof(int) * pmax);
-					pend = realloc(pend, sizeof(int) * pmax);
-				}
-				pstart[plines_total] = seg;
-				pend[plines_total] = seg + take;
+				pstart[plines_total % AI_PROMPT_ROWS] = seg;
+				pend[plines_total % AI_PROMPT_ROWS] = seg + take;
 				plines_total++;
 				seg += take;
 			} while (seg < line_end);
@@ -7288,45 +9078,16 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 	if (plines_total == 0) {
 		pstart[0] = 0; pend[0] = 0; plines_total = 1;
 	}
-	int plines = plines_total > 5 ? 5 : plines_total;
+	int plines = plines_total > AI_PROMPT_ROWS ? AI_PROMPT_ROWS : plines_total;
 	int pscroll = plines_total > plines ? plines_total - plines : 0;
 	int prompt_rows = 1 + plines + 1;
 	int history_end = pane->height - prompt_rows - 1;
 	if (history_end < 2) history_end = 2;
 
-	int total_vis = 0;
-	int *line_owner = NULL;
-	int *line_sub = NULL;
-	int owner_cap = 0;
-	for (int i = 0; i < data->history_count; i++) {
-		int seg_cols_w = inner_w - 2;
-		if (seg_cols_w < 1) seg_cols_w = 1;
-		int dw = utf8_display_width(data->history[i]);
-		int rows = dw > 0 ? (dw + seg_cols_w - 1) / seg_cols_w : 1;
-		if (rows < 1) rows = 1;
-		for (int s = 0; s < rows; s++) {
-			if (total_vis >= owner_cap) {
-				owner_cap = owner_cap ? owner_cap * 2 : 64;
-				line_owner = realloc(line_owner, sizeof(int) * owner_cap);
-				line_sub = realloc(line_sub, sizeof(int) * owner_cap);
-			}
-			line_owner[total_vis] = i;
-			line_sub[total_vis] = s;
-			total_vis++;
-		}
-	}
+	if (data->wrap_w != seg_w) aiReflow(data, seg_w);
+	int total_vis = data->wrap_rows;
 	int spinner_row = -1;
-	if (data->streaming) {
-		if (total_vis >= owner_cap) {
-			owner_cap = owner_cap ? owner_cap * 2 : 64;
-			line_owner = realloc(line_owner, sizeof(int) * owner_cap);
-			line_sub = realloc(line_sub, sizeof(int) * owner_cap);
-		}
-		line_owner[total_vis] = -1;
-		line_sub[total_vis] = 0;
-		spinner_row = total_vis;
-		total_vis++;
-	}
+	if (data->streaming) spinner_row = total_vis++;
 
 	int history_rows = history_end - 2 + 1;
 	if (history_rows < 0) history_rows = 0;
@@ -7336,6 +9097,15 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 	int scroll = max_scroll - data->scroll_offset;
 	if (scroll < 0) scroll = 0;
 
+	/* the line at the top of the view, walking up from the bottom; rows
+	 * below follow from there, so only the visible window is touched */
+	int li = data->history_count, sub = 0, before = data->wrap_rows;
+	while (li > 0 && before > scroll) {
+		li--;
+		before -= aiLineAt(data, li)->wrap_rows;
+	}
+	sub = scroll - before;
+
 	for (int y = 0; y < pane->height; y++) {
 		int gy = pane->y + y;
 		int gx = pane->x;
@@ -7374,12 +9144,12 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 				int pw = inner_w - 2;
 				int shown = 0;
 				if (data->prompt_buffer && data->prompt_len > 0 && vline < plines_total) {
-					int len = pend[vline] - pstart[vline];
+					int len = pend[vline % AI_PROMPT_ROWS] - pstart[vline % AI_PROMPT_ROWS];
 					if (len > pw) len = pw;
 					if (len > 0) {
 						char tmp[1024];
 						if (len > (int)sizeof(tmp) - 1) len = (int)sizeof(tmp) - 1;
-						memcpy(tmp, data->prompt_buffer + pstart[vline], len);
+						memcpy(tmp, data->prompt_buffer + pstart[vline % AI_PROMPT_ROWS], len);
 						tmp[len] = '\0';
 						shown = gridPutStr(cx, gy, tmp, pw, E.theme.fg, E.theme.bg);
 					}
@@ -7409,7 +9179,12 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 				int f = data->spinner_frame;
 				int sx = cx;
 				sx += gridPutStr(sx, gy, frames[f], 1, E.theme.string, E.theme.bg);
-				sx += gridPutStr(sx, gy, " thinking...", 12, E.theme.string, E.theme.bg);
+				/* backpressure: a prompt hakoc has not read yet */
+				char what[32];
+				int queued = clawQueued();
+				if (queued > 0) snprintf(what, sizeof(what), " sending %d KB...", (queued + 1023) / 1024);
+				else snprintf(what, sizeof(what), " thinking...");
+				sx += gridPutStr(sx, gy, what, inner_w - (sx - cx), E.theme.string, E.theme.bg);
 				int filled = sx - cx;
 				for (int x = filled; x < inner_w; x++) {
 					gridPutCh(cx + x, gy, ' ', E.theme.fg, E.theme.bg);
@@ -7418,18 +9193,20 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 				gridPutCh(cx, gy, ' ', E.theme.fg, E.theme.bg);
 				continue;
 			}
-			if (vrow >= 0 && vrow < total_vis) {
-				int msg_idx = line_owner[vrow];
-				int sub = line_sub[vrow];
-				char *text = data->history[msg_idx];
-				int seg_max = inner_w - 2;
-				int byte_off = 0, seg_len = 0, seg_cols = 0;
-				utf8_slice(text, sub * seg_max, seg_max, &byte_off, &seg_len, &seg_cols);
+			if (li < data->history_count) {
+				int msg_idx = li;
+				aiLine *l = aiLineAt(data, li);
+				char *text = l->text;
+				int seg_max = seg_w;
+				int byte_off = sub == 0 ? 0 : l->wrap_off[sub - 1];
+				int seg_len = (sub + 1 < l->wrap_rows ? l->wrap_off[sub] : l->len) - byte_off;
+				int seg_cols = 0;
+				if (++sub >= l->wrap_rows) { li++; sub = 0; }
 
 				int is_selected = (data->visual_mode &&
 					msg_idx >= MIN(data->visual_start, data->visual_end) &&
 					msg_idx <= MAX(data->visual_start, data->visual_end));
-				unsigned char role = data->history_role[msg_idx];
+				unsigned char role = l->role;
 
 				Color bar_fg, body_fg, row_bg;
 				if (is_selected) {
@@ -7455,7 +9232,7 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 					int n = seg_len < (int)sizeof(tmp) - 1 ? seg_len : (int)sizeof(tmp) - 1;
 					memcpy(tmp, text + byte_off, n);
 					tmp[n] = '\0';
-					gridPutStr(cx, gy, tmp, seg_max, body_fg, row_bg);
+					seg_cols = gridPutStr(cx, gy, tmp, seg_max, body_fg, row_bg);
 				}
 				for (int x = seg_cols; x < seg_max; x++) {
 					gridPutCh(cx + x, gy, ' ', body_fg, row_bg);
@@ -7471,11 +9248,6 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 		}
 	}
 
-	free(line_owner);
-	free(line_sub);
-	free(pstart);
-	free(pend);
-	pthread_mutex_unlock(&data->lock);
 	(void)ab;
 }
 
@@ -7483,117 +9255,588 @@ void aiRender(editorPane *pane, struct abuf *ab) {
 
 /* Persistent subprocess: hako speaks JSONL over stdin/stdout to hakoc --pipe.
    stdin  (to hakoc)   ← {"type":"prompt","text":"..."} | {"type":"slash","cmd":"..."} | {"type":"quit"}
-   stdout (from hakoc) → {"type":"init",...} | {"type":"message",...} | {"type":"tool_start/end",...} | {"type":"done",...} */
+   stdout (from hakoc) → {"type":"init",...} | {"type":"delta","text":"..."} | {"type":"message",...} | {"type":"tool_start/end",...} | {"type":"done",...}
+   A run of deltas streams one reply; a following ai message, if any, is its final text. */
 
 static int   g_claw_fd_write      = -1;
-static FILE *g_claw_fp_read       = NULL;
 static pid_t g_claw_pid           = -1;
 static pthread_t g_claw_reader;
 static int g_claw_reader_running  = 0;
 static aiData *g_claw_data        = NULL;
 
-static char *hkExtractJsonString(const char *src, const char *key) {
-	char pat[64];
-	snprintf(pat, sizeof(pat), "\"%s\":\"", key);
-	const char *p = strstr(src, pat);
-	if (!p) return NULL;
-	p += strlen(pat);
-	const char *end = p;
-	while (*end && !(*end == '"' && *(end - 1) != '\\')) end++;
-	if (!*end) return NULL;
-	int len = end - p;
-	char *out = malloc(len + 1);
-	memcpy(out, p, len);
-	out[len] = '\0';
-	return out;
-}
-
-static int hkExtractJsonInt(const char *src, const char *key) {
-	if (!src) return -1;
-	char pat[64];
-	snprintf(pat, sizeof(pat), "\"%s\":", key);
-	const char *p = strstr(src, pat);
-	if (!p) return -1;
-	p += strlen(pat);
-	while (*p == ' ') p++;
-	if (*p < '0' || *p > '9') return -1;
-	return atoi(p);
-}
-
-static void clawJsonEsc(const char *src, char *dst, int dsz) {
-	int d = 0;
-	for (const char *p = src; *p && d < dsz - 2; p++) {
+/* Lines read from hakoc, waiting for the UI thread. The reader holds
+ * the lock only to append a pointer, and clawPollEvents only to take the
+ * whole batch, so neither waits on a frame or on event handling.
+ * The reader is detached and may outlive clawShutdown, so each launch
+ * gets a generation: a reader whose generation is no longer current
+ * drops what it reads and never reports done. */
+static pthread_mutex_t g_claw_inbox_lock = PTHREAD_MUTEX_INITIALIZER;
+typedef struct clawInboxItem {
+	char *line;
+	long long ms;	/* editorNowMs() when it was read */
+	int bytes;	/* as read, newline included */
+} clawInboxItem;
+
+static clawInboxItem *g_claw_inbox = NULL;
+static int g_claw_inbox_n         = 0;
+static int g_claw_inbox_cap       = 0;
+static int g_claw_reader_done     = 0;
+static int g_claw_gen             = 0;
+
+/* What a reader owns: the read end of its hakoc's stdout, closed by the
+ * reader itself at EOF, and the generation it was launched under. */
+typedef struct clawReaderArg {
+	FILE *fp;
+	int gen;
+} clawReaderArg;
+
+/* One decoded hakoc event. Strings point into the line they were parsed
+ * from, unescaped in place; missing fields are NULL or -1. */
+typedef enum {
+	CLAW_EV_UNKNOWN = 0,
+	CLAW_EV_INIT,
+	CLAW_EV_DELTA,
+	CLAW_EV_MESSAGE,
+	CLAW_EV_TOOL,
+	CLAW_EV_DONE,
+	CLAW_EV_ERROR
+} clawEventType;
+
+typedef struct clawEvent {
+	clawEventType type;
+	char *text, *role, *display, *message, *session, *provider, *model;
+	size_t text_len;
+	int resumed, turns, in, out, turn;
+	int t;	/* ms from the start of a recorded transcript */
+} clawEvent;
+
+static const struct { const char *name; clawEventType type; } claw_event_types[] = {
+	{ "init",       CLAW_EV_INIT },
+	{ "delta",      CLAW_EV_DELTA },
+	{ "message",    CLAW_EV_MESSAGE },
+	{ "tool_start", CLAW_EV_TOOL },
+	{ "tool_end",   CLAW_EV_TOOL },
+	{ "done",       CLAW_EV_DONE },
+	{ "error",      CLAW_EV_ERROR },
+};
+
+static const struct { const char *key; size_t off; int is_int; } claw_event_fields[] = {
+	{ "text",     offsetof(clawEvent, text),     0 },
+	{ "role",     offsetof(clawEvent, role),     0 },
+	{ "display",  offsetof(clawEvent, display),  0 },
+	{ "message",  offsetof(clawEvent, message),  0 },
+	{ "session",  offsetof(clawEvent, session),  0 },
+	{ "provider", offsetof(clawEvent, provider), 0 },
+	{ "model",    offsetof(clawEvent, model),    0 },
+	{ "resumed",  offsetof(clawEvent, resumed),  1 },
+	{ "turns",    offsetof(clawEvent, turns),    1 },
+	{ "in",       offsetof(clawEvent, in),       1 },
+	{ "out",      offsetof(clawEvent, out),      1 },
+	{ "turn",     offsetof(clawEvent, turn),     1 },
+	{ "t",        offsetof(clawEvent, t),        1 },
+};
+
+#define CLAW_JSON_DEPTH 32
+
+static char *clawJsonWs(char *p) {
+	while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+	return p;
+}
+
+static int clawJsonHex4(const char *p) {
+	int v = 0;
+	for (int i = 0; i < 4; i++) {
+		char c = p[i];
+		v <<= 4;
+		if (c >= '0' && c <= '9') v |= c - '0';
+		else if (c >= 'a' && c <= 'f') v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F') v |= c - 'A' + 10;
+		else return -1;
+	}
+	return v;
+}
+
+/* Unescapes the string starting at the quote *p in place (the result is
+ * never longer than its escaped form) and returns the position after the
+ * closing quote, or NULL if the string is malformed or unterminated. */
+static char *clawJsonString(char *p, char **out, size_t *out_len) {
+	if (*p != '"') return NULL;
+	char *r = p + 1, *w = p + 1;
+	for (;;) {
+		char c = *r++;
+		if (c == '\0') return NULL;
+		if (c == '"') break;
+		if (c != '\\') { *w++ = c; continue; }
+		switch (*r++) {
+			case '"':  *w++ = '"';  break;
+			case '\\': *w++ = '\\'; break;
+			case '/':  *w++ = '/';  break;
+			case 'b':  *w++ = '\b'; break;
+			case 'f':  *w++ = '\f'; break;
+			case 'n':  *w++ = '\n'; break;
+			case 'r':  *w++ = '\r'; break;
+			case 't':  *w++ = '\t'; break;
+			case 'u': {
+				int cp = clawJsonHex4(r);
+				if (cp < 0) return NULL;
+				r += 4;
+				if (cp >= 0xD800 && cp < 0xDC00 && r[0] == '\\' && r[1] == 'u') {
+					int lo = clawJsonHex4(r + 2);
+					if (lo >= 0xDC00 && lo < 0xE000) {
+						cp = 0x10000 + ((cp - 0xD800) << 10) + (lo - 0xDC00);
+						r += 6;
+					}
+				}
+				if (cp >= 0xD800 && cp < 0xE000) cp = 0xFFFD;
+				if (cp < 0x80) {
+					*w++ = (char)cp;
+				} else if (cp < 0x800) {
+					*w++ = (char)(0xC0 | cp >> 6);
+					*w++ = (char)(0x80 | (cp & 0x3F));
+				} else if (cp < 0x10000) {
+					*w++ = (char)(0xE0 | cp >> 12);
+					*w++ = (char)(0x80 | (cp >> 6 & 0x3F));
+					*w++ = (char)(0x80 | (cp & 0x3F));
+				} else {
+					*w++ = (char)(0xF0 | cp >> 18);
+					*w++ = (char)(0x80 | (cp >> 12 & 0x3F));
+					*w++ = (char)(0x80 | (cp >> 6 & 0x3F));
+					*w++ = (char)(0x80 | (cp & 0x3F));
+				}
+				break;
+			}
+			default: return NULL;
+		}
+	}
+	if (out_len) *out_len = w - (p + 1);
+	*w = '\0';
+	if (out) *out = p + 1;
+	return r;
+}
+
+/* Skips any value; used for the fields hako does not read. */
+static char *clawJsonSkip(char *p, int depth) {
+	p = clawJsonWs(p);
+	if (*p == '"') return clawJsonString(p, NULL, NULL);
+	if (*p == '{' || *p == '[') {
+		char close = *p == '{' ? '}' : ']';
+		if (depth >= CLAW_JSON_DEPTH) return NULL;
+		p = clawJsonWs(p + 1);
+		if (*p == close) return p + 1;
+		for (;;) {
+			if (close == '}') {
+				p = clawJsonString(p, NULL, NULL);
+				if (!p) return NULL;
+				p = clawJsonWs(p);
+				if (*p++ != ':') return NULL;
+			}
+			p = clawJsonSkip(p, depth + 1);
+			if (!p) return NULL;
+			p = clawJsonWs(p);
+			if (*p == close) return p + 1;
+			if (*p++ != ',') return NULL;
+			p = clawJsonWs(p);
+		}
+	}
+	char *start = p;
+	while (*p && !strchr(",}] \t\r\n", *p)) p++;
+	return p == start ? NULL : p;
+}
+
+/* Decodes one event line in a single pass, modifying it in place.
+ * Returns 0 if the line is not a JSON object. */
+static int clawParseEvent(char *line, clawEvent *ev) {
+	memset(ev, 0, sizeof(*ev));
+	ev->resumed = ev->turns = ev->in = ev->out = ev->turn = ev->t = -1;
+
+	char *p = clawJsonWs(line);
+	if (*p++ != '{') return 0;
+	p = clawJsonWs(p);
+	if (*p == '}') return 1;
+	for (;;) {
+		char *key;
+		p = clawJsonString(p, &key, NULL);
+		if (!p) return 0;
+		p = clawJsonWs(p);
+		if (*p++ != ':') return 0;
+		p = clawJsonWs(p);
+
+		int field = -1;
+		for (int i = 0; i < (int)(sizeof(claw_event_fields) / sizeof(claw_event_fields[0])); i++) {
+			if (strcmp(key, claw_event_fields[i].key) == 0) { field = i; break; }
+		}
+
+		if (strcmp(key, "type") == 0 && *p == '"') {
+			char *type;
+			p = clawJsonString(p, &type, NULL);
+			if (!p) return 0;
+			for (int i = 0; i < (int)(sizeof(claw_event_types) / sizeof(claw_event_types[0])); i++) {
+				if (strcmp(type, claw_event_types[i].name) == 0) { ev->type = claw_event_types[i].type; break; }
+			}
+		} else if (field >= 0 && !claw_event_fields[field].is_int && *p == '"') {
+			char **dst = (char **)((char *)ev + claw_event_fields[field].off);
+			p = clawJsonString(p, dst, claw_event_fields[field].off == offsetof(clawEvent, text) ? &ev->text_len : NULL);
+			if (!p) return 0;
+		} else if (field >= 0 && claw_event_fields[field].is_int && ((*p >= '0' && *p <= '9') || *p == 't' || *p == 'f')) {
+			int *dst = (int *)((char *)ev + claw_event_fields[field].off);
+			if (*p == 't') *dst = 1;
+			else if (*p == 'f') *dst = 0;
+			else *dst = (int)strtol(p, NULL, 10);
+			p = clawJsonSkip(p, 0);
+			if (!p) return 0;
+		} else {
+			p = clawJsonSkip(p, 0);
+			if (!p) return 0;
+		}
+
+		p = clawJsonWs(p);
+		if (*p == '}') return 1;
+		if (*p++ != ',') return 0;
+		p = clawJsonWs(p);
+	}
+}
+
+/* --claw-replay: a recorded transcript stands in for hakoc, so Rei
+ * rendering can be measured with no network. The forked child writes the
+ * lines back as recorded, each at its "t" (ms from the start) divided by
+ * the speed, or back to back at speed 0; a line without "t" follows the
+ * one before it. The transcript is read before the fork, so the child
+ * only sleeps and writes. When it is done hako reports and exits. */
+typedef struct clawReplayLine {
+	int off, len;	/* into buf, newline included */
+	int t;		/* -1: right after the previous line */
+} clawReplayLine;
+
+static struct {
+	const char *path;
+	struct abuf buf;
+	clawReplayLine *lines;
+	int nlines;
+	double speed;
+	int active, finished;
+	long long start_us;
+	int events, frames;
+	long long event_bytes, term_bytes;
+	long long handle_us, handle_max_us;
+	long long render_us, render_max_us;
+} g_claw_replay;
+
+static int clawReplayLoad(const char *path, double speed) {
+	FILE *fp = fopen(path, "r");
+	if (!fp) return -1;
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	int lines_cap = 0;
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) len--;
+		if (len == 0) continue;
+		if (g_claw_replay.nlines == lines_cap) {
+			int ncap = lines_cap ? lines_cap * 2 : 256;
+			clawReplayLine *l = realloc(g_claw_replay.lines, sizeof(clawReplayLine) * ncap);
+			if (!l) break;
+			g_claw_replay.lines = l;
+			lines_cap = ncap;
+		}
+		clawReplayLine *l = &g_claw_replay.lines[g_claw_replay.nlines++];
+		l->off = g_claw_replay.buf.len;
+		l->len = (int)len + 1;
+		abAppend(&g_claw_replay.buf, line, (int)len);
+		abAppend(&g_claw_replay.buf, "\n", 1);
+		/* parsing unescapes in place, so it goes after the copy */
+		clawEvent ev;
+		line[len] = '\0';
+		l->t = clawParseEvent(line, &ev) ? ev.t : -1;
+	}
+	free(line);
+	fclose(fp);
+	g_claw_replay.path = path;
+	g_claw_replay.speed = speed < 0 ? 0 : speed;
+	g_claw_replay.active = 1;
+	return 0;
+}
+
+#ifndef _WIN32
+/* Body of the forked child in place of hakoc. Prompts sent to it are
+ * never read. */
+static void clawReplayRun(void) {
+	signal(SIGWINCH, SIG_DFL);
+	long long start = editorNowMs();
+	for (int i = 0; i < g_claw_replay.nlines; i++) {
+		clawReplayLine *l = &g_claw_replay.lines[i];
+		if (l->t >= 0 && g_claw_replay.speed > 0) {
+			long long due = start + (long long)(l->t / g_claw_replay.speed);
+			long long wait;
+			while ((wait = due - editorNowMs()) > 0) poll(NULL, 0, (int)wait);
+		}
+		const char *p = g_claw_replay.buf.b + l->off;
+		int left = l->len;
+		while (left > 0) {
+			ssize_t w = write(STDOUT_FILENO, p, left);
+			if (w < 0 && errno == EINTR) continue;
+			if (w <= 0) _exit(1);
+			p += w;
+			left -= (int)w;
+		}
+	}
+	_exit(0);
+}
+#endif
+
+static void clawReplayEvent(long long start_us, int bytes) {
+	long long us = editorNowUs() - start_us;
+	g_claw_replay.events++;
+	g_claw_replay.event_bytes += bytes;
+	g_claw_replay.handle_us += us;
+	if (us > g_claw_replay.handle_max_us) g_claw_replay.handle_max_us = us;
+}
+
+static void clawReplayFinish(void) {
+	long long wall_us = editorNowUs() - g_claw_replay.start_us;
+	int events = MAX(g_claw_replay.events, 1);
+	int frames = MAX(g_claw_replay.frames, 1);
+	editorCleanup();
+	disableRawMode();
+	fprintf(stderr, "hako replay: %s (speed %g)\n", g_claw_replay.path, g_claw_replay.speed);
+	fprintf(stderr, "  events    %d, %lld bytes in %.1f ms\n",
+		g_claw_replay.events, g_claw_replay.event_bytes, wall_us / 1000.0);
+	fprintf(stderr, "  handle    %.1f us/event, max %lld us\n",
+		(double)g_claw_replay.handle_us / events, g_claw_replay.handle_max_us);
+	fprintf(stderr, "  render    %d frames, %.1f us/frame, max %lld us, %.1f us/event\n",
+		g_claw_replay.frames, (double)g_claw_replay.render_us / frames,
+		g_claw_replay.render_max_us, (double)g_claw_replay.render_us / events);
+	fprintf(stderr, "  terminal  %lld bytes, %.0f/frame, %.0f/event\n",
+		g_claw_replay.term_bytes, (double)g_claw_replay.term_bytes / frames,
+		(double)g_claw_replay.term_bytes / events);
+	_exit(0);
+}
+
+static int clawReplayPending(void) {
+	return g_claw_replay.active && !g_claw_replay.finished;
+}
+
+/* Called after each frame is written; the frame that shows the end of
+ * the transcript is the last. */
+static void clawReplayFrame(long long start_us, size_t bytes) {
+	if (!g_claw_replay.active || !g_claw_replay.start_us) return;
+	long long us = editorNowUs() - start_us;
+	g_claw_replay.frames++;
+	g_claw_replay.render_us += us;
+	if (us > g_claw_replay.render_max_us) g_claw_replay.render_max_us = us;
+	g_claw_replay.term_bytes += bytes;
+	if (g_claw_replay.finished) clawReplayFinish();
+}
+
+/* Lines on their way to hakoc. Sending only appends here and writes what
+ * the (non-blocking) pipe takes; editorWaitEvent polls the pipe while
+ * anything is left and calls clawFlush when it drains. UI thread only. */
+static struct abuf g_claw_out = ABUF_INIT;
+static int g_claw_out_off = 0;
+
+static void clawJsonEsc(struct abuf *ab, const char *src) {
+	const char *run = src;
+	for (const char *p = src; *p; p++) {
 		unsigned char c = (unsigned char)*p;
-		if      (c == '"')  { if (d < dsz-3) { dst[d++]='\\'; dst[d++]='"';  } }
-		else if (c == '\\') { if (d < dsz-3) { dst[d++]='\\'; dst[d++]='\\'; } }
-		else if (c == '\n') { if (d < dsz-3) { dst[d++]='\\'; dst[d++]='n';  } }
-		else if (c == '\r') { if (d < dsz-3) { dst[d++]='\\'; dst[d++]='r';  } }
-		else if (c == '\t') { if (d < dsz-3) { dst[d++]='\\'; dst[d++]='t';  } }
-		else                { dst[d++] = (char)c; }
+		if (c != '"' && c != '\\' && c >= 0x20) continue;
+		abAppend(ab, run, p - run);
+		run = p + 1;
+		if      (c == '"')  abAppend(ab, "\\\"", 2);
+		else if (c == '\\') abAppend(ab, "\\\\", 2);
+		else if (c == '\n') abAppend(ab, "\\n", 2);
+		else if (c == '\r') abAppend(ab, "\\r", 2);
+		else if (c == '\t') abAppend(ab, "\\t", 2);
+		else {
+			char esc[8];
+			snprintf(esc, sizeof(esc), "\\u%04x", c);
+			abAppend(ab, esc, 6);
+		}
 	}
-	dst[d] = '\0';
+	abAppend(ab, run, strlen(run));
 }
 
-static void clawSendLine(const char *json) {
-	if (g_claw_fd_write < 0) return;
-	size_t len = strlen(json);
-	ssize_t w1 = write(g_claw_fd_write, json, len);
-	ssize_t w2 = write(g_claw_fd_write, "\n", 1);
-	if (w1 < 0 || w2 < 0) {
+static void clawFlush(void) {
+	while (g_claw_fd_write >= 0 && g_claw_out_off < g_claw_out.len) {
+		ssize_t w = write(g_claw_fd_write, g_claw_out.b + g_claw_out_off, g_claw_out.len - g_claw_out_off);
+		if (w > 0) { g_claw_out_off += w; continue; }
+		if (w < 0 && errno == EINTR) continue;
+		if (w < 0 && errno == EAGAIN) return;
 		/* pipe broken — hakoc died. mark as gone so further sends no-op. */
 		close(g_claw_fd_write);
 		g_claw_fd_write = -1;
 	}
+	g_claw_out.len = 0;
+	g_claw_out_off = 0;
+}
+
+/* The pipe to poll for writability, or -1 when nothing is queued. */
+static int clawWriteFd(void) {
+	return g_claw_out_off < g_claw_out.len ? g_claw_fd_write : -1;
 }
 
-/* history helpers — display only; hakoc owns the API message stack */
+static int clawQueued(void) {
+	return g_claw_out.len - g_claw_out_off;
+}
+
+/* Queues {"type":type,key:text} and starts writing it. */
+static void clawSend(const char *type, const char *key, const char *text) {
+	if (g_claw_fd_write < 0) return;
+	abAppend(&g_claw_out, "{\"type\":\"", 9);
+	abAppend(&g_claw_out, type, strlen(type));
+	abAppend(&g_claw_out, "\",\"", 3);
+	abAppend(&g_claw_out, key, strlen(key));
+	abAppend(&g_claw_out, "\":\"", 3);
+	clawJsonEsc(&g_claw_out, text);
+	abAppend(&g_claw_out, "\"}\n", 3);
+	clawFlush();
+}
+
+/* history helpers — display only; hakoc owns the API message stack.
+ * Lines are kept whole; aiLineWrap fits them to the pane and caches the
+ * result until the line or the pane width changes. Only the UI thread
+ * touches history (see clawPollEvents), so none of this locks. */
 
 void aiAddHistory(aiData *data, const char *text);
 
+static aiLine *aiLineAt(aiData *data, int i) {
+	return &data->history[(data->history_head + i) % data->history_cap];
+}
+
+/* Word-wraps l at data->wrap_w columns, keeping data->wrap_rows in step.
+ * With resume, rows before the last are kept: greedy wrapping never moves
+ * them when text is only appended. */
+static void aiLineWrap(aiData *data, aiLine *l, int resume) {
+	int w = data->wrap_w;
+	if (w <= 0) return;
+	int rows = 1, row_start = 0;
+	if (l->wrap_w == w) {
+		data->wrap_rows -= l->wrap_rows;
+		if (resume && l->wrap_rows > 1) {
+			rows = l->wrap_rows;
+			row_start = l->wrap_off[rows - 2];
+		}
+	}
+
+	int col = 0, brk = -1;
+	for (int i = row_start; i < l->len; ) {
+		int cw = utf8_char_width(l->text, i);
+		if (cw < 1) cw = 1;
+		int next = utf8_next_char(l->text, i, l->len);
+		if (col + cw > w && i > row_start) {
+			int at = brk > row_start ? brk : i;
+			if (rows - 1 >= l->wrap_cap) {
+				int cap = l->wrap_cap ? l->wrap_cap * 2 : 8;
+				int *off = realloc(l->wrap_off, sizeof(int) * cap);
+				if (!off) break;
+				l->wrap_off = off;
+				l->wrap_cap = cap;
+			}
+			l->wrap_off[rows - 1] = at;
+			rows++;
+			row_start = at;
+			brk = -1;
+			col = 0;
+			for (int j = at; j < i; j = utf8_next_char(l->text, j, l->len)) {
+				int jw = utf8_char_width(l->text, j);
+				col += jw < 1 ? 1 : jw;
+			}
+		}
+		col += cw;
+		if (l->text[i] == ' ') brk = next;
+		i = next;
+	}
+	l->wrap_w = w;
+	l->wrap_rows = rows;
+	data->wrap_rows += rows;
+}
+
+/* Rewraps every line for a new pane width; scrollback is kept whole. */
+static void aiReflow(aiData *data, int width) {
+	data->wrap_w = width;
+	data->wrap_rows = 0;
+	for (int i = 0; i < data->history_count; i++) {
+		aiLine *l = aiLineAt(data, i);
+		l->wrap_w = 0;
+		aiLineWrap(data, l, 0);
+	}
+}
+
+static void aiLineFree(aiData *data, aiLine *l) {
+	if (l->wrap_w == data->wrap_w) data->wrap_rows -= l->wrap_rows;
+	free(l->text);
+	free(l->wrap_off);
+	memset(l, 0, sizeof(*l));
+}
+
+/* Drops lines from the end until n are left. */
+static void aiHistoryTruncate(aiData *data, int n) {
+	while (data->history_count > n) {
+		aiLine *l = aiLineAt(data, --data->history_count);
+		aiLineFree(data, l);
+	}
+}
+
+static void aiLineAppend(aiData *data, aiLine *l, const char *text, int len) {
+	if (l->len + len + 1 > l->cap) {
+		int cap = l->cap ? l->cap : 64;
+		while (cap < l->len + len + 1) cap *= 2;
+		char *t = realloc(l->text, cap);
+		if (!t) return;
+		l->text = t;
+		l->cap = cap;
+	}
+	/* tabs and other control bytes would not take the cell wrapping gave them */
+	for (int i = 0; i < len; i++) {
+		unsigned char c = (unsigned char)text[i];
+		l->text[l->len++] = c < 0x20 ? ' ' : (char)c;
+	}
+	l->text[l->len] = '\0';
+	aiLineWrap(data, l, 1);
+}
+
+/* Adds a line, growing the ring up to AI_HISTORY_MAX lines and then
+ * dropping the oldest. Indices into history move up with it. */
 static void aiPushHistoryLine(aiData *data, const char *text, int len, unsigned char role) {
-	if (data->history_count >= AI_HISTORY_MAX) return;
-	char *line = malloc(len + 1);
-	if (!line) return;
-	memcpy(line, text, len);
-	line[len] = '\0';
-	data->history_role[data->history_count] = role;
-	data->history[data->history_count++] = line;
-}
-
-static void aiAddHistoryLine(aiData *data, const char *text, int text_len, unsigned char role) {
-	int max_width = 60;
-	if (text_len <= 0) { aiPushHistoryLine(data, "", 0, role); return; }
-	if (text_len <= max_width) { aiPushHistoryLine(data, text, text_len, role); return; }
-	int pos = 0;
-	while (pos < text_len) {
-		if (data->history_count >= AI_HISTORY_MAX) break;
-		int end = pos + max_width;
-		if (end >= text_len) { aiPushHistoryLine(data, text + pos, text_len - pos, role); break; }
-		int wrap = end;
-		while (wrap > pos && text[wrap] != ' ') wrap--;
-		if (wrap == pos) wrap = end;
-		aiPushHistoryLine(data, text + pos, wrap - pos, role);
-		pos = wrap;
-		while (pos < text_len && text[pos] == ' ') pos++;
+	if (data->history_count == data->history_cap) {
+		if (data->history_cap < AI_HISTORY_MAX) {
+			int cap = data->history_cap ? MIN(data->history_cap * 2, AI_HISTORY_MAX) : 256;
+			aiLine *h = calloc(cap, sizeof(aiLine));
+			if (!h) return;
+			for (int i = 0; i < data->history_count; i++) h[i] = *aiLineAt(data, i);
+			free(data->history);
+			data->history = h;
+			data->history_cap = cap;
+			data->history_head = 0;
+		} else {
+			aiLineFree(data, aiLineAt(data, 0));
+			data->history_head = (data->history_head + 1) % data->history_cap;
+			data->history_count--;
+			if (data->cursor_y > 0) data->cursor_y--;
+			if (data->visual_start > 0) data->visual_start--;
+			if (data->visual_end > 0) data->visual_end--;
+			if (data->stream_slot > 0) data->stream_slot--;
+		}
 	}
+	aiLine *l = aiLineAt(data, data->history_count++);
+	memset(l, 0, sizeof(*l));
+	l->role = role;
+	aiLineAppend(data, l, text, len);
 }
 
 void aiAddHistoryRole(aiData *data, const char *text, unsigned char role) {
 	if (!data || !text) return;
-	if (data->history_count > 0 && data->history_count < AI_HISTORY_MAX - 1) {
-		unsigned char prev = data->history_role[data->history_count - 1];
-		int role_swap = (prev != role) &&
-		    (prev == HK_ROLE_USER || prev == HK_ROLE_AI ||
+	if (data->history_count > 0) {
+		aiLine *prev = aiLineAt(data, data->history_count - 1);
+		int role_swap = (prev->role != role) &&
+		    (prev->role == HK_ROLE_USER || prev->role == HK_ROLE_AI ||
 		     role == HK_ROLE_USER || role == HK_ROLE_AI);
-		char *prev_text = data->history[data->history_count - 1];
-		if (role_swap && prev_text && *prev_text != '\0')
+		if (role_swap && prev->len > 0)
 			aiPushHistoryLine(data, "", 0, HK_ROLE_SYSTEM);
 	}
 	const char *p = text;
 	while (1) {
 		const char *nl = strchr(p, '\n');
 		int seg = nl ? (int)(nl - p) : (int)strlen(p);
-		aiAddHistoryLine(data, p, seg, role);
+		aiPushHistoryLine(data, p, seg, role);
 		if (!nl) break;
 		p = nl + 1;
 	}
@@ -7603,23 +9846,134 @@ void aiAddHistory(aiData *data, const char *text) {
 	aiAddHistoryRole(data, text, HK_ROLE_SYSTEM);
 }
 
-static void clawHandleEvent(aiData *data, const char *line) {
-	char *type = hkExtractJsonString(line, "type");
-	if (!type) return;
+/* Ends the streamed reply in history[stream_slot..]. Its lines already
+ * are the message, so keep just closes the slot; otherwise they are
+ * dropped (an error, or a final message that replaces them). */
+static void aiStreamClose(aiData *data, int keep) {
+	if (data->stream_slot < 0) return;
+	if (!keep) aiHistoryTruncate(data, data->stream_slot);
+	data->stream_slot = -1;
+}
+
+/* Appends a token to the streamed reply: to the last line, or to new
+ * lines at each '\n'. Only the appended line's last row is rewrapped. */
+static void aiStreamAppend(aiData *data, const char *text, size_t len) {
+	if (data->stream_slot < 0) {
+		data->stream_slot = data->history_count;
+		if (data->history_count > 0) {
+			aiLine *prev = aiLineAt(data, data->history_count - 1);
+			if (prev->role != HK_ROLE_AI && prev->len > 0)
+				aiPushHistoryLine(data, "", 0, HK_ROLE_SYSTEM);
+		}
+		aiPushHistoryLine(data, "", 0, HK_ROLE_AI);
+	}
+
+	while (len > 0) {
+		const char *nl = memchr(text, '\n', len);
+		size_t seg = nl ? (size_t)(nl - text) : len;
+		aiLineAppend(data, aiLineAt(data, data->history_count - 1), text, (int)seg);
+		if (!nl) break;
+		aiPushHistoryLine(data, "", 0, HK_ROLE_AI);
+		text += seg + 1;
+		len  -= seg + 1;
+	}
+	data->history_pos = MAX(0, data->history_count - 20);
+}
+
+/* Turn timings. Events carry the time the reader got them, so frames
+ * drawn in between do not count against hakoc. */
+static void aiPerfEvent(aiData *data, long long ms, int bytes) {
+	if (!data->perf_start_ms) return;
+	if (data->perf_events == 0) data->perf_first_ms = ms;
+	data->perf_events++;
+	data->perf_bytes += bytes;
+}
+
+static int aiPerfRate(const aiTurnPerf *t) {
+	int span = t->done_ms - t->first_ms;
+	if (span <= 0) span = t->done_ms;
+	return span > 0 ? (int)((long long)t->events * 1000 / span) : 0;
+}
+
+static void aiPerfWriteCsv(aiData *data) {
+	FILE *fp = fopen(E.rei_perf_csv, "a");
+	if (!fp) return;
+	if (ftell(fp) == 0)
+		fprintf(fp, "time,provider,model,first_event_ms,done_ms,events,bytes,events_per_sec,in_tokens,out_tokens\n");
+	aiTurnPerf *t = &data->perf_last;
+	fprintf(fp, "%lld,%s,%s,%d,%d,%d,%lld,%d,%d,%d\n",
+		(long long)time(NULL), data->provider, data->model,
+		t->first_ms, t->done_ms, t->events, t->bytes, aiPerfRate(t),
+		data->last_in_tokens, data->last_out_tokens);
+	fclose(fp);
+}
+
+static void aiPerfTurnEnd(aiData *data, long long ms, int finished) {
+	if (!data->perf_start_ms) return;
+	if (finished) {
+		aiTurnPerf *t = &data->perf_last;
+		t->first_ms = data->perf_events ? (int)(data->perf_first_ms - data->perf_start_ms) : 0;
+		t->done_ms  = (int)(ms - data->perf_start_ms);
+		t->events   = data->perf_events;
+		t->bytes    = data->perf_bytes;
+		data->perf_turns++;
+		data->perf_sum_first += t->first_ms;
+		data->perf_sum_done  += t->done_ms;
+		if (E.rei_perf_csv) aiPerfWriteCsv(data);
+	}
+	data->perf_start_ms = 0;
+}
+
+static void aiPerfReport(aiData *data) {
+	char line[160];
+	if (data->perf_start_ms) {
+		snprintf(line, sizeof(line), "perf: turn in flight for %lld ms, %d events so far",
+			editorNowMs() - data->perf_start_ms, data->perf_events);
+		aiAddHistory(data, line);
+	}
+	if (data->perf_turns == 0) {
+		aiAddHistory(data, "perf: no finished turn yet");
+		return;
+	}
+	aiTurnPerf *t = &data->perf_last;
+	snprintf(line, sizeof(line), "perf: last turn: first event %d ms, done %d ms", t->first_ms, t->done_ms);
+	aiAddHistory(data, line);
+	snprintf(line, sizeof(line), "perf: %d events, %.1f KB, %d events/s",
+		t->events, t->bytes / 1024.0, aiPerfRate(t));
+	aiAddHistory(data, line);
+	snprintf(line, sizeof(line), "perf: tokens in %d / out %d (session %ld / %ld)",
+		data->last_in_tokens, data->last_out_tokens, data->total_in_tokens, data->total_out_tokens);
+	aiAddHistory(data, line);
+	snprintf(line, sizeof(line), "perf: %d turns, avg first event %lld ms, avg done %lld ms",
+		data->perf_turns, data->perf_sum_first / data->perf_turns, data->perf_sum_done / data->perf_turns);
+	aiAddHistory(data, line);
+	if (E.rei_perf_csv) {
+		snprintf(line, sizeof(line), "perf: logging to %s", E.rei_perf_csv);
+		aiAddHistory(data, line);
+	}
+}
+
+/* Returns the event's clawEventType (CLAW_EV_UNKNOWN if it did not parse). */
+static int clawHandleEvent(aiData *data, char *line) {
+	clawEvent ev;
+	if (!clawParseEvent(line, &ev)) return CLAW_EV_UNKNOWN;
 
-	if (strcmp(type, "init") == 0) {
-		char *session  = hkExtractJsonString(line, "session");
-		int   resumed  = hkExtractJsonInt(line, "resumed");
-		int   turns    = hkExtractJsonInt(line, "turns");
-		char *provider = hkExtractJsonString(line, "provider");
-		char *model    = hkExtractJsonString(line, "model");
+	if (ev.type == CLAW_EV_DELTA) {
+		if (ev.text) {
+			aiStreamAppend(data, ev.text, ev.text_len);
+		}
+
+	} else if (ev.type == CLAW_EV_INIT) {
+		const char *provider = ev.provider;
+		const char *model    = ev.model;
+		snprintf(data->provider, sizeof(data->provider), "%s", provider ? provider : "");
+		snprintf(data->model, sizeof(data->model), "%s", model ? model : "");
 
 		free(E.claw_session_id);
-		E.claw_session_id      = session ? session : strdup("");
-		E.claw_session_turns   = turns > 0 ? turns : 0;
-		E.claw_session_resumed = resumed > 0 ? 1 : 0;
+		E.claw_session_id      = strdup(ev.session ? ev.session : "");
+		E.claw_session_turns   = ev.turns > 0 ? ev.turns : 0;
+		E.claw_session_resumed = ev.resumed > 0 ? 1 : 0;
 
-		pthread_mutex_lock(&data->lock);
 		char info[256];
 		if (provider && *provider) {
 			snprintf(info, sizeof(info), "provider: %s%s%s",
@@ -7635,72 +9989,36 @@ static void clawHandleEvent(aiData *data, const char *line) {
 			aiAddHistory(data, "session: new");
 		}
 		data->history_pos = MAX(0, data->history_count - 20);
-		pthread_mutex_unlock(&data->lock);
 
-		free(provider);
-		free(model);
-
-	} else if (strcmp(type, "message") == 0) {
-		char *role = hkExtractJsonString(line, "role");
-		char *text = hkExtractJsonString(line, "text");
+	} else if (ev.type == CLAW_EV_MESSAGE) {
+		const char *role = ev.role;
+		const char *text = ev.text;
 		if (text) {
 			unsigned char hrole = HK_ROLE_SYSTEM;
 			if (role && strcmp(role, "ai")   == 0) hrole = HK_ROLE_AI;
 			if (role && strcmp(role, "user") == 0) hrole = HK_ROLE_USER;
-			pthread_mutex_lock(&data->lock);
-			/* close any open streaming slot before adding a full message */
-			if (data->stream_slot >= 0) {
-				free(data->history[data->stream_slot]);
-				data->history[data->stream_slot] = NULL;
-				data->history_count = data->stream_slot;
-				if (data->stream_acc) {
-					aiAddHistoryRole(data, data->stream_acc, HK_ROLE_AI);
-					free(data->stream_acc);
-					data->stream_acc     = NULL;
-					data->stream_acc_len = 0;
-				}
-				data->stream_slot = -1;
-			}
+			/* an ai message is the final text of the streamed reply */
+			aiStreamClose(data, hrole != HK_ROLE_AI);
 			aiAddHistoryRole(data, text, hrole);
 			data->history_pos = MAX(0, data->history_count - 20);
-			pthread_mutex_unlock(&data->lock);
-			free(text);
 		}
-		free(role);
 
-	} else if (strcmp(type, "tool_start") == 0 || strcmp(type, "tool_end") == 0) {
-		char *display = hkExtractJsonString(line, "display");
-		if (display) {
-			pthread_mutex_lock(&data->lock);
-			aiAddHistory(data, display);
+	} else if (ev.type == CLAW_EV_TOOL) {
+		if (ev.display) {
+			aiStreamClose(data, 1);
+			aiAddHistory(data, ev.display);
 			data->history_pos = MAX(0, data->history_count - 20);
-			pthread_mutex_unlock(&data->lock);
-			free(display);
 		}
 
-	} else if (strcmp(type, "done") == 0) {
-		int in      = hkExtractJsonInt(line, "in");
-		int out     = hkExtractJsonInt(line, "out");
-		int turn    = hkExtractJsonInt(line, "turn");
-		char *session = hkExtractJsonString(line, "session");
+	} else if (ev.type == CLAW_EV_DONE) {
+		int in  = ev.in;
+		int out = ev.out;
 
 		free(E.claw_session_id);
-		E.claw_session_id    = session ? session : strdup("");
-		E.claw_session_turns = turn > 0 ? turn : E.claw_session_turns;
-
-		pthread_mutex_lock(&data->lock);
-		if (data->stream_slot >= 0) {
-			free(data->history[data->stream_slot]);
-			data->history[data->stream_slot] = NULL;
-			data->history_count = data->stream_slot;
-			if (data->stream_acc) {
-				aiAddHistoryRole(data, data->stream_acc, HK_ROLE_AI);
-				free(data->stream_acc);
-				data->stream_acc     = NULL;
-				data->stream_acc_len = 0;
-			}
-			data->stream_slot = -1;
-		}
+		E.claw_session_id    = strdup(ev.session ? ev.session : "");
+		E.claw_session_turns = ev.turn > 0 ? ev.turn : E.claw_session_turns;
+
+		aiStreamClose(data, 1);
 		if (in > 0) {
 			data->last_in_tokens   = in;
 			data->last_out_tokens  = out > 0 ? out : 0;
@@ -7709,47 +10027,95 @@ static void clawHandleEvent(aiData *data, const char *line) {
 		}
 		data->streaming   = 0;
 		data->history_pos = MAX(0, data->history_count - 20);
-		pthread_mutex_unlock(&data->lock);
-
-	} else if (strcmp(type, "error") == 0) {
-		char *msg = hkExtractJsonString(line, "message");
-		pthread_mutex_lock(&data->lock);
-		if (data->stream_slot >= 0) {
-			free(data->history[data->stream_slot]);
-			data->history[data->stream_slot] = NULL;
-			data->history_count = data->stream_slot;
-			free(data->stream_acc);
-			data->stream_acc     = NULL;
-			data->stream_acc_len = 0;
-			data->stream_slot    = -1;
-		}
-		aiAddHistory(data, msg ? msg : "Error: unknown");
+
+	} else if (ev.type == CLAW_EV_ERROR) {
+		aiStreamClose(data, 0);
+		aiAddHistory(data, ev.message ? ev.message : "Error: unknown");
 		data->streaming   = 0;
 		data->history_pos = MAX(0, data->history_count - 20);
-		pthread_mutex_unlock(&data->lock);
-		free(msg);
 	}
-
-	free(type);
+	return ev.type;
 }
 
 static void *clawReaderThread(void *arg) {
-	aiData *data = (aiData *)arg;
-	char line[65536];
-	while (g_claw_fp_read && fgets(line, sizeof(line), g_claw_fp_read)) {
-		int len = (int)strlen(line);
+	/* getline grows the buffer, so an event of any size arrives whole */
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	clawReaderArg *ra = arg;
+	FILE *fp = ra->fp;
+	int gen = ra->gen;
+	free(ra);
+	while ((len = getline(&line, &cap, fp)) != -1) {
+		int bytes = (int)len;
 		while (len > 0 && (line[len-1] == '\n' || line[len-1] == '\r')) line[--len] = '\0';
 		if (len == 0) continue;
-		clawHandleEvent(data, line);
-		E.full_redraw_pending = 1;
+		/* hand the buffer itself over; getline allocates the next one */
+		pthread_mutex_lock(&g_claw_inbox_lock);
+		if (gen != g_claw_gen) {
+			pthread_mutex_unlock(&g_claw_inbox_lock);
+			continue;
+		}
+		if (g_claw_inbox_n == g_claw_inbox_cap) {
+			int ncap = g_claw_inbox_cap ? g_claw_inbox_cap * 2 : 64;
+			clawInboxItem *inbox = realloc(g_claw_inbox, sizeof(clawInboxItem) * ncap);
+			if (inbox) {
+				g_claw_inbox = inbox;
+				g_claw_inbox_cap = ncap;
+			}
+		}
+		if (g_claw_inbox_n < g_claw_inbox_cap) {
+			g_claw_inbox[g_claw_inbox_n++] = (clawInboxItem){ line, editorNowMs(), bytes };
+			line = NULL;
+			cap = 0;
+		}
+		pthread_mutex_unlock(&g_claw_inbox_lock);
+		editorWake();
 	}
-	pthread_mutex_lock(&data->lock);
-	data->streaming = 0;
-	pthread_mutex_unlock(&data->lock);
-	g_claw_reader_running = 0;
+	free(line);
+	fclose(fp);
+	pthread_mutex_lock(&g_claw_inbox_lock);
+	if (gen == g_claw_gen) {
+		g_claw_reader_done = 1;
+		g_claw_reader_running = 0;
+	}
+	pthread_mutex_unlock(&g_claw_inbox_lock);
+	editorWake();
 	return NULL;
 }
 
+/* Applies what the reader has queued to the Rei history. Called by the
+ * UI thread before each frame. */
+void clawPollEvents(void) {
+	pthread_mutex_lock(&g_claw_inbox_lock);
+	clawInboxItem *items = g_claw_inbox;
+	int n = g_claw_inbox_n;
+	int done = g_claw_reader_done;
+	g_claw_inbox = NULL;
+	g_claw_inbox_n = g_claw_inbox_cap = 0;
+	g_claw_reader_done = 0;
+	pthread_mutex_unlock(&g_claw_inbox_lock);
+
+	for (int i = 0; i < n; i++) {
+		aiData *data = g_claw_data;
+		if (data) {
+			long long start_us = g_claw_replay.active ? editorNowUs() : 0;
+			aiPerfEvent(data, items[i].ms, items[i].bytes);
+			int type = clawHandleEvent(data, items[i].line);
+			if (g_claw_replay.active) clawReplayEvent(start_us, items[i].bytes);
+			if (type == CLAW_EV_DONE || type == CLAW_EV_ERROR)
+				aiPerfTurnEnd(data, items[i].ms, type == CLAW_EV_DONE);
+		}
+		free(items[i].line);
+	}
+	free(items);
+	if (done && g_claw_data) {
+		g_claw_data->streaming = 0;
+		aiPerfTurnEnd(g_claw_data, 0, 0);
+		if (g_claw_replay.active) g_claw_replay.finished = 1;
+	}
+}
+
 static char *clawFindBinary(void) {
 	char buf[PATH_MAX];
 
@@ -7823,6 +10189,7 @@ static int clawLaunch(aiData *data) {
 		dup2(from_child[1], STDOUT_FILENO);
 		close(to_child[0]);   close(to_child[1]);
 		close(from_child[0]); close(from_child[1]);
+		if (g_claw_replay.active) clawReplayRun();
 		char *argv[] = {bin, "--pipe", NULL};
 		execvp(bin, argv);
 		_exit(127);
@@ -7830,13 +10197,21 @@ static int clawLaunch(aiData *data) {
 	close(to_child[0]);
 	close(from_child[1]);
 	free(bin);
+	fcntl(to_child[1], F_SETFL, fcntl(to_child[1], F_GETFL) | O_NONBLOCK);
 	g_claw_fd_write     = to_child[1];
-	g_claw_fp_read      = fdopen(from_child[0], "r");
 	g_claw_pid          = pid;
 	g_claw_data         = data;
 	g_claw_reader_running = 1;
-	if (pthread_create(&g_claw_reader, NULL, clawReaderThread, data) != 0) {
-		fclose(g_claw_fp_read); g_claw_fp_read  = NULL;
+	if (g_claw_replay.active) g_claw_replay.start_us = editorNowUs();
+	clawReaderArg *ra = malloc(sizeof(clawReaderArg));
+	if (ra) {
+		ra->fp = fdopen(from_child[0], "r");
+		ra->gen = g_claw_gen;
+	}
+	if (!ra || !ra->fp || pthread_create(&g_claw_reader, NULL, clawReaderThread, ra) != 0) {
+		if (ra && ra->fp) fclose(ra->fp);
+		else close(from_child[0]);
+		free(ra);
 		close(g_claw_fd_write); g_claw_fd_write = -1;
 		g_claw_pid            = -1;
 		g_claw_reader_running = 0;
@@ -7850,16 +10225,22 @@ static int clawLaunch(aiData *data) {
 static void clawShutdown(void) {
 #ifndef _WIN32
 	if (g_claw_fd_write >= 0) {
-		const char *quit = "{\"type\":\"quit\"}\n";
-		ssize_t w = write(g_claw_fd_write, quit, strlen(quit));
-		(void)w;
-		close(g_claw_fd_write);
+		/* a half-sent line would garble quit; hakoc exits on EOF anyway */
+		clawFlush();
+		if (g_claw_out.len == 0 && g_claw_fd_write >= 0) {
+			const char *quit = "{\"type\":\"quit\"}\n";
+			ssize_t w = write(g_claw_fd_write, quit, strlen(quit));
+			(void)w;
+		}
+		if (g_claw_fd_write >= 0) close(g_claw_fd_write);
 		g_claw_fd_write = -1;
 	}
-	if (g_claw_fp_read) {
-		fclose(g_claw_fp_read);
-		g_claw_fp_read = NULL;
-	}
+	abFree(&g_claw_out);
+	g_claw_out.b = NULL;
+	g_claw_out.len = g_claw_out.cap = 0;
+	g_claw_out_off = 0;
+	/* the reader's end of the pipe is its own to close: it sees EOF once
+	 * hakoc is gone */
 	if (g_claw_pid > 0) {
 		/* graceful: hakoc sees quit on stdin or EOF, exits.
 		   If still alive after a beat, SIGTERM. Reap to avoid zombie. */
@@ -7876,6 +10257,12 @@ static void clawShutdown(void) {
 	}
 	g_claw_reader_running = 0;
 	g_claw_data           = NULL;
+	/* whatever the old reader left, or reads from here on, is not for
+	 * the next Rei pane */
+	pthread_mutex_lock(&g_claw_inbox_lock);
+	g_claw_gen++;
+	pthread_mutex_unlock(&g_claw_inbox_lock);
+	clawPollEvents();
 #endif
 }
 
@@ -7883,34 +10270,30 @@ void aiWorkerSend(aiData *data) {
 	if (!data) return;
 	if (data->streaming) return;
 	if (g_claw_fd_write < 0) {
-		pthread_mutex_lock(&data->lock);
 		aiAddHistory(data, "Rei not connected. Close and reopen (:q rei, then :rei).");
-		pthread_mutex_unlock(&data->lock);
 		return;
 	}
 	data->streaming = 1;
-	char esc[8192];
-	clawJsonEsc(data->current_prompt ? data->current_prompt : "", esc, sizeof(esc));
-	char json[8256];
-	snprintf(json, sizeof(json), "{\"type\":\"prompt\",\"text\":\"%s\"}", esc);
-	clawSendLine(json);
+	data->perf_start_ms = editorNowMs();
+	data->perf_events = 0;
+	data->perf_bytes = 0;
+	clawSend("prompt", "text", data->current_prompt ? data->current_prompt : "");
 }
 
 int hkHandleSlash(aiData *data, const char *prompt) {
 	if (!data) return 0;
 	if (strcmp(prompt, "/quit") == 0 || strcmp(prompt, "/q") == 0) return 2;
+	if (strcmp(prompt, "/perf") == 0) {
+		aiPerfReport(data);
+		data->history_pos = MAX(0, data->history_count - 20);
+		return 0;
+	}
 	if (g_claw_fd_write < 0) {
-		pthread_mutex_lock(&data->lock);
 		aiAddHistory(data, "Rei not connected.");
-		pthread_mutex_unlock(&data->lock);
 		return 0;
 	}
-	char esc[4096];
-	clawJsonEsc(prompt, esc, sizeof(esc));
-	char json[4160];
-	snprintf(json, sizeof(json), "{\"type\":\"slash\",\"cmd\":\"%s\"}", esc);
 	data->streaming = 1;
-	clawSendLine(json);
+	clawSend("slash", "cmd", prompt);
 	return 0;
 }
 
@@ -7933,10 +10316,16 @@ void editorGenerateConfig(void) {
 	fprintf(fp, "word_wrap=1\n");
 	fprintf(fp, "show_line_numbers=1\n");
 	fprintf(fp, "max_undo_levels=100\n");
+	fprintf(fp, "# files this many MB or larger are memory-mapped (0 = never)\n");
+	fprintf(fp, "large_file_mb=%d\n", LARGE_FILE_MB);
 	fprintf(fp, "auto_indent=1\n");
 	fprintf(fp, "smart_indent=1\n");
 	fprintf(fp, "mouse_enabled=1\n");
-	fprintf(fp, "scroll_speed=3\n\n");
+	fprintf(fp, "scroll_speed=3\n");
+	fprintf(fp, "# most frames drawn per second while input is arriving (0 = no cap)\n");
+	fprintf(fp, "max_fps=60\n");
+	fprintf(fp, "# ms a lone Esc waits for the rest of a key sequence\n");
+	fprintf(fp, "escape_timeout=50\n\n");
 
 	fprintf(fp, "# ============================================================\n");
 	fprintf(fp, "#  紙 Kami — file explorer (left panel)\n");
@@ -7950,6 +10339,8 @@ void editorGenerateConfig(void) {
 	fprintf(fp, "#  Rei is powered by hakoc. Configure AI in ~/.hakocrc\n");
 	fprintf(fp, "#  Run: hakoc --help  |  man page: https://mithraeums.github.io\n");
 	fprintf(fp, "# ============================================================\n\n");
+	fprintf(fp, "# append per-turn latency (as shown by /perf) to this CSV file\n");
+	fprintf(fp, "# rei_perf_csv=/path/to/rei-perf.csv\n\n");
 
 	fprintf(fp, "# ============================================================\n");
 	fprintf(fp, "#  Theme preset\n");
@@ -8249,6 +10640,7 @@ int editorApplyThemeByName(const char *name) {
 	} else {
 		return 0;
 	}
+	gridPaletteReset();
 	gridInvalidateFront();
 	E.full_redraw_pending = 1;
 	return 1;
@@ -8333,6 +10725,8 @@ void editorLoadConfig() {
 			E.show_line_numbers = atoi(val);
 		} else if (strcmp(key, "max_undo_levels") == 0) {
 			E.max_undo_levels = atoi(val);
+		} else if (strcmp(key, "large_file_mb") == 0) {
+			E.large_file_mb = atoi(val);
 		} else if (strcmp(key, "mouse_enabled") == 0) {
 			E.mouse_enabled = atoi(val);
 		} else if (strcmp(key, "auto_indent") == 0) {
@@ -8342,6 +10736,15 @@ void editorLoadConfig() {
 		} else if (strcmp(key, "scroll_speed") == 0) {
 			E.scroll_speed = atoi(val);
 			if (E.scroll_speed < 1) E.scroll_speed = 3;
+		} else if (strcmp(key, "max_fps") == 0) {
+			E.max_fps = atoi(val);
+			if (E.max_fps < 0) E.max_fps = 0;
+		} else if (strcmp(key, "escape_timeout") == 0) {
+			E.escape_timeout = atoi(val);
+			if (E.escape_timeout < 0) E.escape_timeout = 0;
+		} else if (strcmp(key, "rei_perf_csv") == 0) {
+			free(E.rei_perf_csv);
+			E.rei_perf_csv = *val ? strdup(val) : NULL;
 		} else if (strcmp(key, "relative_line_numbers") == 0) {
 			E.relative_line_numbers = atoi(val);
 			if (E.relative_line_numbers) E.show_line_numbers = 2;
@@ -8392,6 +10795,7 @@ void initEditor() {
 	E.word_wrap = 1;
 	E.word_wrap_column = 0;
 	E.max_undo_levels = 100;
+	E.large_file_mb = LARGE_FILE_MB;
 	E.show_line_numbers = 1;
 	E.line_number_width = 0;
 	editorInitPasteBuffer();
@@ -8402,6 +10806,9 @@ void initEditor() {
 	E.full_redraw_pending = 1;
 	E.grid_front = NULL;
 	E.grid_back = NULL;
+	E.grid_dirty = NULL;
+	E.grid_painted = NULL;
+	E.grid_row_painted = NULL;
 	E.grid_w = 0;
 	E.grid_h = 0;
 	E.explorer_enabled = 1;
@@ -8422,6 +10829,7 @@ void initEditor() {
 	E.mouse_button = 0;
 	E.plugin_count = 0;
 	E.plugin_dir = NULL;
+	E.rei_perf_csv = NULL;
 	E.auto_indent = 1;
 	E.smart_indent = 1;
 
@@ -8432,6 +10840,9 @@ void initEditor() {
 
 	E.indent_guides = 0;
 	E.scroll_speed = 3;
+	E.max_fps = 60;
+	E.escape_timeout = 50;
+	E.last_frame_ms = 0;
 	E.config_path = NULL;
 	E.theme_preset = THEME_DARK;
 
@@ -8511,6 +10922,7 @@ void editorCleanup() {
 	hkFreeRegisters();
 	free(E.search.query);
 	free(E.plugin_dir);
+	free(E.rei_perf_csv);
 	free(E.config_path);
 
 	free(E.explorer_kanji);
@@ -8535,11 +10947,42 @@ int main(int argc, char *argv[]) {
 		}
 	}
 
+	char *file = NULL;
+	const char *replay = NULL;
+	const char *script = NULL;
+	double replay_speed = 1;
+	E.headless_cols = 80;
+	E.headless_rows = 24;
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--claw-replay") == 0 && i + 1 < argc) replay = argv[++i];
+		else if (strcmp(argv[i], "--replay-speed") == 0 && i + 1 < argc) replay_speed = atof(argv[++i]);
+		else if (strcmp(argv[i], "--headless") == 0) E.headless = 1;
+		else if (strcmp(argv[i], "--script") == 0 && i + 1 < argc) script = argv[++i];
+		else if (strcmp(argv[i], "--size") == 0 && i + 1 < argc) {
+			if (sscanf(argv[++i], "%dx%d", &E.headless_cols, &E.headless_rows) != 2 ||
+				E.headless_cols < 1 || E.headless_rows < 2) {
+				fprintf(stderr, "hako: --size wants COLSxROWS, e.g. 200x60\n");
+				return 1;
+			}
+		}
+		else if (!file) file = argv[i];
+	}
+	if (replay && clawReplayLoad(replay, replay_speed) < 0) {
+		fprintf(stderr, "hako: %s: %s\n", replay, strerror(errno));
+		return 1;
+	}
+	if (E.headless && editorHeadlessLoad(script) < 0) {
+		fprintf(stderr, "hako: %s: %s\n", script, strerror(errno));
+		return 1;
+	}
+
 	initEditor();
 	detectTerminalType();
-	enableRawMode();
+	gridPaletteReset();	/* palette SGR strings depend on term_type */
+	if (!E.headless) enableRawMode();
 
 #ifndef _WIN32
+	editorInitWake();
 	struct sigaction sa;
 	sa.sa_handler = on_sigwinch;
 	sigemptyset(&sa.sa_mask);
@@ -8551,15 +10994,27 @@ int main(int argc, char *argv[]) {
 	signal(SIGPIPE, SIG_IGN);
 #endif
 
-	if (argc >= 2) {
+	if (file) {
+		E.splash_active = 0;
+		editorOpen(file);
+	}
+	if (replay) {
+		E.splash_active = 0;
+		editorToggleAI();
+	}
+	if (E.headless) {
+		/* scripted keys start on the whole file, not a partial load */
 		E.splash_active = 0;
-		editorOpen(argv[1]);
+		while (E.loading) {
+			editorWaitEvent(INPUT_POLL_MS);
+			editorLoaderPollAll();
+		}
 	}
 
 	editorSetStatusMessage("HAKO v%s | :help for commands", HAKO_VERSION);
 	while (1) {
 		editorRefreshScreen();
-		editorProcessKeyPress();
+		editorProcessInput();
 	}
 	return 0;
 }